@@ -1138,6 +1138,56 @@ flag= 0x%8x phy= 0x%8x vaddr= 0x%8x\n",
 	return 0;
 }
 
+static size_t ion_debug_client_heap_size(struct ion_client *client,
+					 struct ion_heap *heap)
+{
+	size_t size = 0;
+	struct rb_node *n;
+
+	mutex_lock(&client->lock);
+	for (n = rb_first(&client->handles); n; n = rb_next(n)) {
+		struct ion_handle *handle = rb_entry(n, struct ion_handle,
+						     node);
+		if (handle->buffer->heap == heap)
+			size += handle->buffer->size;
+	}
+	mutex_unlock(&client->lock);
+	return size;
+}
+
+/* must not be called with dev->lock held */
+void ion_debug_heap_clients(struct ion_heap *heap, struct seq_file *s)
+{
+	struct ion_device *dev = heap->dev;
+	struct ion_client *client;
+	struct rb_node *n;
+	char task_comm[TASK_COMM_LEN];
+	size_t size;
+
+	seq_printf(s, "%16.16s %16.16s %16.16s\n", "client", "pid", "size");
+	mutex_lock(&dev->lock);
+	for (n = rb_first(&dev->user_clients); n; n = rb_next(n)) {
+		client = rb_entry(n, struct ion_client, node);
+		size = ion_debug_client_heap_size(client, heap);
+		if (!size)
+			continue;
+
+		get_task_comm(task_comm, client->task);
+		seq_printf(s, "%16.16s %16u %16u\n", task_comm, client->pid,
+			   size);
+	}
+
+	for (n = rb_first(&dev->kernel_clients); n; n = rb_next(n)) {
+		client = rb_entry(n, struct ion_client, node);
+		size = ion_debug_client_heap_size(client, heap);
+		if (!size)
+			continue;
+		seq_printf(s, "%16.16s %16u %16u\n", client->name, client->pid,
+			   size);
+	}
+	mutex_unlock(&dev->lock);
+}
+
 static int ion_debug_heap_open(struct inode *inode, struct file *file)
 {
 	return single_open(file, ion_debug_heap_show, inode->i_private);
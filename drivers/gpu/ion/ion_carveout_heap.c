@@ -16,10 +16,11 @@
 #include <linux/spinlock.h>
 
 #include <linux/err.h>
-#include <linux/genalloc.h>
 #include <linux/io.h>
 #include <linux/ion.h>
 #include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/rbtree.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
@@ -27,28 +28,270 @@
 
 #include <asm/mach/map.h>
 
+/* how much of a buffer being relocated is mapped at a time */
+#define ION_CARVEOUT_COPY_CHUNK	(1 << 20)
+
+/*
+ * Every page of the carveout is either free or part of an allocated
+ * block in the `blocks' tree, so the free extents are the gaps in that
+ * tree. Allocations take the exact page aligned size from the lowest
+ * gap large enough to hold it.
+ *
+ * When an allocation fails although enough pages are free, buffers that
+ * nobody can know the address of -- never mapped to userspace, not
+ * mapped to the kernel and never passed to ion_phys -- are moved towards
+ * the start of the carveout and the allocation is retried.
+ */
 struct ion_carveout_heap {
 	struct ion_heap heap;
-	struct gen_pool *pool;
 	ion_phys_addr_t base;
+	unsigned long npages;
+	struct mutex lock;
+	unsigned long free_pages;
+	struct rb_root blocks;
+	unsigned long compactions;
+	unsigned long relocated;
+	unsigned long failed;
+};
+
+/*
+ * ion_carveout_block - an allocated range of the carveout
+ * @buffer:	the ion buffer it backs, NULL for ion_carveout_allocate users
+ * @pinned:	its address may be known outside of the heap, it can't move
+ * @kmap_cnt:	number of kernel mappings, it can't move while mapped
+ */
+struct ion_carveout_block {
+	struct rb_node node;
+	ion_phys_addr_t addr;
+	unsigned long size;
+	struct ion_buffer *buffer;
+	bool pinned;
+	int kmap_cnt;
 };
 
+/* Caller must hold ch->lock and have taken the range out of the tree. */
+static void carveout_free_range(struct ion_carveout_heap *ch,
+				unsigned long off, unsigned long nr)
+{
+	ch->free_pages += nr;
+}
+
+/*
+ * carveout_alloc_range - find nr free pages, returning the offset of the
+ * first one in the carveout, or -1 if no free extent is large enough
+ *
+ * The pages only become allocated once a block covering them is added
+ * to the tree, which the caller must do before dropping ch->lock or
+ * allocating again.
+ *
+ * Caller must hold ch->lock.
+ */
+static long carveout_alloc_range(struct ion_carveout_heap *ch,
+				 unsigned long nr)
+{
+	struct ion_carveout_block *block;
+	struct rb_node *n;
+	unsigned long end = 0, start;
+
+	if (nr > ch->free_pages)
+		return -1;
+
+	for (n = rb_first(&ch->blocks); n; n = rb_next(n)) {
+		block = rb_entry(n, struct ion_carveout_block, node);
+		start = (block->addr - ch->base) >> PAGE_SHIFT;
+		if (start - end >= nr)
+			break;
+		end = start + (block->size >> PAGE_SHIFT);
+	}
+	if (!n && ch->npages - end < nr)
+		return -1;
+
+	ch->free_pages -= nr;
+	return end;
+}
+
+static void carveout_block_insert(struct ion_carveout_heap *ch,
+				  struct ion_carveout_block *block)
+{
+	struct rb_node **p = &ch->blocks.rb_node;
+	struct rb_node *parent = NULL;
+	struct ion_carveout_block *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ion_carveout_block, node);
+		if (block->addr < entry->addr)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&block->node, parent, p);
+	rb_insert_color(&block->node, &ch->blocks);
+}
+
+static struct ion_carveout_block *carveout_block_find(
+					struct ion_carveout_heap *ch,
+					ion_phys_addr_t addr)
+{
+	struct rb_node *n = ch->blocks.rb_node;
+	struct ion_carveout_block *block;
+
+	while (n) {
+		block = rb_entry(n, struct ion_carveout_block, node);
+		if (addr < block->addr)
+			n = n->rb_left;
+		else if (addr > block->addr)
+			n = n->rb_right;
+		else
+			return block;
+	}
+	return NULL;
+}
+
+static int carveout_copy(ion_phys_addr_t dst, ion_phys_addr_t src,
+			 unsigned long size)
+{
+	unsigned long len;
+	void *d, *s;
+
+	while (size) {
+		len = min_t(unsigned long, size, ION_CARVEOUT_COPY_CHUNK);
+		d = __arch_ioremap(dst, len, MT_MEMORY_NONCACHED);
+		s = __arch_ioremap(src, len, MT_MEMORY_NONCACHED);
+		if (!d || !s) {
+			if (d)
+				__arch_iounmap(d);
+			if (s)
+				__arch_iounmap(s);
+			return -ENOMEM;
+		}
+		memcpy(d, s, len);
+		__arch_iounmap(s);
+		__arch_iounmap(d);
+		dst += len;
+		src += len;
+		size -= len;
+	}
+	return 0;
+}
+
+/*
+ * carveout_compact - move movable buffers down into free space below them,
+ * highest first, to coalesce the free space at the top of the carveout
+ *
+ * Caller must hold ch->lock.
+ */
+static void carveout_compact(struct ion_carveout_heap *ch)
+{
+	struct ion_carveout_block *block;
+	struct rb_node *n, *prev;
+	unsigned long nr;
+	ion_phys_addr_t addr;
+	long off;
+
+	ch->compactions++;
+	for (n = rb_last(&ch->blocks); n; n = prev) {
+		prev = rb_prev(n);
+		block = rb_entry(n, struct ion_carveout_block, node);
+		if (!block->buffer || block->pinned || block->kmap_cnt)
+			continue;
+
+		nr = block->size >> PAGE_SHIFT;
+		off = carveout_alloc_range(ch, nr);
+		if (off < 0)
+			continue;
+		addr = ch->base + (off << PAGE_SHIFT);
+		if (addr > block->addr || carveout_copy(addr, block->addr,
+							block->size)) {
+			carveout_free_range(ch, off, nr);
+			continue;
+		}
+
+		carveout_free_range(ch, (block->addr - ch->base) >> PAGE_SHIFT,
+				    nr);
+		rb_erase(&block->node, &ch->blocks);
+		block->addr = addr;
+		block->buffer->priv_phys = addr;
+		carveout_block_insert(ch, block);
+		ch->relocated++;
+	}
+}
+
+static ion_phys_addr_t carveout_allocate(struct ion_carveout_heap *ch,
+					 unsigned long size,
+					 struct ion_buffer *buffer)
+{
+	struct ion_carveout_block *block;
+	unsigned long nr = PAGE_ALIGN(size) >> PAGE_SHIFT;
+	long off;
+
+	if (!nr)
+		return ION_CARVEOUT_ALLOCATE_FAIL;
+
+	block = kzalloc(sizeof(struct ion_carveout_block), GFP_KERNEL);
+	if (!block)
+		return ION_CARVEOUT_ALLOCATE_FAIL;
+
+	mutex_lock(&ch->lock);
+	off = carveout_alloc_range(ch, nr);
+	if (off < 0 && ch->free_pages >= nr) {
+		carveout_compact(ch);
+		off = carveout_alloc_range(ch, nr);
+	}
+	if (off < 0) {
+		ch->failed++;
+		mutex_unlock(&ch->lock);
+		kfree(block);
+		return ION_CARVEOUT_ALLOCATE_FAIL;
+	}
+
+	block->addr = ch->base + (off << PAGE_SHIFT);
+	block->size = nr << PAGE_SHIFT;
+	block->buffer = buffer;
+	carveout_block_insert(ch, block);
+	mutex_unlock(&ch->lock);
+
+	return block->addr;
+}
+
 ion_phys_addr_t ion_carveout_allocate(struct ion_heap *heap,
 				      unsigned long size,
 				      unsigned long align)
 {
 	struct ion_carveout_heap *carveout_heap =
 		container_of(heap, struct ion_carveout_heap, heap);
-	unsigned long offset = gen_pool_alloc(carveout_heap->pool, size);
+	ion_phys_addr_t offset = carveout_allocate(carveout_heap, size, NULL);
 
-	printk("ion: malloc: size=%08x, pool=%08x, offset=%08x \n", size, carveout_heap->pool, offset);
-
-	if (!offset)
-		return ION_CARVEOUT_ALLOCATE_FAIL;
+	printk("ion: malloc: size=%08lx, base=%08lx, offset=%08lx \n", size,
+	       carveout_heap->base, offset);
 
 	return offset;
 }
 
+/*
+ * carveout_free - free the block at addr, or the one backing buffer if
+ * given: its address can only be read under the lock, it may be moving
+ */
+static void carveout_free(struct ion_carveout_heap *ch, ion_phys_addr_t addr,
+			  struct ion_buffer *buffer)
+{
+	struct ion_carveout_block *block;
+
+	mutex_lock(&ch->lock);
+	if (buffer)
+		addr = buffer->priv_phys;
+	block = carveout_block_find(ch, addr);
+	if (WARN_ON(!block)) {
+		mutex_unlock(&ch->lock);
+		return;
+	}
+	rb_erase(&block->node, &ch->blocks);
+	carveout_free_range(ch, (block->addr - ch->base) >> PAGE_SHIFT,
+			    block->size >> PAGE_SHIFT);
+	mutex_unlock(&ch->lock);
+	kfree(block);
+}
+
 void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 		       unsigned long size)
 {
@@ -58,16 +301,43 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
 	if (addr == ION_CARVEOUT_ALLOCATE_FAIL)
 		return;
 
-	printk("ion: free  : size=%08x, pool=%08x, offset=%08x \n", size, carveout_heap->pool, addr);
-	
-	gen_pool_free(carveout_heap->pool, addr, size);
+	printk("ion: free  : size=%08lx, base=%08lx, offset=%08lx \n", size,
+	       carveout_heap->base, addr);
+
+	carveout_free(carveout_heap, addr, NULL);
+}
+
+/*
+ * ion_carveout_pin - look up the block backing a buffer, marking it as
+ * unmovable, and return its current address
+ */
+static ion_phys_addr_t ion_carveout_pin(struct ion_heap *heap,
+					struct ion_buffer *buffer,
+					bool kmap)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_block *block;
+	ion_phys_addr_t addr;
+
+	mutex_lock(&carveout_heap->lock);
+	addr = buffer->priv_phys;
+	block = carveout_block_find(carveout_heap, addr);
+	if (block) {
+		if (kmap)
+			block->kmap_cnt++;
+		else
+			block->pinned = true;
+	}
+	mutex_unlock(&carveout_heap->lock);
+	return addr;
 }
 
 static int ion_carveout_heap_phys(struct ion_heap *heap,
 				  struct ion_buffer *buffer,
 				  ion_phys_addr_t *addr, size_t *len)
 {
-	*addr = buffer->priv_phys;
+	*addr = ion_carveout_pin(heap, buffer, false);
 	*len = buffer->size;
 	return 0;
 }
@@ -77,7 +347,10 @@ static int ion_carveout_heap_allocate(struct ion_heap *heap,
 				      unsigned long size, unsigned long align,
 				      unsigned long flags)
 {
-	buffer->priv_phys = ion_carveout_allocate(heap, size, align);
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+
+	buffer->priv_phys = carveout_allocate(carveout_heap, size, buffer);
 	printk(KERN_INFO "pgprot_noncached flags 0x%x\n",flags);
 	if(flags&(1<<31))
 		buffer->flags |= (1<<31); 
@@ -89,9 +362,10 @@ static int ion_carveout_heap_allocate(struct ion_heap *heap,
 
 static void ion_carveout_heap_free(struct ion_buffer *buffer)
 {
-	struct ion_heap *heap = buffer->heap;
+	struct ion_carveout_heap *carveout_heap =
+		container_of(buffer->heap, struct ion_carveout_heap, heap);
 
-	ion_carveout_free(heap, buffer->priv_phys, buffer->size);
+	carveout_free(carveout_heap, 0, buffer);
 	buffer->priv_phys = ION_CARVEOUT_ALLOCATE_FAIL;
 }
 
@@ -110,21 +384,46 @@ void ion_carveout_heap_unmap_dma(struct ion_heap *heap,
 void *ion_carveout_heap_map_kernel(struct ion_heap *heap,
 				   struct ion_buffer *buffer)
 {
-	return __arch_ioremap(buffer->priv_phys, buffer->size,
-			      MT_MEMORY_NONCACHED);
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_block *block;
+	void *vaddr;
+
+	vaddr = __arch_ioremap(ion_carveout_pin(heap, buffer, true),
+			       buffer->size, MT_MEMORY_NONCACHED);
+	if (!vaddr) {
+		mutex_lock(&carveout_heap->lock);
+		block = carveout_block_find(carveout_heap, buffer->priv_phys);
+		if (block)
+			block->kmap_cnt--;
+		mutex_unlock(&carveout_heap->lock);
+	}
+	return vaddr;
 }
 
 void ion_carveout_heap_unmap_kernel(struct ion_heap *heap,
 				    struct ion_buffer *buffer)
 {
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_block *block;
+
 	__arch_iounmap(buffer->vaddr);
 	buffer->vaddr = NULL;
+
+	mutex_lock(&carveout_heap->lock);
+	block = carveout_block_find(carveout_heap, buffer->priv_phys);
+	if (block)
+		block->kmap_cnt--;
+	mutex_unlock(&carveout_heap->lock);
 	return;
 }
 
 int ion_carveout_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			       struct vm_area_struct *vma)
 {
+	ion_carveout_pin(heap, buffer, false);
+
 	if((buffer->flags & (1<<31)) )
 	{	
 		printk(KERN_INFO "pgprot_cached buffer->flags 0x%x\n",buffer->flags);
@@ -154,6 +453,39 @@ static struct ion_heap_ops carveout_heap_ops = {
 	.unmap_kernel = ion_carveout_heap_unmap_kernel,
 };
 
+void ion_carveout_heap_stats(struct ion_heap *heap,
+			     struct ion_carveout_stats *stats)
+{
+	struct ion_carveout_heap *carveout_heap =
+		container_of(heap, struct ion_carveout_heap, heap);
+	struct ion_carveout_block *block;
+	struct rb_node *n;
+	ion_phys_addr_t end = carveout_heap->base;
+	unsigned long gap;
+
+	memset(stats, 0, sizeof(*stats));
+
+	mutex_lock(&carveout_heap->lock);
+	stats->total = carveout_heap->npages << PAGE_SHIFT;
+	stats->free = carveout_heap->free_pages << PAGE_SHIFT;
+	for (n = rb_first(&carveout_heap->blocks); n; n = rb_next(n)) {
+		block = rb_entry(n, struct ion_carveout_block, node);
+		gap = block->addr - end;
+		stats->largest_free = max(stats->largest_free, gap);
+		end = block->addr + block->size;
+
+		stats->blocks++;
+		if (block->buffer && !block->pinned && !block->kmap_cnt)
+			stats->movable++;
+	}
+	gap = carveout_heap->base + stats->total - end;
+	stats->largest_free = max(stats->largest_free, gap);
+	stats->compactions = carveout_heap->compactions;
+	stats->relocated = carveout_heap->relocated;
+	stats->failed = carveout_heap->failed;
+	mutex_unlock(&carveout_heap->lock);
+}
+
 struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
 {
 	struct ion_carveout_heap *carveout_heap;
@@ -162,14 +494,16 @@ struct ion_heap *ion_carveout_heap_create(struct ion_platform_heap *heap_data)
 	if (!carveout_heap)
 		return ERR_PTR(-ENOMEM);
 
-	carveout_heap->pool = gen_pool_create(12, -1);
-	if (!carveout_heap->pool) {
+	carveout_heap->base = heap_data->base;
+	carveout_heap->npages = heap_data->size >> PAGE_SHIFT;
+	if (!carveout_heap->npages) {
 		kfree(carveout_heap);
-		return ERR_PTR(-ENOMEM);
+		return ERR_PTR(-EINVAL);
 	}
-	carveout_heap->base = heap_data->base;
-	gen_pool_add(carveout_heap->pool, carveout_heap->base, heap_data->size,
-		     -1);
+	mutex_init(&carveout_heap->lock);
+	carveout_heap->blocks = RB_ROOT;
+	carveout_free_range(carveout_heap, 0, carveout_heap->npages);
+
 	carveout_heap->heap.ops = &carveout_heap_ops;
 	carveout_heap->heap.type = ION_HEAP_TYPE_CARVEOUT;
 
@@ -180,8 +514,12 @@ void ion_carveout_heap_destroy(struct ion_heap *heap)
 {
 	struct ion_carveout_heap *carveout_heap =
 	     container_of(heap, struct  ion_carveout_heap, heap);
+	struct rb_node *n;
 
-	gen_pool_destroy(carveout_heap->pool);
+	while ((n = rb_first(&carveout_heap->blocks))) {
+		rb_erase(n, &carveout_heap->blocks);
+		kfree(rb_entry(n, struct ion_carveout_block, node));
+	}
 	kfree(carveout_heap);
 	carveout_heap = NULL;
 }
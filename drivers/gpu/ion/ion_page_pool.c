@@ -0,0 +1,246 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/err.h>
+#include <linux/highmem.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+/* memory kept zeroed and ready in each pool by the refill worker */
+#define ION_PAGE_POOL_FILL	(1 << 20)
+/* total memory a pool may cache before freed pages go back to the system */
+#define ION_PAGE_POOL_LIMIT	(4 << 20)
+
+/*
+ * Pages handed out by a pool are always zeroed. Freed pages are queued
+ * on the dirty list and cleared by a worker off the allocation path,
+ * which also tops the clean list back up from the page allocator.
+ */
+struct ion_page_pool {
+	int clean_count;
+	int dirty_count;
+	struct list_head clean_items;
+	struct list_head dirty_items;
+	struct mutex mutex;
+	gfp_t gfp_mask;
+	unsigned int order;
+	int fill;			/* clean pages to keep in reserve */
+	int limit;			/* pages to cache in total */
+	unsigned long shrunk;		/* jiffies of the last shrink */
+	struct work_struct refill_work;
+};
+
+static void ion_page_pool_zero(struct ion_page_pool *pool, struct page *page)
+{
+	int i;
+
+	for (i = 0; i < (1 << pool->order); i++)
+		clear_highpage(page + i);
+}
+
+static void ion_page_pool_add_clean(struct ion_page_pool *pool,
+				    struct page *page)
+{
+	mutex_lock(&pool->mutex);
+	list_add_tail(&page->lru, &pool->clean_items);
+	pool->clean_count++;
+	mutex_unlock(&pool->mutex);
+}
+
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool,
+					 bool dirty)
+{
+	struct list_head *items = dirty ? &pool->dirty_items :
+					  &pool->clean_items;
+	struct page *page;
+
+	if (list_empty(items))
+		return NULL;
+
+	page = list_first_entry(items, struct page, lru);
+	list_del(&page->lru);
+	if (dirty)
+		pool->dirty_count--;
+	else
+		pool->clean_count--;
+	return page;
+}
+
+static bool ion_page_pool_needs_refill(struct ion_page_pool *pool)
+{
+	return pool->dirty_count ||
+	       (pool->clean_count < pool->fill &&
+		time_after(jiffies, pool->shrunk + HZ));
+}
+
+static void ion_page_pool_refill(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  refill_work);
+	struct page *page;
+
+	/* recycle freed pages first, they cost no trip to the allocator */
+	for (;;) {
+		mutex_lock(&pool->mutex);
+		page = ion_page_pool_remove(pool, true);
+		mutex_unlock(&pool->mutex);
+		if (!page)
+			break;
+		ion_page_pool_zero(pool, page);
+		ion_page_pool_add_clean(pool, page);
+	}
+
+	/*
+	 * Don't refill straight after the shrinker emptied the pool, or
+	 * we would just be handing the memory back and forth.
+	 */
+	for (;;) {
+		mutex_lock(&pool->mutex);
+		if (pool->clean_count >= pool->fill ||
+		    !time_after(jiffies, pool->shrunk + HZ)) {
+			mutex_unlock(&pool->mutex);
+			break;
+		}
+		mutex_unlock(&pool->mutex);
+
+		page = alloc_pages(pool->gfp_mask | __GFP_ZERO, pool->order);
+		if (!page)
+			break;
+		ion_page_pool_add_clean(pool, page);
+	}
+}
+
+/**
+ * ion_page_pool_alloc - get a zeroed chunk of 1 << order pages
+ *
+ * Falls back to clearing a freed chunk inline, then to the page
+ * allocator. High order chunks are not worth reclaim or compaction
+ * here: the caller would rather build the buffer from smaller ones.
+ */
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page;
+	bool dirty = false;
+	bool refill;
+	gfp_t gfp_mask = pool->gfp_mask;
+
+	mutex_lock(&pool->mutex);
+	page = ion_page_pool_remove(pool, false);
+	if (!page) {
+		page = ion_page_pool_remove(pool, true);
+		dirty = true;
+	}
+	refill = ion_page_pool_needs_refill(pool);
+	mutex_unlock(&pool->mutex);
+
+	if (refill)
+		queue_work(system_unbound_wq, &pool->refill_work);
+
+	if (page) {
+		if (dirty)
+			ion_page_pool_zero(pool, page);
+		return page;
+	}
+
+	if (pool->order)
+		gfp_mask &= ~__GFP_WAIT;
+	return alloc_pages(gfp_mask | __GFP_ZERO, pool->order);
+}
+
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	bool cached = false;
+
+	mutex_lock(&pool->mutex);
+	if (pool->clean_count + pool->dirty_count < pool->limit) {
+		list_add_tail(&page->lru, &pool->dirty_items);
+		pool->dirty_count++;
+		cached = true;
+	}
+	mutex_unlock(&pool->mutex);
+
+	if (cached)
+		queue_work(system_unbound_wq, &pool->refill_work);
+	else
+		__free_pages(page, pool->order);
+}
+
+/**
+ * ion_page_pool_shrink - release cached pages back to the system
+ * @nr_to_scan:		number of 0-order pages to free, 0 to only query
+ *
+ * Returns the number of 0-order pages still cached.
+ */
+int ion_page_pool_shrink(struct ion_page_pool *pool, int nr_to_scan)
+{
+	struct page *page;
+	int count;
+
+	mutex_lock(&pool->mutex);
+	if (nr_to_scan)
+		pool->shrunk = jiffies;
+	while (nr_to_scan > 0) {
+		page = ion_page_pool_remove(pool, true);
+		if (!page)
+			page = ion_page_pool_remove(pool, false);
+		if (!page)
+			break;
+		__free_pages(page, pool->order);
+		nr_to_scan -= 1 << pool->order;
+	}
+	count = (pool->clean_count + pool->dirty_count) << pool->order;
+	mutex_unlock(&pool->mutex);
+
+	return count;
+}
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order)
+{
+	struct ion_page_pool *pool;
+
+	pool = kzalloc(sizeof(struct ion_page_pool), GFP_KERNEL);
+	if (!pool)
+		return ERR_PTR(-ENOMEM);
+
+	INIT_LIST_HEAD(&pool->clean_items);
+	INIT_LIST_HEAD(&pool->dirty_items);
+	mutex_init(&pool->mutex);
+	INIT_WORK(&pool->refill_work, ion_page_pool_refill);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	pool->fill = max((ION_PAGE_POOL_FILL >> PAGE_SHIFT) >> order, 1);
+	pool->limit = max((ION_PAGE_POOL_LIMIT >> PAGE_SHIFT) >> order, 1);
+	pool->shrunk = jiffies - HZ - 1;
+
+	queue_work(system_unbound_wq, &pool->refill_work);
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	struct page *page;
+
+	cancel_work_sync(&pool->refill_work);
+	while ((page = ion_page_pool_remove(pool, true)) ||
+	       (page = ion_page_pool_remove(pool, false)))
+		__free_pages(page, pool->order);
+	kfree(pool);
+}
@@ -181,4 +181,49 @@ void ion_carveout_free(struct ion_heap *heap, ion_phys_addr_t addr,
  */
 #define ION_CARVEOUT_ALLOCATE_FAIL -1
 
+/**
+ * struct ion_carveout_stats - state of a carveout heap, for debugging
+ * @total:		size of the carveout
+ * @free:		bytes free
+ * @largest_free:	largest physically contiguous free extent
+ * @blocks:		number of allocations
+ * @movable:		allocations that may be relocated to defragment
+ * @compactions:	times an allocation failed for fragmentation and
+ *			movable buffers were relocated
+ * @relocated:		buffers moved by those relocations
+ * @failed:		allocations that failed
+ */
+struct ion_carveout_stats {
+	unsigned long total;
+	unsigned long free;
+	unsigned long largest_free;
+	unsigned long blocks;
+	unsigned long movable;
+	unsigned long compactions;
+	unsigned long relocated;
+	unsigned long failed;
+};
+
+void ion_carveout_heap_stats(struct ion_heap *heap,
+			     struct ion_carveout_stats *stats);
+
+struct seq_file;
+/**
+ * ion_debug_heap_clients - print how much of a heap each client holds
+ */
+void ion_debug_heap_clients(struct ion_heap *heap, struct seq_file *s);
+
+/**
+ * page pools -- caches of zeroed 1 << order page chunks, used by the
+ * system heap to avoid the page allocator and page clearing on the
+ * allocation path
+ */
+struct ion_page_pool;
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+int ion_page_pool_shrink(struct ion_page_pool *, int nr_to_scan);
+
 #endif /* _ION_PRIV_H */
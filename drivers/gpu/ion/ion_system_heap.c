@@ -22,48 +22,156 @@
 #include <linux/vmalloc.h>
 #include "ion_priv.h"
 
+/*
+ * Buffers are built from the largest chunks that fit, so that a big
+ * gralloc buffer takes a handful of 1M chunks rather than thousands of
+ * single pages. Each order has its own pool of zeroed chunks.
+ */
+static unsigned int orders[] = {8, 4, 0};
+#define NUM_ORDERS ARRAY_SIZE(orders)
+
+static gfp_t high_order_gfp_flags = GFP_HIGHUSER | __GFP_NOWARN |
+				    __GFP_NORETRY | __GFP_NO_KSWAPD;
+static gfp_t low_order_gfp_flags = GFP_HIGHUSER | __GFP_NOWARN;
+
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool *pools[NUM_ORDERS];
+	struct shrinker shrinker;
+};
+
+struct ion_system_chunk {
+	struct list_head list;
+	struct page *page;
+	unsigned int order;
+};
+
+/* what priv_virt points to for a system heap buffer */
+struct ion_system_buffer {
+	struct list_head chunks;
+	int nchunks;
+};
+
+static int order_to_index(unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		if (order == orders[i])
+			return i;
+	BUG();
+	return -1;
+}
+
+static struct ion_system_chunk *alloc_largest_available(
+					struct ion_system_heap *sys_heap,
+					unsigned long size,
+					unsigned int max_order)
+{
+	struct ion_system_chunk *chunk;
+	struct page *page;
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		if (size < (PAGE_SIZE << orders[i]))
+			continue;
+		if (max_order < orders[i])
+			continue;
+
+		page = ion_page_pool_alloc(sys_heap->pools[i]);
+		if (!page)
+			continue;
+
+		chunk = kmalloc(sizeof(struct ion_system_chunk), GFP_KERNEL);
+		if (!chunk) {
+			ion_page_pool_free(sys_heap->pools[i], page);
+			return NULL;
+		}
+		chunk->page = page;
+		chunk->order = orders[i];
+		return chunk;
+	}
+	return NULL;
+}
+
+static void ion_system_heap_free_chunks(struct ion_system_heap *sys_heap,
+					struct ion_system_buffer *buf)
+{
+	struct ion_system_chunk *chunk, *tmp;
+
+	list_for_each_entry_safe(chunk, tmp, &buf->chunks, list) {
+		ion_page_pool_free(sys_heap->pools[order_to_index(chunk->order)],
+				   chunk->page);
+		list_del(&chunk->list);
+		kfree(chunk);
+	}
+	kfree(buf);
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
 				     unsigned long flags)
 {
-	buffer->priv_virt = vmalloc_user(size);
-	if (!buffer->priv_virt)
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	struct ion_system_buffer *buf;
+	struct ion_system_chunk *chunk;
+	long size_remaining = PAGE_ALIGN(size);
+	unsigned int max_order = orders[0];
+
+	buf = kmalloc(sizeof(struct ion_system_buffer), GFP_KERNEL);
+	if (!buf)
 		return -ENOMEM;
+	INIT_LIST_HEAD(&buf->chunks);
+	buf->nchunks = 0;
+
+	while (size_remaining > 0) {
+		chunk = alloc_largest_available(sys_heap, size_remaining,
+						max_order);
+		if (!chunk) {
+			ion_system_heap_free_chunks(sys_heap, buf);
+			return -ENOMEM;
+		}
+		list_add_tail(&chunk->list, &buf->chunks);
+		buf->nchunks++;
+		size_remaining -= PAGE_SIZE << chunk->order;
+		max_order = chunk->order;
+	}
+
+	buffer->priv_virt = buf;
 	return 0;
 }
 
 void ion_system_heap_free(struct ion_buffer *buffer)
 {
-	vfree(buffer->priv_virt);
+	struct ion_system_heap *sys_heap = container_of(buffer->heap,
+							struct ion_system_heap,
+							heap);
+
+	ion_system_heap_free_chunks(sys_heap, buffer->priv_virt);
 }
 
 struct scatterlist *ion_system_heap_map_dma(struct ion_heap *heap,
 					    struct ion_buffer *buffer)
 {
-	struct scatterlist *sglist;
-	struct page *page;
-	int i;
-	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	void *vaddr = buffer->priv_virt;
+	struct ion_system_buffer *buf = buffer->priv_virt;
+	struct ion_system_chunk *chunk;
+	struct scatterlist *sglist, *sg;
 
-	sglist = vmalloc(npages * sizeof(struct scatterlist));
+	sglist = vmalloc(buf->nchunks * sizeof(struct scatterlist));
 	if (!sglist)
 		return ERR_PTR(-ENOMEM);
-	memset(sglist, 0, npages * sizeof(struct scatterlist));
-	sg_init_table(sglist, npages);
-	for (i = 0; i < npages; i++) {
-		page = vmalloc_to_page(vaddr);
-		if (!page)
-			goto end;
-		sg_set_page(&sglist[i], page, PAGE_SIZE, 0);
-		vaddr += PAGE_SIZE;
+	memset(sglist, 0, buf->nchunks * sizeof(struct scatterlist));
+	sg_init_table(sglist, buf->nchunks);
+	sg = sglist;
+	list_for_each_entry(chunk, &buf->chunks, list) {
+		sg_set_page(sg, chunk->page, PAGE_SIZE << chunk->order, 0);
+		sg = sg_next(sg);
 	}
 	/* XXX do cache maintenance for dma? */
 	return sglist;
-end:
-	vfree(sglist);
-	return NULL;
 }
 
 void ion_system_heap_unmap_dma(struct ion_heap *heap,
@@ -77,18 +185,61 @@ void ion_system_heap_unmap_dma(struct ion_heap *heap,
 void *ion_system_heap_map_kernel(struct ion_heap *heap,
 				 struct ion_buffer *buffer)
 {
-	return buffer->priv_virt;
+	struct ion_system_buffer *buf = buffer->priv_virt;
+	struct ion_system_chunk *chunk;
+	struct page **pages, **tmp;
+	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
+	void *vaddr;
+	int i;
+
+	pages = vmalloc(npages * sizeof(struct page *));
+	if (!pages)
+		return NULL;
+	tmp = pages;
+	list_for_each_entry(chunk, &buf->chunks, list)
+		for (i = 0; i < (1 << chunk->order); i++)
+			*(tmp++) = chunk->page + i;
+
+	vaddr = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	vfree(pages);
+	return vaddr;
 }
 
 void ion_system_heap_unmap_kernel(struct ion_heap *heap,
 				  struct ion_buffer *buffer)
 {
+	vunmap(buffer->vaddr);
 }
 
 int ion_system_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			     struct vm_area_struct *vma)
 {
-	return remap_vmalloc_range(vma, buffer->priv_virt, vma->vm_pgoff);
+	struct ion_system_buffer *buf = buffer->priv_virt;
+	struct ion_system_chunk *chunk;
+	unsigned long addr = vma->vm_start;
+	unsigned long offset = vma->vm_pgoff;
+	unsigned long npages, len;
+	int ret;
+
+	list_for_each_entry(chunk, &buf->chunks, list) {
+		npages = 1 << chunk->order;
+		if (offset >= npages) {
+			offset -= npages;
+			continue;
+		}
+		len = min((npages - offset) << PAGE_SHIFT,
+			  vma->vm_end - addr);
+		ret = remap_pfn_range(vma, addr,
+				      page_to_pfn(chunk->page) + offset,
+				      len, vma->vm_page_prot);
+		if (ret)
+			return ret;
+		addr += len;
+		offset = 0;
+		if (addr >= vma->vm_end)
+			break;
+	}
+	return 0;
 }
 
 static struct ion_heap_ops vmalloc_ops = {
@@ -101,21 +252,74 @@ static struct ion_heap_ops vmalloc_ops = {
 	.map_user = ion_system_heap_map_user,
 };
 
+static int ion_system_heap_shrink(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct ion_system_heap *sys_heap = container_of(shrinker,
+							struct ion_system_heap,
+							shrinker);
+	int nr_to_scan = sc->nr_to_scan;
+	int nr_total = 0;
+	int nr_freed, nr_left;
+	int i;
+
+	/* shrink the small pools first, high order chunks are precious */
+	for (i = NUM_ORDERS - 1; i >= 0; i--) {
+		nr_left = ion_page_pool_shrink(sys_heap->pools[i], 0);
+		if (nr_to_scan > 0) {
+			nr_freed = nr_left;
+			nr_left = ion_page_pool_shrink(sys_heap->pools[i],
+						       nr_to_scan);
+			nr_to_scan -= nr_freed - nr_left;
+		}
+		nr_total += nr_left;
+	}
+	return nr_total;
+}
+
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *sys_heap;
+	gfp_t gfp_flags;
+	int i;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
-	if (!heap)
+	sys_heap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
+	if (!sys_heap)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
-	return heap;
+	sys_heap->heap.ops = &vmalloc_ops;
+	sys_heap->heap.type = ION_HEAP_TYPE_SYSTEM;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		gfp_flags = orders[i] ? high_order_gfp_flags :
+					low_order_gfp_flags;
+		sys_heap->pools[i] = ion_page_pool_create(gfp_flags, orders[i]);
+		if (IS_ERR(sys_heap->pools[i]))
+			goto err_create_pool;
+	}
+
+	sys_heap->shrinker.shrink = ion_system_heap_shrink;
+	sys_heap->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&sys_heap->shrinker);
+	return &sys_heap->heap;
+
+err_create_pool:
+	while (--i >= 0)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap);
+	return ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sys_heap = container_of(heap,
+							struct ion_system_heap,
+							heap);
+	int i;
+
+	unregister_shrinker(&sys_heap->shrinker);
+	for (i = 0; i < NUM_ORDERS; i++)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -157,6 +361,17 @@ struct scatterlist *ion_system_contig_heap_map_dma(struct ion_heap *heap,
 	return sglist;
 }
 
+void *ion_system_contig_heap_map_kernel(struct ion_heap *heap,
+					struct ion_buffer *buffer)
+{
+	return buffer->priv_virt;
+}
+
+void ion_system_contig_heap_unmap_kernel(struct ion_heap *heap,
+					 struct ion_buffer *buffer)
+{
+}
+
 int ion_system_contig_heap_map_user(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    struct vm_area_struct *vma)
@@ -174,8 +389,8 @@ static struct ion_heap_ops kmalloc_ops = {
 	.phys = ion_system_contig_heap_phys,
 	.map_dma = ion_system_contig_heap_map_dma,
 	.unmap_dma = ion_system_heap_unmap_dma,
-	.map_kernel = ion_system_heap_map_kernel,
-	.unmap_kernel = ion_system_heap_unmap_kernel,
+	.map_kernel = ion_system_contig_heap_map_kernel,
+	.unmap_kernel = ion_system_contig_heap_unmap_kernel,
 	.map_user = ion_system_contig_heap_map_user,
 };
 
@@ -11,9 +11,11 @@
  * GNU General Public License for more details.
  */
 
+#include <linux/debugfs.h>
 #include <linux/err.h>
 #include <linux/ion.h>
 #include <linux/platform_device.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
 #include <video/ion_sprd.h>
@@ -24,7 +26,57 @@
 struct ion_device *idev;
 int num_heaps;
 struct ion_heap **heaps;
+static struct dentry *sprd_ion_debug_root;
 
+/*
+ * Per heap usage, by client, and for carveouts how fragmented the free
+ * space is: an allocation can fail once it is larger than largest_free
+ * even if free is well above it.
+ */
+static int sprd_ion_debug_heap_show(struct seq_file *s, void *unused)
+{
+	struct ion_heap *heap = s->private;
+	struct ion_carveout_stats stats;
+
+	ion_debug_heap_clients(heap, s);
+
+	if (heap->type != ION_HEAP_TYPE_CARVEOUT)
+		return 0;
+
+	ion_carveout_heap_stats(heap, &stats);
+	seq_printf(s, "\n");
+	seq_printf(s, "total:        %8lu kB\n", stats.total >> 10);
+	seq_printf(s, "free:         %8lu kB\n", stats.free >> 10);
+	seq_printf(s, "largest_free: %8lu kB\n", stats.largest_free >> 10);
+	seq_printf(s, "buffers:      %8lu\n", stats.blocks);
+	seq_printf(s, "movable:      %8lu\n", stats.movable);
+	seq_printf(s, "compactions:  %8lu\n", stats.compactions);
+	seq_printf(s, "relocated:    %8lu\n", stats.relocated);
+	seq_printf(s, "failed:       %8lu\n", stats.failed);
+	return 0;
+}
+
+static int sprd_ion_debug_heap_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sprd_ion_debug_heap_show, inode->i_private);
+}
+
+static const struct file_operations sprd_ion_debug_heap_fops = {
+	.open = sprd_ion_debug_heap_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+
+/* Client for in-kernel users of the sprd heaps */
+struct ion_client *sprd_ion_client_create(const char *name)
+{
+	if (!idev)
+		return ERR_PTR(-ENODEV);
+	return ion_client_create(idev, -1, name);
+}
+EXPORT_SYMBOL(sprd_ion_client_create);
 
 static long sprd_heap_ioctl(struct ion_client *client, unsigned int cmd,
 				unsigned long arg)
@@ -114,6 +166,10 @@ int sprd_ion_probe(struct platform_device *pdev)
 		return PTR_ERR(idev);
 	}
 
+	sprd_ion_debug_root = debugfs_create_dir("sprd_ion", NULL);
+	if (IS_ERR_OR_NULL(sprd_ion_debug_root))
+		pr_err("ion: failed to create sprd debug files.\n");
+
 	/* create the heaps as specified in the board file */
 	for (i = 0; i < num_heaps; i++) {
 		struct ion_platform_heap *heap_data = &pdata->heaps[i];
@@ -124,10 +180,15 @@ int sprd_ion_probe(struct platform_device *pdev)
 			goto err;
 		}
 		ion_device_add_heap(idev, heaps[i]);
+		if (!IS_ERR_OR_NULL(sprd_ion_debug_root))
+			debugfs_create_file(heaps[i]->name, 0444,
+					    sprd_ion_debug_root, heaps[i],
+					    &sprd_ion_debug_heap_fops);
 	}
 	platform_set_drvdata(pdev, idev);
 	return 0;
 err:
+	debugfs_remove_recursive(sprd_ion_debug_root);
 	for (i = 0; i < num_heaps; i++) {
 		if (heaps[i])
 			ion_heap_destroy(heaps[i]);
@@ -141,6 +202,7 @@ int sprd_ion_remove(struct platform_device *pdev)
 	struct ion_device *idev = platform_get_drvdata(pdev);
 	int i;
 
+	debugfs_remove_recursive(sprd_ion_debug_root);
 	ion_device_destroy(idev);
 	for (i = 0; i < num_heaps; i++)
 		ion_heap_destroy(heaps[i]);
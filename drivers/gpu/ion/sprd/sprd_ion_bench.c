@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2012 Spreadtrum Communications Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Allocation latency benchmark for the ion heaps. Allocates <count>
+ * buffers of <size> bytes from heap <id>, frees them, then does the same
+ * again, so that the second pass shows what recycling freed memory buys
+ * (e.g. the system heap page pools). Usage:
+ *
+ *   echo "<heap id> <size> <count>" > /sys/kernel/debug/ion_bench
+ *   cat /sys/kernel/debug/ion_bench
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/err.h>
+#include <linux/ion.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <video/ion_sprd.h>
+
+#define IBENCH_MAX_COUNT	4096
+
+struct ibench {
+	struct mutex		lock;
+
+	/* current run */
+	uint32_t		size;
+	uint32_t		count;
+	struct ion_handle	**handles;
+	uint32_t		*lat;		/* ns per call */
+
+	/* last result */
+	char			result[512];
+	int			len;
+};
+
+static struct ibench ibench;
+static struct dentry *ibench_dentry;
+
+static inline u64 ibench_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static int ibench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void ibench_report(const char *pass, uint32_t n)
+{
+	if (n) {
+		sort(ibench.lat, n, sizeof(uint32_t), ibench_cmp, NULL);
+	}
+
+	ibench.len += scnprintf(ibench.result + ibench.len,
+		sizeof(ibench.result) - ibench.len,
+		"%-10s n %5u, latency (us): p50 %u, p90 %u, p99 %u, max %u\n",
+		pass, n,
+		n ? ibench.lat[n / 2] / 1000 : 0,
+		n ? ibench.lat[n * 9 / 10] / 1000 : 0,
+		n ? ibench.lat[n * 99 / 100] / 1000 : 0,
+		n ? ibench.lat[n - 1] / 1000 : 0);
+}
+
+/* returns the number of buffers allocated */
+static uint32_t ibench_alloc(struct ion_client *client, unsigned int heap_id,
+		const char *pass)
+{
+	struct ion_handle *handle;
+	uint32_t i;
+	u64 start;
+
+	for (i = 0; i < ibench.count; i++) {
+		start = ibench_now();
+		handle = ion_alloc(client, ibench.size, PAGE_SIZE,
+				1 << heap_id);
+		ibench.lat[i] = (uint32_t)min_t(u64, ibench_now() - start,
+				UINT_MAX);
+		if (IS_ERR_OR_NULL(handle)) {
+			break;
+		}
+		ibench.handles[i] = handle;
+	}
+
+	ibench_report(pass, i);
+	return i;
+}
+
+static void ibench_free(struct ion_client *client, uint32_t n)
+{
+	uint32_t i;
+	u64 start;
+
+	for (i = 0; i < n; i++) {
+		start = ibench_now();
+		ion_free(client, ibench.handles[i]);
+		ibench.lat[i] = (uint32_t)min_t(u64, ibench_now() - start,
+				UINT_MAX);
+	}
+
+	ibench_report("free", n);
+}
+
+static int ibench_run(unsigned int heap_id, uint32_t size, uint32_t count)
+{
+	struct ion_client *client;
+	uint32_t n;
+	int rval = 0;
+
+	if (heap_id >= 32 || !size || !count || count > IBENCH_MAX_COUNT) {
+		return -EINVAL;
+	}
+
+	client = sprd_ion_client_create("ion_bench");
+	if (IS_ERR_OR_NULL(client)) {
+		return client ? PTR_ERR(client) : -ENODEV;
+	}
+
+	mutex_lock(&ibench.lock);
+
+	ibench.handles = vmalloc(sizeof(*ibench.handles) * count);
+	ibench.lat = vmalloc(sizeof(uint32_t) * count);
+	if (!ibench.handles || !ibench.lat) {
+		rval = -ENOMEM;
+		goto out;
+	}
+	ibench.size = PAGE_ALIGN(size);
+	ibench.count = count;
+
+	ibench.len = scnprintf(ibench.result, sizeof(ibench.result),
+		"heap: %u, size: %u, count: %u\n", heap_id, ibench.size, count);
+
+	n = ibench_alloc(client, heap_id, "alloc");
+	ibench_free(client, n);
+	if (n < count) {
+		rval = -ENOMEM;
+		goto out;
+	}
+	n = ibench_alloc(client, heap_id, "realloc");
+	ibench_free(client, n);
+	if (n < count) {
+		rval = -ENOMEM;
+	}
+
+	printk(KERN_INFO "ion bench: %s", ibench.result);
+
+out:
+	vfree(ibench.lat);
+	ibench.lat = NULL;
+	vfree(ibench.handles);
+	ibench.handles = NULL;
+	mutex_unlock(&ibench.lock);
+	ion_client_destroy(client);
+
+	return rval;
+}
+
+static ssize_t ibench_write(struct file *filp, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	char buf[64];
+	unsigned int heap_id;
+	uint32_t size, num;
+	int rval;
+
+	if (count >= sizeof(buf)) {
+		return -EINVAL;
+	}
+	if (copy_from_user(buf, ubuf, count)) {
+		return -EFAULT;
+	}
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%u %u %u", &heap_id, &size, &num) != 3) {
+		return -EINVAL;
+	}
+
+	rval = ibench_run(heap_id, size, num);
+
+	return rval ? rval : count;
+}
+
+static int ibench_show(struct seq_file *m, void *private)
+{
+	mutex_lock(&ibench.lock);
+	seq_printf(m, "%s", ibench.result);
+	mutex_unlock(&ibench.lock);
+
+	return 0;
+}
+
+static int ibench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ibench_show, inode->i_private);
+}
+
+static const struct file_operations ibench_fops = {
+	.open = ibench_open,
+	.read = seq_read,
+	.write = ibench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init ibench_init(void)
+{
+	mutex_init(&ibench.lock);
+
+	ibench_dentry = debugfs_create_file("ion_bench", S_IRUGO | S_IWUSR,
+			NULL, NULL, &ibench_fops);
+	if (!ibench_dentry) {
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void __exit ibench_exit(void)
+{
+	debugfs_remove(ibench_dentry);
+}
+
+module_init(ibench_init);
+module_exit(ibench_exit);
+
+MODULE_DESCRIPTION("ION allocation latency benchmark");
+MODULE_LICENSE("GPL");
@@ -22,6 +22,7 @@
 #include <linux/io.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <asm/uaccess.h>
 
 #include <linux/sipc.h>
@@ -33,11 +34,59 @@ static void __sblock_put(struct sblock_mgr *sblock, uint32_t addr)
 {
 	void* virt_addr;
 	uint32_t index;
-	spin_lock(&sblock->ring->plock);
+	unsigned long flags;
+
+	/* seth gets tx blocks from softirq context, so keep plock irq-safe */
+	spin_lock_irqsave(&sblock->ring->plock, flags);
 	virt_addr = addr - sblock->smem_addr + sblock->smem_virt;
 	index = (virt_addr - sblock->smem_virt) / sblock->ring->header->txblk_size;
 	list_add(&sblock->ring->txunits[index].list, &sblock->ring->txpool);
-	spin_unlock(&sblock->ring->plock);
+	spin_unlock_irqrestore(&sblock->ring->plock, flags);
+}
+
+/*
+ * Send the events deferred by the nowait paths, from process
+ * context where smsg_send may wait for room in the smsg txbuf.
+ */
+static void sblock_kick_work(struct work_struct *work)
+{
+	struct sblock_mgr *sblock = container_of(work, struct sblock_mgr, kick_work);
+	struct smsg mevt;
+	unsigned long flags;
+	uint32_t addr;
+
+	/*
+	 * Releases go out oldest first. The head entry is only dropped once
+	 * it is sent, so sblock_release_nowait keeps queueing behind it
+	 * meanwhile instead of overtaking it.
+	 */
+	spin_lock_irqsave(&sblock->rel_lock, flags);
+	while (sblock->rel_count) {
+		addr = sblock->rel_pending[sblock->rel_head];
+		spin_unlock_irqrestore(&sblock->rel_lock, flags);
+
+		smsg_set(&mevt, sblock->channel, SMSG_TYPE_EVENT,
+				SMSG_EVENT_SBLOCK_RELEASE, addr);
+		smsg_send(sblock->dst, &mevt, -1);
+
+		spin_lock_irqsave(&sblock->rel_lock, flags);
+		sblock->rel_head = (sblock->rel_head + 1) % sblock->rel_size;
+		sblock->rel_count--;
+	}
+	spin_unlock_irqrestore(&sblock->rel_lock, flags);
+
+	if (test_bit(SBLOCK_KICK_SEND, &sblock->kick_flags)) {
+		smsg_set(&mevt, sblock->channel, SMSG_TYPE_EVENT,
+				SMSG_EVENT_SBLOCK_SEND, 0);
+		smsg_send(sblock->dst, &mevt, -1);
+		clear_bit(SBLOCK_KICK_SEND, &sblock->kick_flags);
+		smp_mb__after_clear_bit();
+
+		/* sblock_send_nowait may have refused blocks meanwhile */
+		if (sblock->handler) {
+			sblock->handler(SBLOCK_NOTIFY_GET, sblock->data);
+		}
+	}
 }
 
 static int sblock_thread(void *data)
@@ -151,7 +200,7 @@ int sblock_create(uint8_t dst, uint8_t channel,
 		kfree(sblock);
 		return -ENOMEM;
 	}
-	sblock->smem_virt = ioremap(sblock->smem_addr, sblock->smem_size);
+	sblock->smem_virt = smem_map(sblock->smem_addr, sblock->smem_size);
 	if (!sblock->smem_virt) {
 		printk(KERN_ERR "Failed to map smem for sblock\n");
 		smem_free(sblock->smem_addr, sblock->smem_size);
@@ -163,7 +212,7 @@ int sblock_create(uint8_t dst, uint8_t channel,
 	sblock->ring = kzalloc(sizeof(struct sblock_ring), GFP_KERNEL);
 	if (!sblock->ring) {
 		printk(KERN_ERR "Failed to allocate ring for sblock\n");
-		iounmap(sblock->smem_virt);
+		smem_unmap(sblock->smem_virt, sblock->smem_addr);
 		smem_free(sblock->smem_addr, sblock->smem_size);
 		kfree(sblock);
 		return -ENOMEM;
@@ -197,11 +246,23 @@ int sblock_create(uint8_t dst, uint8_t channel,
 	if (!sblock->ring->txunits) {
 		printk(KERN_ERR "Failed to allocate txunits for sblock\n");
 		kfree(sblock->ring);
-		iounmap(sblock->smem_virt);
+		smem_unmap(sblock->smem_virt, sblock->smem_addr);
 		smem_free(sblock->smem_addr, sblock->smem_size);
 		kfree(sblock);
 		return -ENOMEM;
 	}
+	sblock->rel_pending = kzalloc(sizeof(uint32_t) * rxblocknum, GFP_KERNEL);
+	if (!sblock->rel_pending) {
+		printk(KERN_ERR "Failed to allocate release queue for sblock\n");
+		kfree(sblock->ring->txunits);
+		kfree(sblock->ring);
+		smem_unmap(sblock->smem_virt, sblock->smem_addr);
+		smem_free(sblock->smem_addr, sblock->smem_size);
+		kfree(sblock);
+		return -ENOMEM;
+	}
+	sblock->rel_size = rxblocknum;
+
 	INIT_LIST_HEAD(&sblock->ring->txpool);
 	for (i = 0; i < txblocknum; i++) {
 		sblock->ring->txunits[i].addr = sblock->ring->txblk_virt + i * txblocksize;
@@ -210,17 +271,20 @@ int sblock_create(uint8_t dst, uint8_t channel,
 
 	init_waitqueue_head(&sblock->ring->getwait);
 	init_waitqueue_head(&sblock->ring->recvwait);
-	mutex_init(&sblock->ring->txlock);
-	mutex_init(&sblock->ring->rxlock);
+	spin_lock_init(&sblock->ring->txlock);
+	spin_lock_init(&sblock->ring->rxlock);
 	spin_lock_init(&sblock->ring->plock);
+	INIT_WORK(&sblock->kick_work, sblock_kick_work);
+	spin_lock_init(&sblock->rel_lock);
 
 	sblock->thread = kthread_create(sblock_thread, sblock,
 			"sblock-%d-%d", dst, channel);
 	if (IS_ERR(sblock->thread)) {
 		printk(KERN_ERR "Failed to create kthread: sblock-%d-%d\n", dst, channel);
+		kfree(sblock->rel_pending);
 		kfree(sblock->ring->txunits);
 		kfree(sblock->ring);
-		iounmap(sblock->smem_virt);
+		smem_unmap(sblock->smem_virt, sblock->smem_addr);
 		smem_free(sblock->smem_addr, sblock->smem_size);
 		kfree(sblock);
 		return PTR_ERR(sblock->thread);
@@ -238,10 +302,12 @@ void sblock_destroy(uint8_t dst, uint8_t channel)
 
 	sblock->state = SBLOCK_STATE_IDLE;
 	kthread_stop(sblock->thread);
+	cancel_work_sync(&sblock->kick_work);
 
+	kfree(sblock->rel_pending);
 	kfree(sblock->ring->txunits);
 	kfree(sblock->ring);
-	iounmap(sblock->smem_virt);
+	smem_unmap(sblock->smem_virt, sblock->smem_addr);
 	smem_free(sblock->smem_addr, sblock->smem_size);
 	kfree(sblock);
 
@@ -269,6 +335,20 @@ int sblock_register_notifier(uint8_t dst, uint8_t channel,
 	return 0;
 }
 
+int sblock_status(uint8_t dst, uint8_t channel)
+{
+	struct sblock_mgr *sblock = sblocks[dst][channel];
+
+	if (!sblock) {
+		return -ENODEV;
+	}
+	if (sblock->state != SBLOCK_STATE_READY) {
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
 int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 {
 	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
@@ -276,6 +356,7 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 	volatile struct sblock_ring_header *ringhd;
 	struct list_head *head;
 	struct sblock_txunit *txunit;
+	unsigned long flags;
 	int rval = 0;
 
 	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
@@ -289,8 +370,8 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 
 	if (list_empty(head)) {
 		if (timeout == 0) {
-			/* no wait */
-			printk(KERN_WARNING "sblock_get %d-%d is empty!\n",
+			/* no wait, seth polls this from its xmit path */
+			pr_debug("sblock_get %d-%d is empty!\n",
 				dst, channel);
 			rval = -ENODATA;
 		} else if (timeout < 0) {
@@ -308,6 +389,9 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 			} else if (rval == 0) {
 				printk(KERN_WARNING "sblock_get wait timeout!\n");
 				rval = -ETIME;
+			} else {
+				/* woken up, not the remaining jiffies */
+				rval = 0;
 			}
 		}
 	}
@@ -317,7 +401,7 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 	}
 
 	/* multi-gotter may cause got failure */
-	spin_lock(&ring->plock);
+	spin_lock_irqsave(&ring->plock, flags);
 	if (!list_empty(head)) {
 		txunit = list_entry(head->next, struct sblock_txunit, list);
 		blk->addr = txunit->addr;
@@ -326,42 +410,95 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout)
 	} else {
 		rval = -EAGAIN;
 	}
-	spin_unlock(&ring->plock);
+	spin_unlock_irqrestore(&ring->plock, flags);
 
 	return rval;
 }
 
-int sblock_send(uint8_t dst, uint8_t channel, struct sblock *blk)
+void sblock_put(uint8_t dst, uint8_t channel, struct sblock *blk)
 {
 	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
-	struct sblock_ring *ring;
-	volatile struct sblock_ring_header *ringhd;
-	struct smsg mevt;
-	int txpos;
 
-	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
-		printk(KERN_ERR "sblock-%d-%d not ready!\n", dst, channel);
-		return -ENODEV;
+	if (!sblock) {
+		return;
 	}
 
-	pr_debug("sblock_send: dst=%d, channel=%d, addr=%p, len=%d\n",
-			dst, channel, blk->addr, blk->length);
+	__sblock_put(sblock, blk->addr - sblock->smem_virt + sblock->smem_addr);
+	wake_up_interruptible_all(&sblock->ring->getwait);
+}
 
-	ring = sblock->ring;
-	ringhd = ring->header;
+/* put blk on the tx ring, the peer still has to be told by an event */
+static void sblock_publish(struct sblock_mgr *sblock, struct sblock *blk)
+{
+	struct sblock_ring *ring = sblock->ring;
+	volatile struct sblock_ring_header *ringhd = ring->header;
+	unsigned long flags;
+	int txpos;
 
-	mutex_lock(&ring->txlock);
+	spin_lock_irqsave(&ring->txlock, flags);
 
 	txpos = ringhd->txblk_wrptr % ringhd->txblk_count;
 	ring->txblks[txpos].addr = blk->addr - sblock->smem_virt + sblock->smem_addr;
 	ring->txblks[txpos].length = blk->length;
 	pr_debug("sblock_send: wrptr=%d, txpos=%d, addr=%x\n",
 			ringhd->txblk_wrptr, txpos, ring->txblks[txpos].addr);
+	wmb();
 	ringhd->txblk_wrptr = ringhd->txblk_wrptr + 1;
+
+	spin_unlock_irqrestore(&ring->txlock, flags);
+}
+
+int sblock_send(uint8_t dst, uint8_t channel, struct sblock *blk)
+{
+	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
+	struct smsg mevt;
+
+	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
+		printk(KERN_ERR "sblock-%d-%d not ready!\n", dst, channel);
+		return -ENODEV;
+	}
+
+	pr_debug("sblock_send: dst=%d, channel=%d, addr=%p, len=%d\n",
+			dst, channel, blk->addr, blk->length);
+
+	sblock_publish(sblock, blk);
+
 	smsg_set(&mevt, channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBLOCK_SEND, 0);
 	smsg_send(dst, &mevt, -1);
 
-	mutex_unlock(&ring->txlock);
+	return 0;
+}
+
+int sblock_send_nowait(uint8_t dst, uint8_t channel, struct sblock *blk)
+{
+	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
+	struct smsg mevt;
+
+	/* called per packet, leave reporting to the caller */
+	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
+		return -ENODEV;
+	}
+
+	/* the smsg txbuf is still congested, push back on the caller */
+	if (test_bit(SBLOCK_KICK_SEND, &sblock->kick_flags)) {
+		return -EBUSY;
+	}
+
+	pr_debug("sblock_send_nowait: dst=%d, channel=%d, addr=%p, len=%d\n",
+			dst, channel, blk->addr, blk->length);
+
+	sblock_publish(sblock, blk);
+
+	/*
+	 * blk is on the ring already and can't be taken back, so when the
+	 * event can't be sent now it is left to kick_work. One event covers
+	 * every block published before it is received.
+	 */
+	smsg_set(&mevt, channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBLOCK_SEND, 0);
+	if (smsg_send(dst, &mevt, 0)) {
+		set_bit(SBLOCK_KICK_SEND, &sblock->kick_flags);
+		schedule_work(&sblock->kick_work);
+	}
 
 	return 0;
 }
@@ -371,6 +508,7 @@ int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout
 	struct sblock_mgr *sblock = sblocks[dst][channel];
 	struct sblock_ring *ring;
 	volatile struct sblock_ring_header *ringhd;
+	unsigned long flags;
 	int rxpos, rval = 0;
 
 	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
@@ -408,6 +546,9 @@ int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout
 			} else if (rval == 0) {
 				printk(KERN_WARNING "sblock_receive wait timeout!\n");
 				rval = -ETIME;
+			} else {
+				/* woken up, not the remaining jiffies */
+				rval = 0;
 			}
 		}
 	}
@@ -417,7 +558,7 @@ int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout
 	}
 
 	/* multi-receiver may cause recv failure */
-	mutex_lock(&ring->rxlock);
+	spin_lock_irqsave(&ring->rxlock, flags);
 	if (ringhd->rxblk_wrptr != ringhd->rxblk_rdptr){
 		rxpos = ringhd->rxblk_rdptr % ringhd->rxblk_count;
 		blk->addr = ring->rxblks[rxpos].addr - sblock->smem_addr + sblock->smem_virt;
@@ -428,11 +569,45 @@ int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout
 	} else {
 		rval = -EAGAIN;
 	}
-	mutex_unlock(&ring->rxlock);
+	spin_unlock_irqrestore(&ring->rxlock, flags);
 
 	return rval;
 }
 
+int sblock_receive_batch(uint8_t dst, uint8_t channel,
+		struct sblock *blks, int num)
+{
+	struct sblock_mgr *sblock = sblocks[dst][channel];
+	struct sblock_ring *ring;
+	volatile struct sblock_ring_header *ringhd;
+	unsigned long flags;
+	int rxpos, n = 0;
+
+	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
+		printk(KERN_ERR "sblock-%d-%d not ready!\n", dst, channel);
+		return -ENODEV;
+	}
+
+	ring = sblock->ring;
+	ringhd = ring->header;
+
+	/* drain all ready blocks up to num under a single lock */
+	spin_lock_irqsave(&ring->rxlock, flags);
+	while (n < num && ringhd->rxblk_wrptr != ringhd->rxblk_rdptr) {
+		rxpos = ringhd->rxblk_rdptr % ringhd->rxblk_count;
+		blks[n].addr = ring->rxblks[rxpos].addr - sblock->smem_addr + sblock->smem_virt;
+		blks[n].length = ring->rxblks[rxpos].length;
+		ringhd->rxblk_rdptr = ringhd->rxblk_rdptr + 1;
+		n++;
+	}
+	spin_unlock_irqrestore(&ring->rxlock, flags);
+
+	pr_debug("sblock_receive_batch: dst=%d, channel=%d, got %d of %d\n",
+			dst, channel, n, num);
+
+	return n;
+}
+
 int sblock_release(uint8_t dst, uint8_t channel, struct sblock *blk)
 {
 	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
@@ -462,13 +637,70 @@ int sblock_release(uint8_t dst, uint8_t channel, struct sblock *blk)
 	return 0;
 }
 
+int sblock_release_nowait(uint8_t dst, uint8_t channel, struct sblock *blk)
+{
+	struct sblock_mgr *sblock = (struct sblock_mgr *)sblocks[dst][channel];
+	struct smsg mevt;
+	unsigned long flags;
+	uint32_t addr;
+
+	/* called per packet, leave reporting to the caller */
+	if (!sblock || sblock->state != SBLOCK_STATE_READY) {
+		return -ENODEV;
+	}
+
+	addr = blk->addr - sblock->smem_virt + sblock->smem_addr;
+	pr_debug("sblock_release_nowait: dst=%d, channel=%d, addr=%x\n",
+			dst, channel, addr);
+
+	/*
+	 * Don't overtake releases still waiting in kick_work. smsg_send
+	 * with no timeout doesn't sleep, so it is tried under rel_lock.
+	 */
+	spin_lock_irqsave(&sblock->rel_lock, flags);
+	if (!sblock->rel_count) {
+		smsg_set(&mevt, channel, SMSG_TYPE_EVENT,
+				SMSG_EVENT_SBLOCK_RELEASE, addr);
+		if (!smsg_send(dst, &mevt, 0)) {
+			spin_unlock_irqrestore(&sblock->rel_lock, flags);
+			return 0;
+		}
+	}
+
+	/*
+	 * Each rx block is released once, so rel_size entries are enough
+	 * unless the peer hands out more blocks than it set up.
+	 */
+	if (sblock->rel_count >= sblock->rel_size) {
+		spin_unlock_irqrestore(&sblock->rel_lock, flags);
+		if (printk_ratelimit()) {
+			printk(KERN_WARNING "sblock-%d-%d release queue full, "
+				"dropping %x\n", dst, channel, addr);
+		}
+		return -ENOSPC;
+	}
+	sblock->rel_pending[(sblock->rel_head + sblock->rel_count) %
+		sblock->rel_size] = addr;
+	sblock->rel_count++;
+	spin_unlock_irqrestore(&sblock->rel_lock, flags);
+
+	schedule_work(&sblock->kick_work);
+
+	return 0;
+}
+
 EXPORT_SYMBOL(sblock_create);
 EXPORT_SYMBOL(sblock_destroy);
 EXPORT_SYMBOL(sblock_register_notifier);
+EXPORT_SYMBOL(sblock_status);
 EXPORT_SYMBOL(sblock_get);
+EXPORT_SYMBOL(sblock_put);
 EXPORT_SYMBOL(sblock_send);
+EXPORT_SYMBOL(sblock_send_nowait);
 EXPORT_SYMBOL(sblock_receive);
+EXPORT_SYMBOL(sblock_receive_batch);
 EXPORT_SYMBOL(sblock_release);
+EXPORT_SYMBOL(sblock_release_nowait);
 
 MODULE_AUTHOR("Chen Gaopeng");
 MODULE_DESCRIPTION("SIPC/SBLOCK driver");
@@ -25,6 +25,9 @@
 #define SBLOCK_STATE_IDLE		0
 #define SBLOCK_STATE_READY		1
 
+/* bits of sblock_mgr kick_flags, events left to kick_work */
+#define SBLOCK_KICK_SEND		0
+
 struct sblock_blks {
 	uint32_t		addr; /*phy address*/
 	uint32_t		length;
@@ -65,8 +68,8 @@ struct sblock_ring {
 	struct list_head	txpool;
 	spinlock_t		plock;
 
-	struct mutex		txlock;
-	struct mutex		rxlock;
+	spinlock_t		txlock;
+	spinlock_t		rxlock;
 
 	wait_queue_head_t	getwait;
 	wait_queue_head_t	recvwait;
@@ -89,6 +92,15 @@ struct sblock_mgr {
 
 	void			(*handler)(int event, void *data);
 	void			*data;
+
+	/* events which could not be sent without sleeping */
+	struct work_struct	kick_work;
+	unsigned long		kick_flags;
+	spinlock_t		rel_lock;
+	uint32_t		*rel_pending;	/* FIFO of rx block addrs to release */
+	uint32_t		rel_size;
+	uint32_t		rel_head;
+	uint32_t		rel_count;
 };
 
 #endif
@@ -20,6 +20,7 @@
 #include <linux/delay.h>
 #include <linux/slab.h>
 #include <linux/io.h>
+#include <linux/workqueue.h>
 #include <asm/uaccess.h>
 
 #include <linux/sipc.h>
@@ -27,6 +28,99 @@
 
 static struct sbuf_mgr *sbufs[SIPC_ID_NR][SMSG_CH_NR];
 
+static void sbuf_notify(struct sbuf_mgr *sbuf, uint32_t bufid, uint16_t flag)
+{
+	struct smsg mevt;
+
+	smsg_set(&mevt, sbuf->channel, SMSG_TYPE_EVENT, flag, bufid);
+	smsg_send(sbuf->dst, &mevt, -1);
+}
+
+/* flush doorbells skipped by the coalescing fast path */
+static void sbuf_db_work(struct work_struct *work)
+{
+	struct sbuf_ring *ring = container_of(work, struct sbuf_ring, db_work.work);
+
+	if (atomic_xchg(&ring->tx_pending, 0)) {
+		sbuf_notify(ring->sbuf, ring->bufid, SMSG_EVENT_SBUF_WRPTR);
+	}
+	if (atomic_xchg(&ring->rx_pending, 0)) {
+		sbuf_notify(ring->sbuf, ring->bufid, SMSG_EVENT_SBUF_RDPTR);
+	}
+}
+
+/* called after txbuf_wrptr moved from oldptr by size bytes */
+static void sbuf_tx_doorbell(struct sbuf_ring *ring, uint32_t oldptr, int size)
+{
+	volatile struct sbuf_ring_header *ringhd = ring->header;
+
+	if (!(ring->mode & SBUF_MODE_COALESCE)) {
+		sbuf_notify(ring->sbuf, ring->bufid, SMSG_EVENT_SBUF_WRPTR);
+		return;
+	}
+
+	/* publish wrptr before checking whether the reader drained the ring */
+	mb();
+	if (ringhd->txbuf_rdptr == oldptr ||
+		atomic_add_return(size, &ring->tx_pending) >= ring->db_bytes) {
+		atomic_set(&ring->tx_pending, 0);
+		sbuf_notify(ring->sbuf, ring->bufid, SMSG_EVENT_SBUF_WRPTR);
+	} else {
+		schedule_delayed_work(&ring->db_work,
+			msecs_to_jiffies(ring->db_delay));
+	}
+}
+
+/* called after rxbuf_rdptr moved from oldptr by size bytes */
+static void sbuf_rx_doorbell(struct sbuf_ring *ring, uint32_t oldptr, int size)
+{
+	volatile struct sbuf_ring_header *ringhd = ring->header;
+
+	if (!(ring->mode & SBUF_MODE_COALESCE)) {
+		sbuf_notify(ring->sbuf, ring->bufid, SMSG_EVENT_SBUF_RDPTR);
+		return;
+	}
+
+	/* publish rdptr before checking whether the writer saw a full ring */
+	mb();
+	if ((int)(ringhd->rxbuf_wrptr - oldptr) >= ringhd->rxbuf_size ||
+		atomic_add_return(size, &ring->rx_pending) >= ring->db_bytes) {
+		atomic_set(&ring->rx_pending, 0);
+		sbuf_notify(ring->sbuf, ring->bufid, SMSG_EVENT_SBUF_RDPTR);
+	} else {
+		schedule_delayed_work(&ring->db_work,
+			msecs_to_jiffies(ring->db_delay));
+	}
+}
+
+/*
+ * Returns the ring mode the caller runs under, which must be handed back
+ * to sbuf_ring_unlock: sbuf_set_mode may change ring->mode meanwhile.
+ */
+static int sbuf_ring_lock(struct sbuf_ring *ring, struct mutex *lock, int timeout)
+{
+	int mode = ACCESS_ONCE(ring->mode);
+
+	if (mode & SBUF_MODE_SPSC) {
+		return mode;
+	}
+
+	if (timeout) {
+		mutex_lock(lock);
+	} else if (!mutex_trylock(lock)) {
+		return -EBUSY;
+	}
+
+	return mode;
+}
+
+static void sbuf_ring_unlock(struct mutex *lock, int mode)
+{
+	if (!(mode & SBUF_MODE_SPSC)) {
+		mutex_unlock(lock);
+	}
+}
+
 static int sbuf_thread(void *data)
 {
 	struct sbuf_mgr *sbuf = data;
@@ -126,7 +220,7 @@ int sbuf_create(uint8_t dst, uint8_t channel, uint32_t bufnum,
 		kfree(sbuf);
 		return -ENOMEM;
 	}
-	sbuf->smem_virt = ioremap(sbuf->smem_addr, sbuf->smem_size);
+	sbuf->smem_virt = smem_map(sbuf->smem_addr, sbuf->smem_size);
 	if (!sbuf->smem_virt) {
 		printk(KERN_ERR "Failed to map smem for sbuf\n");
 		smem_free(sbuf->smem_addr, sbuf->smem_size);
@@ -138,7 +232,7 @@ int sbuf_create(uint8_t dst, uint8_t channel, uint32_t bufnum,
 	sbuf->rings = kzalloc(sizeof(struct sbuf_ring) * bufnum, GFP_KERNEL);
 	if (!sbuf->rings) {
 		printk(KERN_ERR "Failed to allocate rings for sbuf\n");
-		iounmap(sbuf->smem_virt);
+		smem_unmap(sbuf->smem_virt, sbuf->smem_addr);
 		smem_free(sbuf->smem_addr, sbuf->smem_size);
 		kfree(sbuf);
 		return -ENOMEM;
@@ -167,6 +261,12 @@ int sbuf_create(uint8_t dst, uint8_t channel, uint32_t bufnum,
 		init_waitqueue_head(&(sbuf->rings[i].rxwait));
 		mutex_init(&(sbuf->rings[i].txlock));
 		mutex_init(&(sbuf->rings[i].rxlock));
+
+		sbuf->rings[i].sbuf = sbuf;
+		sbuf->rings[i].bufid = i;
+		atomic_set(&(sbuf->rings[i].tx_pending), 0);
+		atomic_set(&(sbuf->rings[i].rx_pending), 0);
+		INIT_DELAYED_WORK(&(sbuf->rings[i].db_work), sbuf_db_work);
 	}
 
 	sbuf->thread = kthread_create(sbuf_thread, sbuf,
@@ -174,7 +274,7 @@ int sbuf_create(uint8_t dst, uint8_t channel, uint32_t bufnum,
 	if (IS_ERR(sbuf->thread)) {
 		printk(KERN_ERR "Failed to create kthread: sbuf-%d-%d\n", dst, channel);
 		kfree(sbuf->rings);
-		iounmap(sbuf->smem_virt);
+		smem_unmap(sbuf->smem_virt, sbuf->smem_addr);
 		smem_free(sbuf->smem_addr, sbuf->smem_size);
 		kfree(sbuf);
 
@@ -190,12 +290,17 @@ int sbuf_create(uint8_t dst, uint8_t channel, uint32_t bufnum,
 void sbuf_destroy(uint8_t dst, uint8_t channel)
 {
 	struct sbuf_mgr *sbuf = sbufs[dst][channel];
+	int i;
 
 	sbuf->state = SBUF_STATE_IDLE;
 	kthread_stop(sbuf->thread);
 
+	for (i = 0; i < sbuf->ringnr; i++) {
+		cancel_delayed_work_sync(&(sbuf->rings[i].db_work));
+	}
+
 	kfree(sbuf->rings);
-	iounmap(sbuf->smem_virt);
+	smem_unmap(sbuf->smem_virt, sbuf->smem_addr);
 	smem_free(sbuf->smem_addr, sbuf->smem_size);
 	kfree(sbuf);
 
@@ -208,9 +313,9 @@ int sbuf_write(uint8_t dst, uint8_t channel, uint32_t bufid,
 	struct sbuf_mgr *sbuf = sbufs[dst][channel];
 	struct sbuf_ring *ring = &(sbuf->rings[bufid]);
 	volatile struct sbuf_ring_header *ringhd = ring->header;
-	struct smsg mevt;
 	void *txpos;
-	int rval, left, tail, txsize;
+	uint32_t oldptr;
+	int rval, left, tail, txsize, mode;
 
 	if (!sbuf) {
 		return -ENODEV;
@@ -228,13 +333,10 @@ int sbuf_write(uint8_t dst, uint8_t channel, uint32_t bufid,
 	rval = 0;
 	left = len;
 
-	if (timeout) {
-		mutex_lock(&ring->txlock);
-	} else {
-		if (!mutex_trylock(&(ring->txlock))) {
-			printk(KERN_INFO "sbuf_write busy!\n");
-			return -EBUSY;
-		}
+	mode = sbuf_ring_lock(ring, &ring->txlock, timeout);
+	if (mode < 0) {
+		printk(KERN_INFO "sbuf_write busy!\n");
+		return mode;
 	}
 
 	if (timeout == 0) {
@@ -304,15 +406,15 @@ int sbuf_write(uint8_t dst, uint8_t channel, uint32_t bufid,
 		pr_debug("sbuf_write: txpos=%p, txsize=%d\n", txpos, txsize);
 
 		/* update tx wrptr */
-		ringhd->txbuf_wrptr = ringhd->txbuf_wrptr + txsize;
-		smsg_set(&mevt, channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBUF_WRPTR, bufid);
-		smsg_send(dst, &mevt, -1);
+		oldptr = ringhd->txbuf_wrptr;
+		ringhd->txbuf_wrptr = oldptr + txsize;
+		sbuf_tx_doorbell(ring, oldptr, txsize);
 
 		left -= txsize;
 		buf += txsize;
 	}
 
-	mutex_unlock(&ring->txlock);
+	sbuf_ring_unlock(&ring->txlock, mode);
 
 	pr_debug("sbuf_write done: len=%d\n", len - left);
 
@@ -329,9 +431,9 @@ int sbuf_read(uint8_t dst, uint8_t channel, uint32_t bufid,
 	struct sbuf_mgr *sbuf = sbufs[dst][channel];
 	struct sbuf_ring *ring = &(sbuf->rings[bufid]);
 	volatile struct sbuf_ring_header *ringhd = ring->header;
-	struct smsg mevt;
 	void *rxpos;
-	int rval, left, tail, rxsize;
+	uint32_t oldptr;
+	int rval, left, tail, rxsize, mode;
 
 	if (!sbuf) {
 		return -ENODEV;
@@ -349,13 +451,10 @@ int sbuf_read(uint8_t dst, uint8_t channel, uint32_t bufid,
 	rval = 0;
 	left = len;
 
-	if (timeout) {
-		mutex_lock(&ring->rxlock);
-	} else {
-		if (!mutex_trylock(&(ring->rxlock))) {
-			printk(KERN_INFO "sbuf_read busy!\n");
-			return -EBUSY;
-		}
+	mode = sbuf_ring_lock(ring, &ring->rxlock, timeout);
+	if (mode < 0) {
+		printk(KERN_INFO "sbuf_read busy!\n");
+		return mode;
 	}
 
 	if (ringhd->rxbuf_wrptr == ringhd->rxbuf_rdptr) {
@@ -424,15 +523,15 @@ int sbuf_read(uint8_t dst, uint8_t channel, uint32_t bufid,
 		}
 
 		/* update rx rdptr */
-		ringhd->rxbuf_rdptr = ringhd->rxbuf_rdptr + rxsize;
-		smsg_set(&mevt, channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBUF_RDPTR, bufid);
-		smsg_send(dst, &mevt, -1);
+		oldptr = ringhd->rxbuf_rdptr;
+		ringhd->rxbuf_rdptr = oldptr + rxsize;
+		sbuf_rx_doorbell(ring, oldptr, rxsize);
 
 		left -= rxsize;
 		buf += rxsize;
 	}
 
-	mutex_unlock(&ring->rxlock);
+	sbuf_ring_unlock(&ring->rxlock, mode);
 
 	pr_debug("sbuf_read done: len=%d", len - left);
 
@@ -473,6 +572,44 @@ int sbuf_poll_wait(uint8_t dst, uint8_t channel, uint32_t bufid,
 	return mask;
 }
 
+int sbuf_set_mode(uint8_t dst, uint8_t channel, uint32_t bufid,
+		uint32_t mode, uint32_t db_bytes, uint32_t db_delay)
+{
+	struct sbuf_mgr *sbuf = sbufs[dst][channel];
+	struct sbuf_ring *ring;
+
+	if (!sbuf) {
+		return -ENODEV;
+	}
+	if (bufid >= sbuf->ringnr) {
+		return -EINVAL;
+	}
+
+	ring = &(sbuf->rings[bufid]);
+
+	/* don't switch locking under a running writer or reader */
+	mutex_lock(&ring->txlock);
+	mutex_lock(&ring->rxlock);
+
+	ring->db_bytes = db_bytes ? db_bytes :
+		min(ring->header->txbuf_size, ring->header->rxbuf_size) / 2;
+	ring->db_delay = db_delay ? db_delay : SBUF_DB_DELAY_DEFAULT;
+	ring->mode = mode;
+
+	mutex_unlock(&ring->rxlock);
+	mutex_unlock(&ring->txlock);
+
+	/* flush anything left over from the coalescing mode */
+	if (!(mode & SBUF_MODE_COALESCE)) {
+		flush_delayed_work(&ring->db_work);
+	}
+
+	pr_debug("sbuf_set_mode: %d-%d ring %d mode=0x%x, db_bytes=%d, db_delay=%d\n",
+			dst, channel, bufid, mode, ring->db_bytes, ring->db_delay);
+
+	return 0;
+}
+
 int sbuf_status(uint8_t dst, uint8_t channel)
 {
 	struct sbuf_mgr *sbuf = sbufs[dst][channel];
@@ -492,6 +629,7 @@ EXPORT_SYMBOL(sbuf_destroy);
 EXPORT_SYMBOL(sbuf_write);
 EXPORT_SYMBOL(sbuf_read);
 EXPORT_SYMBOL(sbuf_poll_wait);
+EXPORT_SYMBOL(sbuf_set_mode);
 EXPORT_SYMBOL(sbuf_status);
 
 MODULE_AUTHOR("Chen Gaopeng");
@@ -44,6 +44,11 @@ struct sbuf_smem_header {
 	struct sbuf_ring_header	headers[0];
 };
 
+/* default doorbell coalescing thresholds */
+#define SBUF_DB_DELAY_DEFAULT	2	/* ms */
+
+struct sbuf_mgr;
+
 struct sbuf_ring {
 	/* tx/rx buffer info */
 	volatile struct sbuf_ring_header	*header;
@@ -58,6 +63,19 @@ struct sbuf_ring {
 	/* send/recv mutex */
 	struct mutex		txlock;
 	struct mutex		rxlock;
+
+	/* fast path options, see sbuf_set_mode */
+	uint32_t		mode;
+	uint32_t		db_bytes;
+	uint32_t		db_delay;
+
+	/* bytes moved since the last wrptr/rdptr doorbell */
+	atomic_t		tx_pending;
+	atomic_t		rx_pending;
+	struct delayed_work	db_work;
+
+	struct sbuf_mgr		*sbuf;
+	uint32_t		bufid;
 };
 
 #define SBUF_STATE_IDLE		0
@@ -40,6 +40,9 @@
 #define SETH_BLOCK_NUM	64
 #define SETH_BLOCK_SIZE	(ETH_HLEN + ETH_DATA_LEN + NET_IP_ALIGN)
 
+#define SETH_NAPI_WEIGHT	64
+#define SETH_RX_BATCH	16
+
 #define DEV_ON 1
 #define DEV_OFF 0
 
@@ -49,6 +52,8 @@
 typedef struct SEth {
 	struct net_device_stats stats;	/* net statistics */
 	struct net_device* netdev;	/* Linux net device */
+	struct napi_struct napi;	/* rx poll context */
+	atomic_t rx_pending;		/* rx event seen while polling */
 	struct seth_init_data* pdata;	/* platform data */
 	int state;			/* device state */
 	int stopped;			/* sblock indicator */
@@ -78,29 +83,11 @@ seth_tx_ready_handler (void* data)
 }
 
 static void
-seth_rx_handler (void* data)
+seth_rx_one (SEth* seth, struct sblock* blk)
 {
-	SEth* seth = (SEth *)data;
-	struct seth_init_data *pdata = seth->pdata;
-	struct sblock blk;
 	struct sk_buff* skb;
-	int ret;
-	int i;
 
-	if (seth->state != DEV_ON) {
-		SETH_ERR ("rx_handler the state of %s is off!\n", seth->netdev->name);
-		seth->stats.rx_errors++;
-		return;
-	}
-
-	ret = sblock_receive(pdata->dst, pdata->channel, &blk, 0);
-	if (ret) {
-		SETH_ERR ("receive sblock failed (%d)\n", ret);
-		seth->stats.rx_errors++;
-		return;
-	}
-	
-	skb = dev_alloc_skb (blk.length + NET_IP_ALIGN); //16 bytes align
+	skb = netdev_alloc_skb (seth->netdev, blk->length + NET_IP_ALIGN);
 	if (!skb) {
 		SETH_ERR ("alloc skbuff failed!\n");
 		seth->stats.rx_dropped++;
@@ -109,25 +96,74 @@ seth_rx_handler (void* data)
 
 	skb_reserve(skb, NET_IP_ALIGN);
 
-	memcpy(skb->data, blk.addr, blk.length);
+	memcpy(skb->data, blk->addr, blk->length);
 
-	skb_put (skb, blk.length);
+	skb_put (skb, blk->length);
 
-	skb->dev = seth->netdev;
 	skb->protocol  = eth_type_trans (skb, seth->netdev);
 	skb->ip_summed = CHECKSUM_UNNECESSARY;
 
 	seth->stats.rx_packets++;
 	seth->stats.rx_bytes += skb->len;
 
-	netif_rx (skb);
+	napi_gro_receive (&seth->napi, skb);
+}
+
+/*
+ * NAPI poll: drain up to budget sblocks, SETH_RX_BATCH at a time.
+ */
+static int
+seth_rx_poll (struct napi_struct* napi, int budget)
+{
+	SEth* seth = container_of(napi, SEth, napi);
+	struct seth_init_data *pdata = seth->pdata;
+	struct sblock blks[SETH_RX_BATCH];
+	int done = 0;
+	int ret;
+	int i;
+
+	atomic_set(&seth->rx_pending, 0);
+	while (done < budget) {
+		ret = sblock_receive_batch(pdata->dst, pdata->channel, blks,
+				min(budget - done, SETH_RX_BATCH));
+		if (ret < 0) {
+			SETH_ERR ("receive sblock failed (%d)\n", ret);
+			seth->stats.rx_errors++;
+			break;
+		}
+		if (ret == 0) {
+			break;
+		}
 
-	seth->netdev->last_rx = jiffies;
+		for (i = 0; i < ret; i++) {
+			/* blocks are still drained while off, or the ring stays full */
+			if (seth->state == DEV_ON) {
+				seth_rx_one(seth, &blks[i]);
+			} else {
+				seth->stats.rx_dropped++;
+			}
+			/* softirq context, the release event must not wait */
+			if (sblock_release_nowait(pdata->dst, pdata->channel, &blks[i])) {
+				SETH_ERR ("release sblock failed\n");
+			}
+		}
+		done += ret;
+	}
 
-	ret = sblock_release(pdata->dst, pdata->channel, &blk);
-	if (ret) {
-		SETH_ERR ("release sblock failed (%d)\n", ret);
+	if (done) {
+		seth->netdev->last_rx = jiffies;
+	}
+
+	if (done < budget) {
+		napi_complete (napi);
+		/* a recv event racing with napi_complete would be lost */
+		smp_mb();
+		if (atomic_read(&seth->rx_pending)) {
+			napi_schedule (napi);
+		}
 	}
+
+	return done;
 }
 
 static void
@@ -138,10 +174,18 @@ seth_handler (int event, void* data)
 	switch(event) {
 		case SBLOCK_NOTIFY_GET:
 			SETH_DEBUG ("SBLOCK_NOTIFY_GET is received\n");
+			if (seth->stopped) {
+				seth->stopped = 0;
+				netif_wake_queue (seth->netdev);
+			}
 			break;
 		case SBLOCK_NOTIFY_RECV:
 			SETH_DEBUG ("SBLOCK_NOTIFY_RECV is received\n");
-			seth_rx_handler(seth);
+			/* called from sblock thread, let bh_enable run the poll */
+			atomic_set(&seth->rx_pending, 1);
+			local_bh_disable();
+			napi_schedule (&seth->napi);
+			local_bh_enable();
 			break;
 		case SBLOCK_NOTIFY_STATUS:
 			SETH_DEBUG ("SBLOCK_NOTIFY_STATUS is received\n");
@@ -154,6 +198,13 @@ seth_handler (int event, void* data)
 
 /*
  * Transmit interface
+ *
+ * The skb is gathered straight from its linear part and page fragments
+ * into the sblock, so the stack never has to linearize it for us, and
+ * the transport checksum is computed in the same pass. When no sblock
+ * is free, or the smsg link can't take the send event without sleeping,
+ * the skb is handed back with NETDEV_TX_BUSY and the queue is woken
+ * again from the SBLOCK_NOTIFY_GET event.
  */
 static int
 seth_start_xmit (struct sk_buff* skb, struct net_device* dev)
@@ -171,35 +222,60 @@ seth_start_xmit (struct sk_buff* skb, struct net_device* dev)
 		dev_kfree_skb_any (skb);
 		return NETDEV_TX_OK;
 	}
+
+	if (skb->len > SETH_BLOCK_SIZE) {
+		SETH_ERR ("The size of sblock is so tiny!\n");
+		seth->stats.tx_dropped++;
+		dev_kfree_skb_any (skb);
+		return NETDEV_TX_OK;
+	}
+
 	/*
 	 * Get a free sblock.
 	 */
-
-	ret = sblock_get(pdata->dst, pdata->channel, &blk, 0xFFFFFFFF);
-	if(ret) {
-		SETH_ERR ("Get free sblock failed(%d)\n", ret);
+	ret = sblock_get(pdata->dst, pdata->channel, &blk, 0);
+	if (ret) {
+		SETH_DEBUG ("Get free sblock failed(%d), requeue\n", ret);
 		netif_stop_queue (dev);
-		seth->stats.tx_fifo_errors++;
 		seth->stopped = 1;
-		dev_kfree_skb_any (skb);
-		return NETDEV_TX_BUSY;
-	}
+		smp_mb();
 
-	if(blk.length < skb->len) {
-		SETH_ERR ("The size of sblock is so tiny!\n");
-		seth->stats.tx_fifo_errors++;
-		dev_kfree_skb_any (skb);
-		return NETDEV_TX_BUSY;
+		/* a block may have been released before the queue stopped */
+		ret = sblock_get(pdata->dst, pdata->channel, &blk, 0);
+		if (ret) {
+			return NETDEV_TX_BUSY;
+		}
+		seth->stopped = 0;
+		netif_start_queue (dev);
 	}
 
+	/* gather linear and paged data into the sblock, folding the csum */
+	skb_copy_and_csum_dev(skb, blk.addr);
 	blk.length = skb->len;
-	memcpy (blk.addr, skb->data, skb->len);
-	ret = sblock_send(pdata->dst, pdata->channel, &blk);
-	if(ret) {
+
+	/* ndo_start_xmit runs with BH disabled, so the send must not sleep */
+	ret = sblock_send_nowait(pdata->dst, pdata->channel, &blk);
+	if (ret == -EBUSY) {
+		SETH_DEBUG ("smsg link busy, requeue\n");
+		netif_stop_queue (dev);
+		seth->stopped = 1;
+		smp_mb();
+
+		/* the deferred event may have gone out before the queue stopped */
+		ret = sblock_send_nowait(pdata->dst, pdata->channel, &blk);
+		if (ret == -EBUSY) {
+			sblock_put(pdata->dst, pdata->channel, &blk);
+			return NETDEV_TX_BUSY;
+		}
+		seth->stopped = 0;
+		netif_start_queue (dev);
+	}
+	if (ret) {
 		SETH_ERR ("send sblock failed(%d)\n", ret);
+		sblock_put(pdata->dst, pdata->channel, &blk);
 		seth->stats.tx_fifo_errors++;
 		dev_kfree_skb_any (skb);
-		return NETDEV_TX_BUSY;
+		return NETDEV_TX_OK;
 	}
 
 	/*
@@ -223,7 +299,9 @@ static int seth_open (struct net_device *dev)
 
 	/* Reset stats */
 	memset(&seth->stats, 0, sizeof(seth->stats));
-	
+
+	napi_enable(&seth->napi);
+
 	/*
 	seth->state = DEV_ON;
 	*/
@@ -241,6 +319,7 @@ static int seth_close (struct net_device *dev)
 	SEth* seth = netdev_priv(dev);
 
 	netif_stop_queue(dev);
+	napi_disable(&seth->napi);
 
 	/*
 	seth->state = DEV_OFF;
@@ -276,6 +355,7 @@ static int __devexit seth_remove (struct platform_device *pdev)
 	sblock_destroy(pdata->dst, pdata->channel);
 
 	unregister_netdev(seth->netdev);
+	netif_napi_del(&seth->napi);
 	free_netdev(seth->netdev);
 
 	platform_set_drvdata(pdev, NULL);
@@ -327,11 +407,14 @@ static int __devinit seth_probe(struct platform_device *pdev)
 	netdev->tx_timeout = seth_tx_timeout;
 #endif
 	netdev->watchdog_timeo = 100*HZ;
+	netdev->features |= NETIF_F_SG | NETIF_F_HW_CSUM;
 	netdev->irq = 0;
 	netdev->dma = 0;
 
 	random_ether_addr(netdev->dev_addr);
 
+	netif_napi_add(netdev, &seth->napi, seth_rx_poll, SETH_NAPI_WEIGHT);
+
 	ret = sblock_create(pdata->dst, pdata->channel,
 		SETH_BLOCK_NUM, SETH_BLOCK_SIZE,
 		SETH_BLOCK_NUM, SETH_BLOCK_SIZE);
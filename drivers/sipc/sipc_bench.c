@@ -0,0 +1,550 @@
+/*
+ * Copyright (C) 2012 Spreadtrum Communications Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Throughput/latency benchmark for sbuf, sblock and seth. The peer must
+ * echo everything back, which is what the sipc loopback does. Usage:
+ *
+ *   echo "sbuf|sblock|seth <size> <count>" > /sys/kernel/debug/sipc/bench
+ *   cat /sys/kernel/debug/sipc/bench
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <net/net_namespace.h>
+#include <asm/div64.h>
+
+#include <linux/sipc.h>
+#include <linux/sipc_priv.h>
+
+#define SBENCH_SBUF_SIZE	(64 * 1024)
+#define SBENCH_BLOCK_NUM	64
+#define SBENCH_BLOCK_SIZE	2048
+#define SBENCH_ETH_P		0x88B5	/* local experimental ethertype */
+#define SBENCH_SETH_INFLIGHT	32
+#define SBENCH_TIMEOUT		(10 * HZ)
+
+static uint dst = SIPC_ID_CPW;
+module_param(dst, uint, 0444);
+MODULE_PARM_DESC(dst, "processor ID of the echo peer");
+
+static uint sbuf_ch = SMSG_CH_PIPE;
+module_param(sbuf_ch, uint, 0444);
+MODULE_PARM_DESC(sbuf_ch, "channel for the sbuf test");
+
+static uint sblock_ch = SMSG_CH_PCM;
+module_param(sblock_ch, uint, 0444);
+MODULE_PARM_DESC(sblock_ch, "channel for the sblock test");
+
+static char *ifname = "seth_lo0";
+module_param(ifname, charp, 0444);
+MODULE_PARM_DESC(ifname, "seth interface for the seth test");
+
+/* message header stamped by the sender */
+struct sbench_hdr {
+	u64			stamp;
+	u32			seq;
+};
+
+struct sbench {
+	struct mutex		lock;
+
+	/* current run */
+	uint32_t		size;
+	uint32_t		count;
+	uint32_t		*lat;		/* ns per msg */
+	atomic_t		received;
+	atomic_t		errors;
+	struct completion	done;
+	wait_queue_head_t	wait;
+
+	/* created channels */
+	int			sbuf_ready;
+	int			sblock_ready;
+
+	/* last result */
+	char			result[512];
+};
+
+static struct sbench sbench;
+static struct dentry *sbench_dentry;
+
+static inline u64 sbench_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static void sbench_record(u64 stamp)
+{
+	int n = atomic_inc_return(&sbench.received) - 1;
+
+	if (n < sbench.count) {
+		sbench.lat[n] = (uint32_t)min_t(u64, sbench_now() - stamp, UINT_MAX);
+	}
+	if (n + 1 == sbench.count) {
+		complete(&sbench.done);
+	}
+	wake_up(&sbench.wait);
+}
+
+/* writers must not exit before kthread_stop */
+static void sbench_wait_stop(void)
+{
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+}
+
+static int sbench_wait_ready(int (*status)(uint8_t, uint8_t), uint8_t channel)
+{
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		if (status(dst, channel) == 0) {
+			return 0;
+		}
+		msleep(20);
+	}
+
+	printk(KERN_ERR "sipc bench: channel %d-%d not ready\n", dst, channel);
+	return -ENODEV;
+}
+
+/* ****************************************************************** */
+
+static int sbench_sbuf_writer(void *data)
+{
+	struct sbench_hdr *hdr;
+	char *buf;
+	int i, n, rval;
+
+	buf = kzalloc(sbench.size, GFP_KERNEL);
+	if (!buf) {
+		atomic_inc(&sbench.errors);
+		goto out;
+	}
+	hdr = (struct sbench_hdr *)buf;
+
+	for (i = 0; i < sbench.count && !kthread_should_stop(); i++) {
+		hdr->seq = i;
+		hdr->stamp = sbench_now();
+		for (n = 0; n < sbench.size; n += rval) {
+			rval = sbuf_write(dst, sbuf_ch, 0, buf + n,
+					sbench.size - n, SBENCH_TIMEOUT);
+			if (rval <= 0) {
+				atomic_inc(&sbench.errors);
+				goto out;
+			}
+		}
+	}
+
+out:
+	kfree(buf);
+	sbench_wait_stop();
+	return 0;
+}
+
+static int sbench_run_sbuf(void)
+{
+	struct task_struct *writer;
+	struct sbench_hdr *hdr;
+	char *buf;
+	int i, n, rval;
+
+	if (!sbench.sbuf_ready) {
+		rval = sbuf_create(dst, sbuf_ch, 1,
+				SBENCH_SBUF_SIZE, SBENCH_SBUF_SIZE);
+		if (rval) {
+			return rval;
+		}
+		sbench.sbuf_ready = 1;
+	}
+	rval = sbench_wait_ready(sbuf_status, sbuf_ch);
+	if (rval) {
+		return rval;
+	}
+
+	buf = kzalloc(sbench.size, GFP_KERNEL);
+	if (!buf) {
+		return -ENOMEM;
+	}
+	hdr = (struct sbench_hdr *)buf;
+
+	writer = kthread_run(sbench_sbuf_writer, NULL, "sbench-sbuf");
+	if (IS_ERR(writer)) {
+		kfree(buf);
+		return PTR_ERR(writer);
+	}
+
+	for (i = 0; i < sbench.count; i++) {
+		for (n = 0; n < sbench.size; n += rval) {
+			rval = sbuf_read(dst, sbuf_ch, 0, buf + n,
+					sbench.size - n, SBENCH_TIMEOUT);
+			if (rval <= 0) {
+				atomic_inc(&sbench.errors);
+				goto out;
+			}
+		}
+		sbench_record(hdr->stamp);
+	}
+
+out:
+	kthread_stop(writer);
+	kfree(buf);
+	return 0;
+}
+
+/* ****************************************************************** */
+
+static int sbench_sblock_writer(void *data)
+{
+	struct sbench_hdr *hdr;
+	struct sblock blk;
+	int i;
+
+	for (i = 0; i < sbench.count && !kthread_should_stop(); i++) {
+		if (sblock_get(dst, sblock_ch, &blk, SBENCH_TIMEOUT)) {
+			atomic_inc(&sbench.errors);
+			break;
+		}
+		hdr = blk.addr;
+		hdr->seq = i;
+		hdr->stamp = sbench_now();
+		blk.length = sbench.size;
+		if (sblock_send(dst, sblock_ch, &blk)) {
+			atomic_inc(&sbench.errors);
+			break;
+		}
+	}
+
+	sbench_wait_stop();
+	return 0;
+}
+
+static int sbench_run_sblock(void)
+{
+	struct task_struct *writer;
+	struct sbench_hdr *hdr;
+	struct sblock blk;
+	int i, rval;
+
+	if (sbench.size > SBENCH_BLOCK_SIZE) {
+		return -EINVAL;
+	}
+
+	if (!sbench.sblock_ready) {
+		rval = sblock_create(dst, sblock_ch,
+				SBENCH_BLOCK_NUM, SBENCH_BLOCK_SIZE,
+				SBENCH_BLOCK_NUM, SBENCH_BLOCK_SIZE);
+		if (rval) {
+			return rval;
+		}
+		sbench.sblock_ready = 1;
+	}
+	rval = sbench_wait_ready(sblock_status, sblock_ch);
+	if (rval) {
+		return rval;
+	}
+
+	writer = kthread_run(sbench_sblock_writer, NULL, "sbench-sblock");
+	if (IS_ERR(writer)) {
+		return PTR_ERR(writer);
+	}
+
+	for (i = 0; i < sbench.count; i++) {
+		if (sblock_receive(dst, sblock_ch, &blk, SBENCH_TIMEOUT)) {
+			atomic_inc(&sbench.errors);
+			break;
+		}
+		hdr = blk.addr;
+		sbench_record(hdr->stamp);
+		sblock_release(dst, sblock_ch, &blk);
+	}
+
+	kthread_stop(writer);
+	return 0;
+}
+
+/* ****************************************************************** */
+
+static int sbench_seth_rcv(struct sk_buff *skb, struct net_device *dev,
+		struct packet_type *pt, struct net_device *orig_dev)
+{
+	struct sbench_hdr hdr;
+
+	if (!skb_copy_bits(skb, 0, &hdr, sizeof(hdr))) {
+		sbench_record(hdr.stamp);
+	}
+	kfree_skb(skb);
+
+	return NET_RX_SUCCESS;
+}
+
+static int sbench_run_seth(void)
+{
+	struct packet_type pt = {
+		.type = htons(SBENCH_ETH_P),
+		.func = sbench_seth_rcv,
+	};
+	struct net_device *dev;
+	struct sk_buff *skb;
+	struct sbench_hdr *hdr;
+	struct ethhdr *eth;
+	int i, len;
+
+	if (sbench.size < ETH_HLEN + sizeof(struct sbench_hdr) ||
+			sbench.size > ETH_FRAME_LEN) {
+		return -EINVAL;
+	}
+	len = sbench.size - ETH_HLEN;
+
+	dev = dev_get_by_name(&init_net, ifname);
+	if (!dev) {
+		return -ENODEV;
+	}
+	if (!netif_running(dev) || !netif_carrier_ok(dev)) {
+		dev_put(dev);
+		return -ENETDOWN;
+	}
+
+	pt.dev = dev;
+	dev_add_pack(&pt);
+
+	for (i = 0; i < sbench.count; i++) {
+		/* keep the qdisc from dropping frames */
+		wait_event_timeout(sbench.wait, i - atomic_read(&sbench.received) <
+				SBENCH_SETH_INFLIGHT, SBENCH_TIMEOUT);
+
+		skb = netdev_alloc_skb(dev, sbench.size + NET_IP_ALIGN);
+		if (!skb) {
+			atomic_inc(&sbench.errors);
+			break;
+		}
+		skb_reserve(skb, NET_IP_ALIGN);
+
+		eth = (struct ethhdr *)skb_put(skb, ETH_HLEN);
+		memcpy(eth->h_dest, dev->dev_addr, ETH_ALEN);
+		memcpy(eth->h_source, dev->dev_addr, ETH_ALEN);
+		eth->h_proto = htons(SBENCH_ETH_P);
+
+		hdr = (struct sbench_hdr *)skb_put(skb, len);
+		memset(hdr, 0, len);
+		hdr->seq = i;
+		hdr->stamp = sbench_now();
+
+		skb_reset_mac_header(skb);
+		skb->protocol = htons(SBENCH_ETH_P);
+		skb->dev = dev;
+		if (dev_queue_xmit(skb) != NET_XMIT_SUCCESS) {
+			atomic_inc(&sbench.errors);
+		}
+	}
+
+	wait_for_completion_timeout(&sbench.done, SBENCH_TIMEOUT);
+
+	dev_remove_pack(&pt);
+	dev_put(dev);
+	return 0;
+}
+
+/* ****************************************************************** */
+
+static int sbench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void sbench_report(const char *test, u64 elapsed)
+{
+	uint32_t n = min_t(uint32_t, atomic_read(&sbench.received), sbench.count);
+	u64 bytes = (u64)n * sbench.size;
+	u64 kbps, mps, us = elapsed;
+
+	do_div(us, NSEC_PER_USEC);
+	if (!us) {
+		us = 1;
+	}
+
+	/* KB/s and msgs/s */
+	kbps = (bytes * USEC_PER_SEC) >> 10;
+	do_div(kbps, (uint32_t)us);
+	mps = (u64)n * USEC_PER_SEC;
+	do_div(mps, (uint32_t)us);
+
+	if (n) {
+		sort(sbench.lat, n, sizeof(uint32_t), sbench_cmp, NULL);
+	}
+
+	snprintf(sbench.result, sizeof(sbench.result),
+		"test: %s, size: %u, count: %u, received: %u, errors: %d\n"
+		"elapsed: %llu us, %llu.%02llu MB/s, %llu msgs/s\n"
+		"latency (us): p50 %u, p90 %u, p99 %u, max %u\n",
+		test, sbench.size, sbench.count, n, atomic_read(&sbench.errors),
+		us, kbps / 1024, (kbps % 1024) * 100 / 1024, mps,
+		n ? sbench.lat[n / 2] / 1000 : 0,
+		n ? sbench.lat[n * 9 / 10] / 1000 : 0,
+		n ? sbench.lat[n * 99 / 100] / 1000 : 0,
+		n ? sbench.lat[n - 1] / 1000 : 0);
+
+	printk(KERN_INFO "sipc bench: %s", sbench.result);
+}
+
+static int sbench_run(const char *test, uint32_t size, uint32_t count)
+{
+	int (*run)(void);
+	u64 start;
+	int rval;
+
+	if (!strcmp(test, "sbuf")) {
+		run = sbench_run_sbuf;
+	} else if (!strcmp(test, "sblock")) {
+		run = sbench_run_sblock;
+	} else if (!strcmp(test, "seth")) {
+		run = sbench_run_seth;
+	} else {
+		return -EINVAL;
+	}
+
+	if (size < sizeof(struct sbench_hdr) || !count) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&sbench.lock);
+
+	sbench.lat = vmalloc(sizeof(uint32_t) * count);
+	if (!sbench.lat) {
+		mutex_unlock(&sbench.lock);
+		return -ENOMEM;
+	}
+	sbench.size = size;
+	sbench.count = count;
+	atomic_set(&sbench.received, 0);
+	atomic_set(&sbench.errors, 0);
+	INIT_COMPLETION(sbench.done);
+
+	start = sbench_now();
+	rval = run();
+	if (!rval) {
+		sbench_report(test, sbench_now() - start);
+	}
+
+	vfree(sbench.lat);
+	sbench.lat = NULL;
+	mutex_unlock(&sbench.lock);
+
+	return rval;
+}
+
+static ssize_t sbench_write(struct file *filp, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	char buf[64], test[16];
+	uint32_t size, num;
+	int rval;
+
+	if (count >= sizeof(buf)) {
+		return -EINVAL;
+	}
+	if (copy_from_user(buf, ubuf, count)) {
+		return -EFAULT;
+	}
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%15s %u %u", test, &size, &num) != 3) {
+		return -EINVAL;
+	}
+
+	rval = sbench_run(test, size, num);
+
+	return rval ? rval : count;
+}
+
+static int sbench_show(struct seq_file *m, void *private)
+{
+	mutex_lock(&sbench.lock);
+	seq_printf(m, "%s", sbench.result);
+	mutex_unlock(&sbench.lock);
+
+	return 0;
+}
+
+static int sbench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sbench_show, inode->i_private);
+}
+
+static const struct file_operations sbench_fops = {
+	.open = sbench_open,
+	.read = seq_read,
+	.write = sbench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init sbench_init(void)
+{
+	if (dst >= SIPC_ID_NR || sbuf_ch >= SMSG_CH_NR || sblock_ch >= SMSG_CH_NR) {
+		return -EINVAL;
+	}
+
+	mutex_init(&sbench.lock);
+	init_completion(&sbench.done);
+	init_waitqueue_head(&sbench.wait);
+
+	sbench_dentry = debugfs_create_file("bench", S_IRUGO | S_IWUSR,
+			sipc_debugfs_root(), NULL, &sbench_fops);
+	if (!sbench_dentry) {
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void __exit sbench_exit(void)
+{
+	debugfs_remove(sbench_dentry);
+
+	if (sbench.sbuf_ready) {
+		sbuf_destroy(dst, sbuf_ch);
+	}
+	if (sbench.sblock_ready) {
+		sblock_destroy(dst, sblock_ch);
+	}
+}
+
+module_init(sbench_init);
+module_exit(sbench_exit);
+
+MODULE_DESCRIPTION("SIPC benchmark");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,417 @@
+/*
+ * Copyright (C) 2012 Spreadtrum Communications Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Software loopback for the sipc stack. A fake CP peer runs on an
+ * ordered workqueue, it shares the smsg rings and a smem pool in kernel
+ * memory with the AP side and echoes every sbuf byte and sblock back.
+ * The doorbells are simulated by queueing works instead of IPIs, so
+ * smsg/sbuf/sblock/seth can be exercised without a modem.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/interrupt.h>
+#include <linux/delay.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/io.h>
+#include <linux/workqueue.h>
+#include <linux/platform_device.h>
+
+#include <linux/sipc.h>
+#include <linux/sipc_priv.h>
+#include <linux/seth.h>
+
+#include "sbuf.h"
+#include "sblock.h"
+
+/* smsg ring size in msgs, must be 2^n */
+#define SLOOP_RING_NR		128
+
+#define SLOOP_CH_NONE		0
+#define SLOOP_CH_SBUF		1
+#define SLOOP_CH_SBLOCK		2
+
+static uint dst = SIPC_ID_CPW;
+module_param(dst, uint, 0444);
+MODULE_PARM_DESC(dst, "processor ID served by the loopback peer");
+
+static uint smem_size = 1024 * 1024;
+module_param(smem_size, uint, 0444);
+MODULE_PARM_DESC(smem_size, "loopback smem pool size");
+
+static uint sbuf_mask = (1 << SMSG_CH_PIPE) | (1 << SMSG_CH_PLOG) |
+	(1 << SMSG_CH_TTY);
+module_param(sbuf_mask, uint, 0444);
+MODULE_PARM_DESC(sbuf_mask, "channels echoed as sbuf");
+
+static uint sblock_mask = (1 << SMSG_CH_DATA) | (1 << SMSG_CH_PCM);
+module_param(sblock_mask, uint, 0444);
+MODULE_PARM_DESC(sblock_mask, "channels echoed as sblock");
+
+static bool seth = true;
+module_param(seth, bool, 0444);
+MODULE_PARM_DESC(seth, "register a seth device on SMSG_CH_DATA");
+
+struct sloop_channel {
+	int			type;
+	uint32_t		smem_addr;
+
+	/* sblock peer: free rx blocks owned by the peer */
+	uint32_t		*rxfree;
+	uint32_t		rxfree_nr;
+};
+
+struct sloop {
+	struct smsg_ipc		ipc;
+
+	/* smsg rings and their rd/wr pointers */
+	struct smsg		*txring;
+	struct smsg		*rxring;
+	uint32_t		ptrs[4];
+
+	/* smem pool backed by kernel pages */
+	void			*smem_virt;
+	uint32_t		smem_addr;
+
+	struct workqueue_struct	*peer_wq;
+	struct workqueue_struct	*irq_wq;
+	struct work_struct	peer_work;
+	struct work_struct	irq_work;
+
+	struct sloop_channel	channels[SMSG_CH_NR];
+
+	struct platform_device	*seth_pdev;
+};
+
+static struct sloop sloop;
+
+static inline void *sloop_virt(uint32_t addr)
+{
+	return sloop.smem_virt + (addr - sloop.smem_addr);
+}
+
+/* AP doorbell: run the peer */
+static void sloop_txirq_trigger(void)
+{
+	queue_work(sloop.peer_wq, &sloop.peer_work);
+}
+
+static uint32_t sloop_rxirq_status(void)
+{
+	return 1;
+}
+
+static void sloop_rxirq_clear(void)
+{
+}
+
+/* CP doorbell: run the AP smsg dispatcher */
+static void sloop_irq_work(struct work_struct *work)
+{
+	sloop.ipc.irq_threadfn(sloop.ipc.irq, &sloop.ipc);
+}
+
+/* peer writes a msg into the AP rx ring */
+static void sloop_peer_send(uint8_t channel, uint8_t type,
+		uint16_t flag, uint32_t value)
+{
+	struct smsg_ipc *ipc = &sloop.ipc;
+	struct smsg *msg;
+	uint32_t wr;
+
+	while ((int)(readl(ipc->rxbuf_wrptr) - readl(ipc->rxbuf_rdptr)) >=
+			ipc->rxbuf_size) {
+		queue_work(sloop.irq_wq, &sloop.irq_work);
+		msleep(1);
+	}
+
+	wr = readl(ipc->rxbuf_wrptr);
+	msg = &sloop.rxring[wr & (ipc->rxbuf_size - 1)];
+	smsg_set(msg, channel, type, flag, value);
+	smp_wmb();
+	writel(wr + 1, ipc->rxbuf_wrptr);
+
+	queue_work(sloop.irq_wq, &sloop.irq_work);
+}
+
+/* move AP sbuf tx bytes into the AP rx ring of the same bufid */
+static void sloop_sbuf_echo(struct sloop_channel *ch, uint8_t channel,
+		uint32_t bufid)
+{
+	struct sbuf_smem_header *smem = sloop_virt(ch->smem_addr);
+	volatile struct sbuf_ring_header *hd;
+	uint32_t txoff, rxoff, n, moved = 0;
+
+	if (bufid >= smem->ringnr) {
+		return;
+	}
+	hd = &smem->headers[bufid];
+
+	while (hd->txbuf_wrptr != hd->txbuf_rdptr &&
+			(int)(hd->rxbuf_wrptr - hd->rxbuf_rdptr) < hd->rxbuf_size) {
+		txoff = hd->txbuf_rdptr % hd->txbuf_size;
+		rxoff = hd->rxbuf_wrptr % hd->rxbuf_size;
+
+		n = hd->txbuf_wrptr - hd->txbuf_rdptr;
+		n = min_t(uint32_t, n, hd->rxbuf_size -
+			(hd->rxbuf_wrptr - hd->rxbuf_rdptr));
+		n = min_t(uint32_t, n, hd->txbuf_size - txoff);
+		n = min_t(uint32_t, n, hd->rxbuf_size - rxoff);
+
+		memcpy(sloop_virt(hd->rxbuf_addr) + rxoff,
+			sloop_virt(hd->txbuf_addr) + txoff, n);
+		smp_wmb();
+		hd->rxbuf_wrptr += n;
+		hd->txbuf_rdptr += n;
+		moved += n;
+	}
+
+	if (moved) {
+		sloop_peer_send(channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBUF_RDPTR, bufid);
+		sloop_peer_send(channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBUF_WRPTR, bufid);
+	}
+}
+
+/* copy each sent AP tx block into a free rx block of the peer */
+static void sloop_sblock_echo(struct sloop_channel *ch, uint8_t channel)
+{
+	volatile struct sblock_ring_header *hd = sloop_virt(ch->smem_addr);
+	struct sblock_blks *txblks = sloop_virt(hd->txblk_blks);
+	struct sblock_blks *rxblks = sloop_virt(hd->rxblk_blks);
+	struct sblock_blks *tx, *rx;
+	uint32_t rxaddr, moved = 0;
+
+	while (hd->txblk_rdptr != hd->txblk_wrptr && ch->rxfree_nr) {
+		tx = &txblks[hd->txblk_rdptr % hd->txblk_count];
+		rx = &rxblks[hd->rxblk_wrptr % hd->rxblk_count];
+		rxaddr = ch->rxfree[--ch->rxfree_nr];
+
+		rx->addr = rxaddr;
+		rx->length = min_t(uint32_t, tx->length, hd->rxblk_size);
+		memcpy(sloop_virt(rxaddr), sloop_virt(tx->addr), rx->length);
+		smp_wmb();
+		hd->rxblk_wrptr++;
+		hd->txblk_rdptr++;
+
+		sloop_peer_send(channel, SMSG_TYPE_EVENT,
+			SMSG_EVENT_SBLOCK_RELEASE, tx->addr);
+		moved++;
+	}
+
+	if (moved) {
+		sloop_peer_send(channel, SMSG_TYPE_EVENT, SMSG_EVENT_SBLOCK_SEND, 0);
+	}
+}
+
+static void sloop_sblock_init(struct sloop_channel *ch)
+{
+	struct sblock_ring_header *hd = sloop_virt(ch->smem_addr);
+	uint32_t i;
+
+	kfree(ch->rxfree);
+	ch->rxfree = kmalloc(sizeof(uint32_t) * hd->rxblk_count, GFP_KERNEL);
+	if (!ch->rxfree) {
+		printk(KERN_ERR "sipc loopback: no memory for rx blocks\n");
+		ch->rxfree_nr = 0;
+		return;
+	}
+
+	for (i = 0; i < hd->rxblk_count; i++) {
+		ch->rxfree[i] = hd->rxblk_addr + i * hd->rxblk_size;
+	}
+	ch->rxfree_nr = hd->rxblk_count;
+}
+
+static void sloop_peer_handle(struct smsg *msg)
+{
+	struct sloop_channel *ch = &sloop.channels[msg->channel];
+
+	switch (msg->type) {
+	case SMSG_TYPE_OPEN:
+		sloop_peer_send(msg->channel, SMSG_TYPE_OPEN, SMSG_OPEN_MAGIC, 0);
+		if (ch->type != SLOOP_CH_NONE) {
+			/* SBUF_INIT and SBLOCK_INIT share the same flag */
+			sloop_peer_send(msg->channel, SMSG_TYPE_CMD,
+				SMSG_CMD_SBUF_INIT, 0);
+		}
+		break;
+	case SMSG_TYPE_CLOSE:
+		ch->smem_addr = 0;
+		kfree(ch->rxfree);
+		ch->rxfree = NULL;
+		ch->rxfree_nr = 0;
+		break;
+	case SMSG_TYPE_DONE:
+		ch->smem_addr = msg->value;
+		if (ch->type == SLOOP_CH_SBLOCK) {
+			sloop_sblock_init(ch);
+		}
+		break;
+	case SMSG_TYPE_EVENT:
+		if (!ch->smem_addr) {
+			break;
+		}
+		if (ch->type == SLOOP_CH_SBUF) {
+			/* both wrptr and rdptr updates may unblock the echo */
+			sloop_sbuf_echo(ch, msg->channel, msg->value);
+		} else if (ch->type == SLOOP_CH_SBLOCK) {
+			if (msg->flag == SMSG_EVENT_SBLOCK_RELEASE &&
+					ch->rxfree_nr < ((struct sblock_ring_header *)
+					sloop_virt(ch->smem_addr))->rxblk_count) {
+				ch->rxfree[ch->rxfree_nr++] = msg->value;
+			}
+			sloop_sblock_echo(ch, msg->channel);
+		}
+		break;
+	default:
+		pr_debug("sipc loopback: ignore msg type %d on channel %d\n",
+			msg->type, msg->channel);
+		break;
+	}
+}
+
+/* peer drains the AP tx ring */
+static void sloop_peer_work(struct work_struct *work)
+{
+	struct smsg_ipc *ipc = &sloop.ipc;
+	struct smsg msg;
+	uint32_t rd;
+
+	while (readl(ipc->txbuf_wrptr) != readl(ipc->txbuf_rdptr)) {
+		rd = readl(ipc->txbuf_rdptr);
+		smp_rmb();
+		memcpy(&msg, &sloop.txring[rd & (ipc->txbuf_size - 1)],
+			sizeof(struct smsg));
+		writel(rd + 1, ipc->txbuf_rdptr);
+
+		if (msg.channel < SMSG_CH_NR) {
+			sloop_peer_handle(&msg);
+		}
+	}
+}
+
+static int __init sloop_init(void)
+{
+	struct smsg_ipc *ipc = &sloop.ipc;
+	struct seth_init_data seth_pdata;
+	int i, rval;
+
+	if (dst >= SIPC_ID_NR) {
+		return -EINVAL;
+	}
+
+	sloop.txring = kzalloc(sizeof(struct smsg) * SLOOP_RING_NR, GFP_KERNEL);
+	sloop.rxring = kzalloc(sizeof(struct smsg) * SLOOP_RING_NR, GFP_KERNEL);
+	if (!sloop.txring || !sloop.rxring) {
+		rval = -ENOMEM;
+		goto fail_ring;
+	}
+
+	sloop.smem_virt = alloc_pages_exact(smem_size, GFP_KERNEL | __GFP_ZERO);
+	if (!sloop.smem_virt) {
+		printk(KERN_ERR "sipc loopback: failed to allocate smem\n");
+		rval = -ENOMEM;
+		goto fail_ring;
+	}
+	sloop.smem_addr = virt_to_phys(sloop.smem_virt);
+
+	/* the smem pool is global, Kconfig keeps real CP backends out */
+	rval = smem_init(sloop.smem_addr, smem_size);
+	if (rval) {
+		printk(KERN_ERR "sipc loopback: failed to init smem (%d)\n", rval);
+		goto fail_smem;
+	}
+
+	for (i = 0; i < SMSG_CH_NR; i++) {
+		if (sbuf_mask & (1 << i)) {
+			sloop.channels[i].type = SLOOP_CH_SBUF;
+		} else if (sblock_mask & (1 << i)) {
+			sloop.channels[i].type = SLOOP_CH_SBLOCK;
+		}
+	}
+
+	sloop.peer_wq = alloc_ordered_workqueue("sipc-loop-peer", 0);
+	sloop.irq_wq = alloc_ordered_workqueue("sipc-loop-irq", 0);
+	if (!sloop.peer_wq || !sloop.irq_wq) {
+		rval = -ENOMEM;
+		goto fail_wq;
+	}
+	INIT_WORK(&sloop.peer_work, sloop_peer_work);
+	INIT_WORK(&sloop.irq_work, sloop_irq_work);
+
+	ipc->name = "sipc-loop";
+	ipc->dst = dst;
+	ipc->irq = -1;
+	ipc->rxirq_status = sloop_rxirq_status;
+	ipc->rxirq_clear = sloop_rxirq_clear;
+	ipc->txirq_trigger = sloop_txirq_trigger;
+
+	ipc->txbuf_size = SLOOP_RING_NR;
+	ipc->txbuf_addr = (uint32_t)sloop.txring;
+	ipc->txbuf_rdptr = (uint32_t)&sloop.ptrs[0];
+	ipc->txbuf_wrptr = (uint32_t)&sloop.ptrs[1];
+
+	ipc->rxbuf_size = SLOOP_RING_NR;
+	ipc->rxbuf_addr = (uint32_t)sloop.rxring;
+	ipc->rxbuf_rdptr = (uint32_t)&sloop.ptrs[2];
+	ipc->rxbuf_wrptr = (uint32_t)&sloop.ptrs[3];
+
+	rval = smsg_ipc_create(dst, ipc);
+	if (rval) {
+		goto fail_wq;
+	}
+
+	if (seth && (sblock_mask & (1 << SMSG_CH_DATA))) {
+		seth_pdata.name = "seth_lo%d";
+		seth_pdata.dst = dst;
+		seth_pdata.channel = SMSG_CH_DATA;
+		sloop.seth_pdev = platform_device_register_data(NULL, "seth", 100,
+				&seth_pdata, sizeof(seth_pdata));
+		if (IS_ERR(sloop.seth_pdev)) {
+			printk(KERN_WARNING "sipc loopback: no seth device (%ld)\n",
+				PTR_ERR(sloop.seth_pdev));
+			sloop.seth_pdev = NULL;
+		}
+	}
+
+	printk(KERN_INFO "sipc loopback: dst %d, smem 0x%08x+0x%x\n",
+		dst, sloop.smem_addr, smem_size);
+
+	return 0;
+
+fail_wq:
+	if (sloop.peer_wq) {
+		destroy_workqueue(sloop.peer_wq);
+	}
+	if (sloop.irq_wq) {
+		destroy_workqueue(sloop.irq_wq);
+	}
+	/* smem pool can't be torn down once created */
+	return rval;
+fail_smem:
+	free_pages_exact(sloop.smem_virt, smem_size);
+fail_ring:
+	kfree(sloop.txring);
+	kfree(sloop.rxring);
+	return rval;
+}
+
+late_initcall(sloop_init);
+
+MODULE_DESCRIPTION("SIPC loopback backend");
+MODULE_LICENSE("GPL");
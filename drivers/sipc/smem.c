@@ -15,14 +15,74 @@
 #include <linux/module.h>
 #include <linux/genalloc.h>
 #include <linux/mm.h>
+#include <linux/io.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/interrupt.h>
 
 #include <linux/sipc.h>
+#include <linux/sipc_priv.h>
+
+/*
+ * Requests up to SMEM_SLAB_MAX bytes are packed into pages from the
+ * gen_pool by power-of-2 size classes. Page sized requests up to
+ * SMEM_RUN_PAGES are recycled through per-size freelists, so channels
+ * which are created and destroyed again don't search the gen_pool.
+ */
+#define SMEM_MIN_SHIFT		6
+#define SMEM_SLAB_MAX		(PAGE_SIZE / 2)
+#define SMEM_CLASS_NR		(PAGE_SHIFT - SMEM_MIN_SHIFT)
+#define SMEM_SLAB_OBJS		(PAGE_SIZE >> SMEM_MIN_SHIFT)
+#define SMEM_RUN_PAGES		16
+#define SMEM_RUN_CACHE		4	/* cached runs per size */
+
+/* a pool page carved into objects of one size class */
+struct smem_slab {
+	struct list_head	list;
+	uint32_t		addr;
+	uint16_t		cls;
+	uint16_t		inuse;
+	unsigned long		map[BITS_TO_LONGS(SMEM_SLAB_OBJS)];
+};
+
+struct smem_class {
+	uint32_t		size;
+	uint32_t		objs;
+	struct list_head	partial;	/* slabs with free objects */
+	uint32_t		nr_slabs;
+	uint32_t		inuse;
+	uint32_t		requested;	/* bytes asked by callers */
+};
+
+/* a freed run of pages kept for reuse */
+struct smem_run {
+	struct list_head	list;
+	uint32_t		addr;
+};
 
 struct smem_pool {
 	uint32_t		addr;
 	uint32_t		size;
 
 	struct gen_pool		*gen;
+
+	spinlock_t		lock;
+	struct smem_slab	**slabs;	/* slab of each pool page */
+	struct smem_class	classes[SMEM_CLASS_NR];
+	struct list_head	runs[SMEM_RUN_PAGES + 1];
+	uint32_t		nr_runs[SMEM_RUN_PAGES + 1];
+
+	/* statistics */
+	uint32_t		pages_used;	/* pages taken from gen_pool */
+	uint32_t		requested;	/* bytes asked by page callers */
+	uint32_t		run_hits;
+	uint32_t		run_misses;
+	uint32_t		failed;
 };
 
 static struct smem_pool		mem_pool;
@@ -30,19 +90,46 @@ static struct smem_pool		mem_pool;
 int smem_init(uint32_t addr, uint32_t size)
 {
 	struct smem_pool *spool = &mem_pool;
+	int i;
+
+	if (spool->gen) {
+		printk(KERN_ERR "smem gen pool already initialized!\n");
+		return -EEXIST;
+	}
 
 	spool->addr = addr;
 	spool->size = PAGE_ALIGN(size);
 
+	spool->slabs = kzalloc(sizeof(struct smem_slab *) *
+			(spool->size >> PAGE_SHIFT), GFP_KERNEL);
+	if (!spool->slabs) {
+		printk(KERN_ERR "Failed to allocate smem slab index!\n");
+		return -1;
+	}
+
+	spin_lock_init(&spool->lock);
+	for (i = 0; i < SMEM_CLASS_NR; i++) {
+		spool->classes[i].size = 1 << (SMEM_MIN_SHIFT + i);
+		spool->classes[i].objs = PAGE_SIZE >> (SMEM_MIN_SHIFT + i);
+		INIT_LIST_HEAD(&spool->classes[i].partial);
+	}
+	for (i = 0; i <= SMEM_RUN_PAGES; i++) {
+		INIT_LIST_HEAD(&spool->runs[i]);
+	}
+
 	/* allocator block size is times of pages */
 	spool->gen = gen_pool_create(PAGE_SHIFT, -1);
 	if (!spool->gen) {
 		printk(KERN_ERR "Failed to create smem gen pool!\n");
+		kfree(spool->slabs);
 		return -1;
 	}
 
 	if (gen_pool_add(spool->gen, spool->addr, spool->size, -1) != 0) {
 		printk(KERN_ERR "Failed to add smem gen pool!\n");
+		gen_pool_destroy(spool->gen);
+		spool->gen = NULL;
+		kfree(spool->slabs);
 		return -1;
 	}
 
@@ -51,24 +138,316 @@ int smem_init(uint32_t addr, uint32_t size)
 
 /* ****************************************************************** */
 
+/* give all cached runs back to the gen_pool */
+static void smem_drain_runs(struct smem_pool *spool)
+{
+	struct smem_run *run, *tmp;
+	int i;
+
+	for (i = 1; i <= SMEM_RUN_PAGES; i++) {
+		list_for_each_entry_safe(run, tmp, &spool->runs[i], list) {
+			list_del(&run->list);
+			gen_pool_free(spool->gen, run->addr, i << PAGE_SHIFT);
+			spool->pages_used -= i;
+			kfree(run);
+		}
+		spool->nr_runs[i] = 0;
+	}
+}
+
+static uint32_t smem_page_alloc(struct smem_pool *spool, uint32_t size)
+{
+	uint32_t npages = size >> PAGE_SHIFT;
+	struct smem_run *run;
+	uint32_t addr;
+
+	if (npages <= SMEM_RUN_PAGES && !list_empty(&spool->runs[npages])) {
+		run = list_first_entry(&spool->runs[npages], struct smem_run, list);
+		list_del(&run->list);
+		spool->nr_runs[npages]--;
+		spool->run_hits++;
+		addr = run->addr;
+		kfree(run);
+		return addr;
+	}
+
+	spool->run_misses++;
+	addr = gen_pool_alloc(spool->gen, size);
+	if (!addr) {
+		/* cached runs may be what fragments the pool */
+		smem_drain_runs(spool);
+		addr = gen_pool_alloc(spool->gen, size);
+	}
+	if (addr) {
+		spool->pages_used += npages;
+	}
+
+	return addr;
+}
+
+static void smem_page_free(struct smem_pool *spool, uint32_t addr, uint32_t size)
+{
+	uint32_t npages = size >> PAGE_SHIFT;
+	struct smem_run *run;
+
+	if (npages <= SMEM_RUN_PAGES && spool->nr_runs[npages] < SMEM_RUN_CACHE) {
+		run = kmalloc(sizeof(struct smem_run), GFP_ATOMIC);
+		if (run) {
+			run->addr = addr;
+			list_add(&run->list, &spool->runs[npages]);
+			spool->nr_runs[npages]++;
+			return;
+		}
+	}
+
+	gen_pool_free(spool->gen, addr, size);
+	spool->pages_used -= npages;
+}
+
+static inline int smem_size_class(uint32_t size)
+{
+	if (size <= (1 << SMEM_MIN_SHIFT)) {
+		return 0;
+	}
+	return fls(size - 1) - SMEM_MIN_SHIFT;
+}
+
+static uint32_t smem_slab_alloc(struct smem_pool *spool, uint32_t size)
+{
+	int cls = smem_size_class(size);
+	struct smem_class *sc = &spool->classes[cls];
+	struct smem_slab *slab;
+	uint32_t addr, bit;
+
+	if (list_empty(&sc->partial)) {
+		slab = kzalloc(sizeof(struct smem_slab), GFP_ATOMIC);
+		if (!slab) {
+			return 0;
+		}
+		slab->addr = smem_page_alloc(spool, PAGE_SIZE);
+		if (!slab->addr) {
+			kfree(slab);
+			return 0;
+		}
+		slab->cls = cls;
+		spool->slabs[(slab->addr - spool->addr) >> PAGE_SHIFT] = slab;
+		list_add(&slab->list, &sc->partial);
+		sc->nr_slabs++;
+	}
+
+	slab = list_first_entry(&sc->partial, struct smem_slab, list);
+	bit = find_first_zero_bit(slab->map, sc->objs);
+	__set_bit(bit, slab->map);
+	if (++slab->inuse == sc->objs) {
+		/* full slabs leave the partial list */
+		list_del_init(&slab->list);
+	}
+
+	addr = slab->addr + bit * sc->size;
+	sc->inuse++;
+	sc->requested += size;
+
+	return addr;
+}
+
+static void smem_slab_free(struct smem_pool *spool, uint32_t addr, uint32_t size)
+{
+	struct smem_slab *slab = spool->slabs[(addr - spool->addr) >> PAGE_SHIFT];
+	struct smem_class *sc;
+
+	if (!slab) {
+		printk(KERN_ERR "smem_free: 0x%08x is not a slab object!\n", addr);
+		return;
+	}
+	sc = &spool->classes[slab->cls];
+
+	__clear_bit((addr - slab->addr) / sc->size, slab->map);
+	if (slab->inuse-- == sc->objs) {
+		list_add(&slab->list, &sc->partial);
+	}
+	sc->inuse--;
+	sc->requested -= size;
+
+	if (!slab->inuse) {
+		list_del(&slab->list);
+		spool->slabs[(slab->addr - spool->addr) >> PAGE_SHIFT] = NULL;
+		smem_page_free(spool, slab->addr, PAGE_SIZE);
+		sc->nr_slabs--;
+		kfree(slab);
+	}
+}
+
 uint32_t smem_alloc(uint32_t size)
 {
 	struct smem_pool *spool = &mem_pool;
+	unsigned long flags;
+	uint32_t addr;
 
-	size = PAGE_ALIGN(size);
-	return gen_pool_alloc(spool->gen, size);
+	if (!size) {
+		return 0;
+	}
+
+	spin_lock_irqsave(&spool->lock, flags);
+	if (size <= SMEM_SLAB_MAX) {
+		addr = smem_slab_alloc(spool, size);
+	} else {
+		addr = smem_page_alloc(spool, PAGE_ALIGN(size));
+		if (addr) {
+			spool->requested += size;
+		}
+	}
+	if (!addr) {
+		spool->failed++;
+	}
+	spin_unlock_irqrestore(&spool->lock, flags);
+
+	return addr;
 }
 
 void smem_free(uint32_t addr, uint32_t size)
 {
 	struct smem_pool *spool = &mem_pool;
+	unsigned long flags;
 
-	size = PAGE_ALIGN(size);
-	gen_pool_free(spool->gen, addr, size);
+	spin_lock_irqsave(&spool->lock, flags);
+	if (size <= SMEM_SLAB_MAX) {
+		smem_slab_free(spool, addr, size);
+	} else {
+		smem_page_free(spool, addr, PAGE_ALIGN(size));
+		spool->requested -= size;
+	}
+	spin_unlock_irqrestore(&spool->lock, flags);
 }
 
+void *smem_map(uint32_t addr, uint32_t size)
+{
+	uint32_t offset = addr & ~PAGE_MASK;
+	struct page **pages;
+	void *virt;
+	int i, npages;
+
+	/* a reserved CP window, not managed by the kernel */
+	if (!pfn_valid(addr >> PAGE_SHIFT)) {
+		return ioremap(addr, size);
+	}
+
+	/* system RAM (e.g. sipc loopback) can't be ioremapped on ARMv6+ */
+	npages = PAGE_ALIGN(offset + size) >> PAGE_SHIFT;
+	pages = kmalloc(sizeof(struct page *) * npages, GFP_KERNEL);
+	if (!pages) {
+		return NULL;
+	}
+	for (i = 0; i < npages; i++) {
+		pages[i] = pfn_to_page((addr >> PAGE_SHIFT) + i);
+	}
+	virt = vmap(pages, npages, VM_MAP, PAGE_KERNEL);
+	kfree(pages);
+
+	return virt ? virt + offset : NULL;
+}
+
+void smem_unmap(void *virt, uint32_t addr)
+{
+	if (!pfn_valid(addr >> PAGE_SHIFT)) {
+		iounmap(virt);
+	} else {
+		vunmap((void *)((unsigned long)virt & PAGE_MASK));
+	}
+}
+
+#ifdef CONFIG_DEBUG_FS
+/* free pages and the largest free extent left in the gen_pool */
+static void smem_pool_extent(struct gen_pool *gen,
+		uint32_t *free, uint32_t *largest)
+{
+	struct gen_pool_chunk *chunk;
+	unsigned long nbits, start, end;
+
+	*free = *largest = 0;
+
+	read_lock(&gen->lock);
+	list_for_each_entry(chunk, &gen->chunks, next_chunk) {
+		nbits = (chunk->end_addr - chunk->start_addr) >> gen->min_alloc_order;
+		spin_lock(&chunk->lock);
+		start = find_first_zero_bit(chunk->bits, nbits);
+		while (start < nbits) {
+			end = find_next_bit(chunk->bits, nbits, start);
+			*free += end - start;
+			*largest = max_t(uint32_t, *largest, end - start);
+			start = find_next_zero_bit(chunk->bits, nbits, end);
+		}
+		spin_unlock(&chunk->lock);
+	}
+	read_unlock(&gen->lock);
+}
+
+static int smem_debug_show(struct seq_file *m, void *private)
+{
+	struct smem_pool *spool = &mem_pool;
+	struct smem_class *sc;
+	uint32_t free, largest, cached = 0;
+	unsigned long flags;
+	int i;
+
+	if (!spool->gen) {
+		return 0;
+	}
+
+	smem_pool_extent(spool->gen, &free, &largest);
+
+	spin_lock_irqsave(&spool->lock, flags);
+	for (i = 1; i <= SMEM_RUN_PAGES; i++) {
+		cached += spool->nr_runs[i] * i;
+	}
+
+	seq_printf(m, "smem pool: 0x%08x+0x%x, pages used %u, cached %u, free %u\n",
+		spool->addr, spool->size, spool->pages_used, cached, free);
+	seq_printf(m, "  largest free extent: %u pages, fragmentation: %u%%\n",
+		largest, free ? 100 - largest * 100 / free : 0);
+	seq_printf(m, "  page requests: %u bytes, run hits %u, misses %u, failed %u\n",
+		spool->requested, spool->run_hits, spool->run_misses,
+		spool->failed);
+	seq_printf(m, "  %8s %8s %8s %8s %10s %6s\n",
+		"size", "slabs", "inuse", "total", "requested", "util");
+	for (i = 0; i < SMEM_CLASS_NR; i++) {
+		sc = &spool->classes[i];
+		seq_printf(m, "  %8u %8u %8u %8u %10u %5u%%\n",
+			sc->size, sc->nr_slabs, sc->inuse,
+			sc->nr_slabs * sc->objs, sc->requested,
+			sc->nr_slabs ? (uint32_t)(sc->requested * 100 /
+			(sc->nr_slabs * PAGE_SIZE)) : 0);
+	}
+	spin_unlock_irqrestore(&spool->lock, flags);
+
+	return 0;
+}
+
+static int smem_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, smem_debug_show, inode->i_private);
+}
+
+static const struct file_operations smem_debug_fops = {
+	.open = smem_debug_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init smem_debugfs_init(void)
+{
+	debugfs_create_file("smem", S_IRUGO, sipc_debugfs_root(), NULL,
+			&smem_debug_fops);
+	return 0;
+}
+
+late_initcall(smem_debugfs_init);
+#endif /* CONFIG_DEBUG_FS */
+
 EXPORT_SYMBOL(smem_alloc);
 EXPORT_SYMBOL(smem_free);
+EXPORT_SYMBOL(smem_map);
+EXPORT_SYMBOL(smem_unmap);
 
 MODULE_AUTHOR("Chen Gaopeng");
 MODULE_DESCRIPTION("SIPC/SMEM driver");
@@ -20,80 +20,156 @@
 #include <linux/delay.h>
 #include <linux/slab.h>
 #include <linux/io.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <linux/sipc.h>
 #include <linux/sipc_priv.h>
 
 static struct smsg_ipc *smsg_ipcs[SIPC_ID_NR];
 
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *sipc_debugfs;
+
+struct dentry *sipc_debugfs_root(void)
+{
+	if (!sipc_debugfs) {
+		sipc_debugfs = debugfs_create_dir("sipc", NULL);
+	}
+
+	return sipc_debugfs;
+}
+EXPORT_SYMBOL(sipc_debugfs_root);
+#endif
+
+/* per-channel cache size, 0 means SMSG_CACHE_NR */
+static uint cache_nr[SMSG_CH_NR];
+module_param_array(cache_nr, uint, NULL, 0444);
+MODULE_PARM_DESC(cache_nr, "smsg cache size of each channel");
+
 irqreturn_t smsg_irq_handler(int irq, void *dev_id)
 {
 	struct smsg_ipc *ipc = (struct smsg_ipc *)dev_id;
-	struct smsg *msg;
-	struct smsg_channel *ch;
-	uint32_t rxpos, wr;
 
 	if (ipc->rxirq_status()) {
 		ipc->rxirq_clear();
 	}
 
-	while (readl(ipc->rxbuf_wrptr) != readl(ipc->rxbuf_rdptr)) {
-		rxpos = (readl(ipc->rxbuf_rdptr) & (ipc->rxbuf_size - 1)) *
-			sizeof (struct smsg) + ipc->rxbuf_addr;
-		msg = (struct smsg *)rxpos;
-
-		pr_debug("irq get smsg: wrptr=%d, rdptr=%d, rxpos=0x%08x\n",
-			readl(ipc->rxbuf_wrptr), readl(ipc->rxbuf_rdptr), rxpos);
-		pr_debug("irq read smsg: channel=%d, type=%d, flag=0x%04x, value=0x%08x\n",
-			msg->channel, msg->type, msg->flag, msg->value);
-
-		if (msg->channel >= SMSG_CH_NR || msg->type >= SMSG_TYPE_NR) {
-			/* invalid msg */
-			printk(KERN_ERR "invalid smsg: channel=%d, type=%d, flag=0x%04x, value=0x%08x\n",
-				msg->channel, msg->type, msg->flag, msg->value);
+	/* msgs are dispatched in smsg_irq_threadfn */
+	return IRQ_WAKE_THREAD;
+}
 
-			/* update smsg rdptr */
-			writel(readl(ipc->rxbuf_rdptr) + 1, ipc->rxbuf_rdptr);
+static void smsg_wake_channels(struct smsg_ipc *ipc, uint32_t mask)
+{
+	int i;
 
-			continue;
+	for (i = 0; mask; i++, mask >>= 1) {
+		if ((mask & 1) && ipc->channels[i]) {
+			wake_up_interruptible_all(&(ipc->channels[i]->rxwait));
 		}
+	}
+}
 
-		ch = ipc->channels[msg->channel];
-		if (!ch) {
-			if (ipc->states[msg->channel] == CHAN_STATE_UNUSED &&
-					msg->type == SMSG_TYPE_OPEN &&
-					msg->flag == SMSG_OPEN_MAGIC) {
-
-				ipc->states[msg->channel] = CHAN_STATE_WAITING;
-			} else {
-				/* drop this bad msg since channel is not opened */
-				printk(KERN_ERR "smsg channel %d not opened! "
-					"drop smsg: type=%d, flag=0x%04x, value=0x%08x\n",
-					msg->channel, msg->type, msg->flag, msg->value);
-			}
+/* handle one msg, return the channel mask to be woken up */
+static uint32_t smsg_dispatch(struct smsg_ipc *ipc, struct smsg *msg)
+{
+	struct smsg_channel *ch;
+	uint32_t used, wr;
+
+	if (msg->channel >= SMSG_CH_NR || msg->type >= SMSG_TYPE_NR) {
+		/* invalid msg */
+		printk(KERN_ERR "invalid smsg: channel=%d, type=%d, flag=0x%04x, value=0x%08x\n",
+			msg->channel, msg->type, msg->flag, msg->value);
+		ipc->rx_invalid++;
+		return 0;
+	}
 
-			/* update smsg rdptr */
-			writel(readl(ipc->rxbuf_rdptr) + 1, ipc->rxbuf_rdptr);
+	ch = ipc->channels[msg->channel];
+	if (!ch) {
+		if (ipc->states[msg->channel] == CHAN_STATE_UNUSED &&
+				msg->type == SMSG_TYPE_OPEN &&
+				msg->flag == SMSG_OPEN_MAGIC) {
 
-			continue;
+			ipc->states[msg->channel] = CHAN_STATE_WAITING;
+		} else {
+			/* drop this bad msg since channel is not opened */
+			printk(KERN_ERR "smsg channel %d not opened! "
+				"drop smsg: type=%d, flag=0x%04x, value=0x%08x\n",
+				msg->channel, msg->type, msg->flag, msg->value);
+			ipc->rx_invalid++;
 		}
+		return 0;
+	}
 
-		if ((int)(readl(ch->wrptr) - readl(ch->rdptr)) >= SMSG_CACHE_NR) {
-			/* msg cache is full, drop this msg */
+	used = readl(ch->wrptr) - readl(ch->rdptr);
+	if ((int)used >= ch->cache_nr) {
+		/* msg cache is full, drop this msg */
+		if (!ch->dropped++) {
 			printk(KERN_ERR "smsg channel %d recv cache is full! "
 				"drop smsg: type=%d, flag=0x%04x, value=0x%08x\n",
 				msg->channel, msg->type, msg->flag, msg->value);
-		} else {
-			/* write smsg to cache */
-			wr = readl(ch->wrptr) & (SMSG_CACHE_NR - 1);
-			memcpy(&(ch->caches[wr]), msg, sizeof(struct smsg));
-			writel(readl(ch->wrptr) + 1, ch->wrptr);
+		}
+	} else {
+		/* write smsg to cache */
+		wr = readl(ch->wrptr) & (ch->cache_nr - 1);
+		memcpy(&(ch->caches[wr]), msg, sizeof(struct smsg));
+		smp_wmb();
+		writel(readl(ch->wrptr) + 1, ch->wrptr);
+
+		ch->received++;
+		if (used + 1 > ch->hiwater) {
+			ch->hiwater = used + 1;
+		}
+	}
+
+	return 1 << msg->channel;
+}
+
+/*
+ * Threaded bottom half: drain the rx ring, waking each channel once
+ * per SMSG_IRQ_BUDGET msgs instead of once per msg.
+ */
+irqreturn_t smsg_irq_threadfn(int irq, void *dev_id)
+{
+	struct smsg_ipc *ipc = (struct smsg_ipc *)dev_id;
+	struct smsg *msg;
+	uint32_t rxpos, mask = 0;
+	int budget = SMSG_IRQ_BUDGET;
+	int count = 0;
+
+	while (readl(ipc->rxbuf_wrptr) != readl(ipc->rxbuf_rdptr)) {
+		if (budget-- == 0) {
+			/* let receivers run during msg storms */
+			smsg_wake_channels(ipc, mask);
+			mask = 0;
+			budget = SMSG_IRQ_BUDGET - 1;
+			cond_resched();
 		}
 
+		rxpos = (readl(ipc->rxbuf_rdptr) & (ipc->rxbuf_size - 1)) *
+			sizeof (struct smsg) + ipc->rxbuf_addr;
+		msg = (struct smsg *)rxpos;
+
+		pr_debug("irq get smsg: wrptr=%d, rdptr=%d, rxpos=0x%08x\n",
+			readl(ipc->rxbuf_wrptr), readl(ipc->rxbuf_rdptr), rxpos);
+		pr_debug("irq read smsg: channel=%d, type=%d, flag=0x%04x, value=0x%08x\n",
+			msg->channel, msg->type, msg->flag, msg->value);
+
+		mask |= smsg_dispatch(ipc, msg);
+
 		/* update smsg rdptr */
 		writel(readl(ipc->rxbuf_rdptr) + 1, ipc->rxbuf_rdptr);
+		count++;
+	}
+
+	smsg_wake_channels(ipc, mask);
 
-		wake_up_interruptible_all(&(ch->rxwait));
+	if (count) {
+		ipc->rx_batches++;
+		if (count > ipc->rx_max_batch) {
+			ipc->rx_max_batch = count;
+		}
 	}
 
 	return IRQ_HANDLED;
@@ -106,16 +182,24 @@ int smsg_ipc_create(uint8_t dst, struct smsg_ipc *ipc)
 	if (!ipc->irq_handler) {
 		ipc->irq_handler = smsg_irq_handler;
 	}
+	if (!ipc->irq_threadfn) {
+		ipc->irq_threadfn = smsg_irq_threadfn;
+	}
 
-	mutex_init(&(ipc->txlock));
+	spin_lock_init(&(ipc->txlock));
 	smsg_ipcs[dst] = ipc;
 
-	/* explicitly call irq handler in case of missing irq on boot */
-	ipc->irq_handler(ipc->irq, ipc);
+	/* explicitly dispatch msgs in case of missing irq on boot */
+	ipc->irq_threadfn(ipc->irq, ipc);
+
+	/* a backend without irq line calls irq_threadfn by itself */
+	if (ipc->irq < 0) {
+		return 0;
+	}
 
 	/* register IPI irq */
-	rval = request_irq(ipc->irq, ipc->irq_handler,
-			0, ipc->name, ipc);
+	rval = request_threaded_irq(ipc->irq, ipc->irq_handler,
+			ipc->irq_threadfn, 0, ipc->name, ipc);
 	if (rval != 0) {
 		printk(KERN_ERR "Failed to request irq %s: %d\n",
 				ipc->name, ipc->irq);
@@ -129,8 +213,12 @@ int smsg_ipc_destroy(uint8_t dst)
 {
 	struct smsg_ipc *ipc = smsg_ipcs[dst];
 
-	kthread_stop(ipc->thread);
-	free_irq(ipc->irq, ipc);
+	if (ipc->thread) {
+		kthread_stop(ipc->thread);
+	}
+	if (ipc->irq >= 0) {
+		free_irq(ipc->irq, ipc);
+	}
 	smsg_ipcs[dst] = NULL;
 
 	return 0;
@@ -150,6 +238,14 @@ int smsg_ch_open(uint8_t dst, uint8_t channel, int timeout)
 		return -ENOMEM;
 	}
 
+	ch->cache_nr = cache_nr[channel] ?
+		roundup_pow_of_two(cache_nr[channel]) : SMSG_CACHE_NR;
+	ch->caches = kzalloc(sizeof(struct smsg) * ch->cache_nr, GFP_KERNEL);
+	if (!ch->caches) {
+		kfree(ch);
+		return -ENOMEM;
+	}
+
 	init_waitqueue_head(&(ch->rxwait));
 	mutex_init(&(ch->rxlock));
 	ipc->channels[channel] = ch;
@@ -157,7 +253,7 @@ int smsg_ch_open(uint8_t dst, uint8_t channel, int timeout)
 	smsg_set(&mopen, channel, SMSG_TYPE_OPEN, SMSG_OPEN_MAGIC, 0);
 	rval = smsg_send(dst, &mopen, timeout);
 	if (rval != 0) {
-		return rval;
+		goto open_failed;
 	}
 
 	/* open msg might be got before */
@@ -168,21 +264,27 @@ int smsg_ch_open(uint8_t dst, uint8_t channel, int timeout)
 	smsg_set(&mrecv, channel, 0, 0, 0);
 	rval = smsg_recv(dst, &mrecv, timeout);
 	if (rval != 0) {
-		ipc->channels[channel] = NULL;
-		return rval;
+		goto open_failed;
 	}
 
 	if (mrecv.type != SMSG_TYPE_OPEN || mrecv.flag != SMSG_OPEN_MAGIC) {
 		printk(KERN_ERR "Got bad open msg on channel %d-%d\n",
 				dst, channel);
-		ipc->channels[channel] = NULL;
-		return -EIO;
+		rval = -EIO;
+		goto open_failed;
 	}
 
 open_done:
 	ipc->states[channel] = CHAN_STATE_OPENED;
 
 	return 0;
+
+open_failed:
+	ipc->channels[channel] = NULL;
+	kfree(ch->caches);
+	kfree(ch);
+
+	return rval;
 }
 
 int smsg_ch_close(uint8_t dst, uint8_t channel,  int timeout)
@@ -193,6 +295,7 @@ int smsg_ch_close(uint8_t dst, uint8_t channel,  int timeout)
 	smsg_set(&mclose, channel, SMSG_TYPE_CLOSE, SMSG_CLOSE_MAGIC, 0);
 	smsg_send(dst, &mclose, timeout);
 
+	kfree(ipc->channels[channel]->caches);
 	kfree(ipc->channels[channel]);
 	ipc->channels[channel] = NULL;
 
@@ -203,7 +306,8 @@ int smsg_send(uint8_t dst, struct smsg *msg, int timeout)
 {
 	struct smsg_ipc *ipc = smsg_ipcs[dst];
 	uint32_t txpos;
-	int rval = 0;
+	unsigned long flags;
+	bool nowait;
 
 	if (!ipc->channels[msg->channel]) {
 		printk(KERN_ERR "channel %d not inited!\n", msg->channel);
@@ -221,40 +325,32 @@ int smsg_send(uint8_t dst, struct smsg *msg, int timeout)
 	pr_debug("send smsg: channel=%d, type=%d, flag=0x%04x, value=0x%08x\n",
 			msg->channel, msg->type, msg->flag, msg->value);
 
-	if (timeout == 0) {
-		if (!mutex_trylock(&(ipc->txlock))) {
-			printk(KERN_INFO "send smsg busy!\n");
-			return -EBUSY;
-		}
-
-		/* no wait */
+	nowait = (timeout == 0);
+	if (timeout < 0)
+		timeout = 3600 * 1000;	/* 1 hour */
+
+	/*
+	 * The ring is only touched under the txlock spinlock, so a send
+	 * with timeout 0 never sleeps and may be used from softirq.
+	 * Blocking sends sleep between attempts with the lock dropped.
+	 */
+	for (;;) {
+		spin_lock_irqsave(&ipc->txlock, flags);
 		if ((int)(readl(ipc->txbuf_wrptr) -
-			readl(ipc->txbuf_rdptr)) >= ipc->txbuf_size) {
+			readl(ipc->txbuf_rdptr)) < ipc->txbuf_size)
+			break;
+		spin_unlock_irqrestore(&ipc->txlock, flags);
 
-			printk(KERN_WARNING "smsg txbuf is full!\n");
-			rval = -EBUSY;
-
-			goto send_failed;
+		if (nowait) {
+			pr_debug("smsg txbuf is full!\n");
+			return -EBUSY;
 		}
-	} else {
-		mutex_lock(&(ipc->txlock));
-
-		/* wait timeout */
 		if (timeout < 0) {
-			timeout =  3600 * 1000;	/* 1 hour */
-		}
-
-		while ((int)(readl(ipc->txbuf_wrptr) -
-			readl(ipc->txbuf_rdptr)) >= ipc->txbuf_size) {
-			if (timeout < 0) {
-				printk(KERN_WARNING "smsg txbuf is full, timeout!\n");
-				rval = -ETIME;
-
-				goto send_failed;
-			}
-			msleep(10);
-			timeout -= 10;
+			printk(KERN_WARNING "smsg txbuf is full, timeout!\n");
+			return -ETIME;
 		}
+		msleep(10);
+		timeout -= 10;
 	}
 
 	/* calc txpos and write smsg */
@@ -269,11 +365,9 @@ int smsg_send(uint8_t dst, struct smsg *msg, int timeout)
 	/* update wrptr */
 	writel(readl(ipc->txbuf_wrptr) + 1, ipc->txbuf_wrptr);
 	ipc->txirq_trigger();
+	spin_unlock_irqrestore(&ipc->txlock, flags);
 
-send_failed:
-	mutex_unlock(&(ipc->txlock));
-
-	return rval;
+	return 0;
 }
 
 int smsg_recv(uint8_t dst, struct smsg *msg, int timeout)
@@ -334,7 +428,8 @@ int smsg_recv(uint8_t dst, struct smsg *msg, int timeout)
 	}
 
 	/* read smsg from cache */
-	rd = readl(ch->rdptr) & (SMSG_CACHE_NR - 1);
+	smp_rmb();
+	rd = readl(ch->rdptr) & (ch->cache_nr - 1);
 	memcpy(msg, &(ch->caches[rd]), sizeof(struct smsg));
 	writel(readl(ch->rdptr) + 1, ch->rdptr);
 
@@ -349,6 +444,65 @@ recv_failed:
 	return rval;
 }
 
+#ifdef CONFIG_DEBUG_FS
+static int smsg_debug_show(struct seq_file *m, void *private)
+{
+	struct smsg_ipc *ipc;
+	struct smsg_channel *ch;
+	int i, j;
+
+	for (i = 0; i < SIPC_ID_NR; i++) {
+		ipc = smsg_ipcs[i];
+		if (!ipc) {
+			continue;
+		}
+
+		seq_printf(m, "sipc: %s, batches: %u, max batch: %u, invalid: %u\n",
+			ipc->name, ipc->rx_batches, ipc->rx_max_batch,
+			ipc->rx_invalid);
+		seq_printf(m, "  txbuf: wrptr=%u, rdptr=%u\n",
+			readl(ipc->txbuf_wrptr), readl(ipc->txbuf_rdptr));
+		seq_printf(m, "  rxbuf: wrptr=%u, rdptr=%u\n",
+			readl(ipc->rxbuf_wrptr), readl(ipc->rxbuf_rdptr));
+
+		for (j = 0; j < SMSG_CH_NR; j++) {
+			ch = ipc->channels[j];
+			if (!ch) {
+				continue;
+			}
+			seq_printf(m, "  channel %d: state=%d, cache=%u/%u, "
+				"hiwater=%u, received=%u, dropped=%u\n",
+				j, ipc->states[j],
+				readl(ch->wrptr) - readl(ch->rdptr), ch->cache_nr,
+				ch->hiwater, ch->received, ch->dropped);
+		}
+	}
+
+	return 0;
+}
+
+static int smsg_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, smsg_debug_show, inode->i_private);
+}
+
+static const struct file_operations smsg_debug_fops = {
+	.open = smsg_debug_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init smsg_debugfs_init(void)
+{
+	debugfs_create_file("smsg", S_IRUGO, sipc_debugfs_root(), NULL,
+			&smsg_debug_fops);
+	return 0;
+}
+
+late_initcall(smsg_debugfs_init);
+#endif /* CONFIG_DEBUG_FS */
+
 EXPORT_SYMBOL(smsg_ch_open);
 EXPORT_SYMBOL(smsg_ch_close);
 EXPORT_SYMBOL(smsg_send);
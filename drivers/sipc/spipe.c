@@ -139,6 +139,13 @@ static int __devinit spipe_probe(struct platform_device *pdev)
 		return rval;
 	}
 
+	if (init->mode) {
+		for (i = 0; i < init->ringnr; i++) {
+			sbuf_set_mode(init->dst, init->channel, i,
+				init->mode, 0, 0);
+		}
+	}
+
 	spipe = kzalloc(sizeof(struct spipe_device), GFP_KERNEL);
 	if (spipe == NULL) {
 		sbuf_destroy(init->dst, init->channel);
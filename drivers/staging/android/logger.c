@@ -25,6 +25,7 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -36,32 +37,40 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The offsets and the reader list
+ * are protected by the spinlock 'lock'.
+ *
+ * Writers reserve [w_resv, w_resv + len) under the lock, fill it without
+ * the lock and then publish it by moving w_off, in reservation order.
+ * Readers only ever look at entries before w_off.
  */
 struct logger_log {
 	unsigned char		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	spinlock_t		lock;	/* lock protecting offsets */
+	size_t			w_off;	/* end of the last published entry */
+	size_t			w_resv;	/* end of the last reserved entry */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_log	*mmap_log; /* page 0 of a reader mmap */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	unsigned int		lapped;	/* times a writer moved r_off */
 	bool			r_all;	/* reader can read all entries */
 	int			r_ver;	/* reader ABI version */
+	struct logger_mmap_reader *mmap_rd; /* page 1 of a reader mmap */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -123,7 +132,7 @@ static struct logger_entry *get_entry_header(struct logger_log *log,
  * In the log, the length does not include the size of the log entry structure.
  * This function returns the size including the log entry structure.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_msg_len(struct logger_log *log, size_t off)
 {
@@ -167,14 +176,15 @@ static ssize_t copy_header_to_user(int ver, struct logger_entry *entry,
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * do_read_log_to_user - reads exactly 'count' bytes of the entry at 'off'
+ * from 'log' into the user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Called without log->lock; the caller checks reader->lapped afterwards
+ * to find out whether a writer overwrote the entry meanwhile.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
-				   char __user *buf,
+				   size_t off, char __user *buf,
 				   size_t count)
 {
 	struct logger_entry scratch;
@@ -186,14 +196,13 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * First, copy the header to userspace, using the version of
 	 * the header requested
 	 */
-	entry = get_entry_header(log, reader->r_off, &scratch);
+	entry = get_entry_header(log, off, &scratch);
 	if (copy_header_to_user(reader->r_ver, entry, buf))
 		return -EFAULT;
 
 	count -= get_user_hdr_len(reader->r_ver);
 	buf += get_user_hdr_len(reader->r_ver);
-	msg_start = logger_offset(log,
-		reader->r_off + sizeof(struct logger_entry));
+	msg_start = logger_offset(log, off + sizeof(struct logger_entry));
 
 	/*
 	 * We read from the msg in two disjoint operations. First, we read from
@@ -212,12 +221,22 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(log, reader->r_off +
-		sizeof(struct logger_entry) + count);
-
 	return count + get_user_hdr_len(reader->r_ver);
 }
 
+/*
+ * set_reader_off - moves 'reader' to 'off' and mirrors it into the
+ * reader's mmap page, if any.
+ *
+ * Caller must hold log->lock.
+ */
+static void set_reader_off(struct logger_reader *reader, size_t off)
+{
+	reader->r_off = off;
+	if (reader->mmap_rd)
+		reader->mmap_rd->r_off = off;
+}
+
 /*
  * get_next_entry_by_uid - Starting at 'off', returns an offset into
  * 'log->buffer' which contains the first entry readable by 'euid'
@@ -259,17 +278,19 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	unsigned int lapped;
+	size_t off, msg_len;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -290,31 +311,43 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+		set_reader_off(reader, get_next_entry_by_uid(log,
+			reader->r_off, current_euid()));
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_user_hdr_len(reader->r_ver) +
-		get_entry_msg_len(log, reader->r_off);
+	msg_len = get_entry_msg_len(log, reader->r_off);
+	ret = get_user_hdr_len(reader->r_ver) + msg_len;
 	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+		spin_unlock(&log->lock);
+		return -EINVAL;
 	}
+	off = reader->r_off;
+	lapped = reader->lapped;
+	spin_unlock(&log->lock);
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, reader, off, buf, ret);
+	if (ret < 0)
+		return ret;
 
-out:
-	mutex_unlock(&log->mutex);
+	spin_lock(&log->lock);
+	if (unlikely(reader->lapped != lapped)) {
+		/* a writer overwrote the entry while it was being copied */
+		spin_unlock(&log->lock);
+		goto start;
+	}
+	set_reader_off(reader, logger_offset(log, off +
+		sizeof(struct logger_entry) + msg_len));
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -323,7 +356,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -368,91 +401,90 @@ static inline int is_between(size_t a, size_t b, size_t c)
 	return 0;
 }
 
+/*
+ * is_overwritten - will reserving [old, new) clobber the entry at 'c'?
+ *
+ * Like is_between(), except that while other reservations are still in
+ * flight an entry starting right at 'old' is the oldest one in the log,
+ * not a caught-up reader, so it gets overwritten too.
+ */
+static inline int is_overwritten(struct logger_log *log, size_t old,
+				 size_t new, size_t c)
+{
+	if (c == old)
+		return old != log->w_off;
+	return is_between(old, new, c);
+}
+
 /*
  * fix_up_readers - walk the list of all readers and "fix up" any who were
  * lapped by the writer; also do the same for the default "start head".
  * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
+ * entry after the new reservation.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
-	size_t old = log->w_off;
+	size_t old = log->w_resv;
 	size_t new = logger_offset(log, old + len);
 	struct logger_reader *reader;
 
-	if (is_between(old, new, log->head))
+	if (is_overwritten(log, old, new, log->head))
 		log->head = get_next_entry(log, log->head, len);
 
 	list_for_each_entry(reader, &log->readers, list)
-		if (is_between(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+		if (is_overwritten(log, old, new, reader->r_off)) {
+			set_reader_off(reader,
+				get_next_entry(log, reader->r_off, len));
+			reader->lapped++;
+			if (reader->mmap_rd)
+				reader->mmap_rd->lapped = reader->lapped;
+		}
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller must own a reservation covering the range.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off,
+			 const void *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
+ * Payloads up to this size are gathered on the stack, larger ones in a
+ * kmalloc'ed bounce buffer.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
-{
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
-
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			/*
-			 * Note that by not updating w_off, this abandons the
-			 * portion of the new entry that *was* successfully
-			 * copied, just above.  This is intentional to avoid
-			 * message corruption from missing fragments.
-			 */
-			return -EFAULT;
-
-	log->w_off = logger_offset(log, log->w_off + count);
-
-	return count;
-}
+#define LOGGER_STACK_PAYLOAD	256
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The payload is gathered from user space before anything is reserved, so
+ * a fault can never leave a hole in the ring.  Between reservation and
+ * publication the writer does not sleep and runs with preemption off, so
+ * a later writer waiting for its turn to publish only spins for a memcpy.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	char stack_payload[LOGGER_STACK_PAYLOAD];
 	struct logger_entry header;
 	struct timespec now;
+	char *payload;
+	size_t off, len;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -469,42 +501,75 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
+	if (header.len <= LOGGER_STACK_PAYLOAD)
+		payload = stack_payload;
+	else {
+		payload = kmalloc(header.len, GFP_KERNEL);
+		if (!payload)
+			return -ENOMEM;
+	}
 
+	while (nr_segs-- > 0 && ret < header.len) {
 		/* figure out how much of this vector we can keep */
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		if (copy_from_user(payload + ret, iov->iov_base, len)) {
+			ret = -EFAULT;
+			goto out;
 		}
 
 		iov++;
-		ret += nr;
+		ret += len;
 	}
 
-	mutex_unlock(&log->mutex);
+	len = sizeof(struct logger_entry) + header.len;
+
+	preempt_disable();
+	spin_lock(&log->lock);
+
+	/*
+	 * Keep the unpublished part of the ring well below its size so a
+	 * reservation never reaches entries that are still being filled.
+	 */
+	while (logger_offset(log, log->w_resv - log->w_off) + len >
+	       log->size / 2) {
+		spin_unlock(&log->lock);
+		cpu_relax();
+		spin_lock(&log->lock);
+	}
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the end of our reservation.
+	 */
+	fix_up_readers(log, len);
+	off = log->w_resv;
+	log->w_resv = logger_offset(log, off + len);
+	spin_unlock(&log->lock);
+
+	do_write_log(log, off, &header, sizeof(struct logger_entry));
+	do_write_log(log, logger_offset(log, off + sizeof(struct logger_entry)),
+		     payload, header.len);
+
+	/* publish in reservation order */
+	while (ACCESS_ONCE(log->w_off) != off)
+		cpu_relax();
+
+	spin_lock(&log->lock);
+	log->w_off = logger_offset(log, off + len);
+	if (log->mmap_log) {
+		smp_wmb();
+		log->mmap_log->w_off = log->w_off;
+	}
+	spin_unlock(&log->lock);
+	preempt_enable();
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
 
+out:
+	if (payload != stack_payload)
+		kfree(payload);
 	return ret;
 }
 
@@ -539,13 +604,15 @@ static int logger_open(struct inode *inode, struct file *file)
 		reader->r_ver = 1;
 		reader->r_all = in_egroup_p(inode->i_gid) ||
 			capable(CAP_SYSLOG);
+		reader->lapped = 0;
+		reader->mmap_rd = NULL;
 
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -565,10 +632,12 @@ static int logger_release(struct inode *ignored, struct file *file)
 		struct logger_reader *reader = file->private_data;
 		struct logger_log *log = reader->log;
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
+		if (reader->mmap_rd)
+			free_page((unsigned long)reader->mmap_rd);
 		kfree(reader);
 	}
 
@@ -598,14 +667,14 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (!reader->r_all)
-		reader->r_off = get_next_entry_by_uid(log,
-			reader->r_off, current_euid());
+		set_reader_off(reader, get_next_entry_by_uid(log,
+			reader->r_off, current_euid()));
 
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -623,6 +692,30 @@ static long logger_set_version(struct logger_reader *reader, void __user *arg)
 	return 0;
 }
 
+/*
+ * logger_set_read_off - an mmap reader consumed everything up to 'off'.
+ * 'off' must be an entry boundary between the reader's r_off and w_off.
+ *
+ * Caller must hold log->lock.
+ */
+static long logger_set_read_off(struct logger_log *log,
+				struct logger_reader *reader, size_t off)
+{
+	size_t pos = reader->r_off;
+
+	if (off >= log->size)
+		return -EINVAL;
+
+	while (pos != off) {
+		if (pos == log->w_off)
+			return -EINVAL;
+		pos = logger_offset(log, pos + sizeof(struct logger_entry) +
+				    get_entry_msg_len(log, pos));
+	}
+	set_reader_off(reader, off);
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
@@ -630,7 +723,15 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	long ret = -EINVAL;
 	void __user *argp = (void __user *) arg;
 
-	mutex_lock(&log->mutex);
+	/* may fault on argp, and only touches reader-private state */
+	if (cmd == LOGGER_SET_VERSION) {
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		reader = file->private_data;
+		return logger_set_version(reader, argp);
+	}
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -655,8 +756,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 
 		if (!reader->r_all)
-			reader->r_off = get_next_entry_by_uid(log,
-				reader->r_off, current_euid());
+			set_reader_off(reader, get_next_entry_by_uid(log,
+				reader->r_off, current_euid()));
 
 		if (log->w_off != reader->r_off)
 			ret = get_user_hdr_len(reader->r_ver) +
@@ -674,8 +775,12 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EPERM;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
+		list_for_each_entry(reader, &log->readers, list) {
+			set_reader_off(reader, log->w_off);
+			reader->lapped++;
+			if (reader->mmap_rd)
+				reader->mmap_rd->lapped = reader->lapped;
+		}
 		log->head = log->w_off;
 		ret = 0;
 		break;
@@ -687,21 +792,89 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		reader = file->private_data;
 		ret = reader->r_ver;
 		break;
-	case LOGGER_SET_VERSION:
+	case LOGGER_SET_READ_OFF:
 		if (!(file->f_mode & FMODE_READ)) {
 			ret = -EBADF;
 			break;
 		}
 		reader = file->private_data;
-		ret = logger_set_version(reader, argp);
+		if (!reader->mmap_rd) {
+			ret = -EINVAL;
+			break;
+		}
+		ret = logger_set_read_off(log, reader, arg);
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * logger_mmap - maps the log read-only for a reader that may see every
+ * entry; see the layout in logger.h. Only logs whose ring is in lowmem
+ * get an mmap_log page, see init_log().
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	struct logger_mmap_reader *rd;
+	unsigned long addr = vma->vm_start;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	reader = file->private_data;
+	log = reader->log;
+
+	if (!reader->r_all)
+		return -EPERM;
+	if (!log->mmap_log)
+		return -ENODEV;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start !=
+	    LOGGER_MMAP_HDR_PAGES * PAGE_SIZE + log->size)
+		return -EINVAL;
+
+	rd = (struct logger_mmap_reader *)get_zeroed_page(GFP_KERNEL);
+	if (!rd)
+		return -ENOMEM;
+
+	spin_lock(&log->lock);
+	if (reader->mmap_rd) {
+		spin_unlock(&log->lock);
+		free_page((unsigned long)rd);
+		return -EBUSY;
+	}
+	rd->r_off = reader->r_off;
+	rd->lapped = reader->lapped;
+	reader->mmap_rd = rd;
+	spin_unlock(&log->lock);
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	ret = remap_pfn_range(vma, addr,
+			virt_to_phys(log->mmap_log) >> PAGE_SHIFT,
+			PAGE_SIZE, vma->vm_page_prot);
+	addr += PAGE_SIZE;
+	if (!ret)
+		ret = remap_pfn_range(vma, addr,
+				virt_to_phys(rd) >> PAGE_SHIFT,
+				PAGE_SIZE, vma->vm_page_prot);
+	addr += PAGE_SIZE;
+	if (!ret)
+		ret = remap_pfn_range(vma, addr,
+				virt_to_phys(log->buffer) >> PAGE_SHIFT,
+				log->size, vma->vm_page_prot);
+
+	/* rd stays with the reader until release, like a successful map */
+	return ret;
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
@@ -709,17 +882,20 @@ static const struct file_operations logger_fops = {
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
+	.mmap = logger_mmap,
 	.open = logger_open,
 	.release = logger_release,
 };
 
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, and greater than
+ * must be a power of two, and greater than twice
  * (LOGGER_ENTRY_MAX_PAYLOAD + sizeof(struct logger_entry)).
+ * The buffer is page aligned so that readers can mmap it when the driver is
+ * built in.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -730,8 +906,9 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.w_resv = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
@@ -758,6 +935,20 @@ static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	/*
+	 * logger_mmap hands the ring to userspace by pfn, which is only
+	 * valid in the linear map: built as a module, the ring sits in
+	 * vmalloc space, so such a log just can't be mmapped. Without the
+	 * page the log still works otherwise.
+	 */
+	if (virt_addr_valid(log->buffer) &&
+	    virt_addr_valid(log->buffer + log->size - 1)) {
+		log->mmap_log = (struct logger_mmap_log *)
+			get_zeroed_page(GFP_KERNEL);
+		if (log->mmap_log)
+			log->mmap_log->size = log->size;
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -51,6 +51,32 @@ struct logger_entry {
 	char		msg[0];		/* the entry's payload */
 };
 
+/*
+ * Readers allowed to see every entry may mmap() the log read-only:
+ *
+ *	page 0	struct logger_mmap_log, shared by all readers of the log
+ *	page 1	struct logger_mmap_reader, private to the open file
+ *	page 2-	the ring itself, LOGGER_GET_LOG_BUF_SIZE bytes
+ *
+ * Entries between the reader's r_off and the log's w_off are complete and
+ * in struct logger_entry format.  If 'lapped' changes while an entry is
+ * being copied out, a writer overtook the reader and the copy is stale.
+ * Consumed entries are handed back with LOGGER_SET_READ_OFF, which fails
+ * with EINVAL if the reader was lapped and the offset is no longer ahead.
+ * mmap() fails with ENODEV when the driver is built as a module.
+ */
+struct logger_mmap_log {
+	__u32		size;		/* size of the ring */
+	__u32		w_off;		/* end of the last published entry */
+};
+
+struct logger_mmap_reader {
+	__u32		r_off;		/* next entry for this reader */
+	__u32		lapped;		/* bumped when a writer laps r_off */
+};
+
+#define LOGGER_MMAP_HDR_PAGES	2
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -66,5 +92,6 @@ struct logger_entry {
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
 #define LOGGER_GET_VERSION		_IO(__LOGGERIO, 5) /* abi version */
 #define LOGGER_SET_VERSION		_IO(__LOGGERIO, 6) /* abi version */
+#define LOGGER_SET_READ_OFF		_IO(__LOGGERIO, 7) /* mmap consumed */
 
 #endif /* _LINUX_LOGGER_H */
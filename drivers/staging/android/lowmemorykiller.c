@@ -40,6 +40,9 @@
 #include <linux/device.h>
 #include <linux/err.h>
 #include <linux/mm_inline.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/ktime.h>
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 #include <linux/memory.h>
 #include <linux/memory_hotplug.h>
@@ -47,6 +50,10 @@
 #include <linux/swap.h>
 #include <linux/string.h>
 #include <linux/spinlock_types.h>
+#include <linux/list.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/vmstat.h>
 
 #ifdef CONFIG_ANDROID_LMK_ENHANCE
 #define LOWMEM_DEATHPENDING_DEPTH 3
@@ -163,6 +170,7 @@ extern atomic_t optimize_comp_on;
 
 int lowmemkiller_reclaim_adj = 1;
 int swap_to_zram(int  nr_to_scan,  int  min_adj, int max_adj);
+static void lmk_swapd_wakeup(int min_adj, int buddy_free);
 
 extern int isolate_lru_page_compcache(struct page *page);
 extern void putback_lru_page(struct page *page);
@@ -180,6 +188,35 @@ extern unsigned int zone_id_shrink_pagelist(struct zone *zone_id,struct list_hea
 
 static unsigned int check_free_memory = 0;
 
+/*
+ * Swapping background apps out to zram is done by the lmk_swapd thread.
+ * lowmem_shrink only posts the pressure seen by kswapd; a request that
+ * arrives while the previous one is still pending replaces it.
+ */
+static struct task_struct *lmk_swapd_task;
+static DECLARE_WAIT_QUEUE_HEAD(lmk_swapd_wait);
+static DEFINE_SPINLOCK(lmk_swapd_lock);
+static int lmk_swapd_min_adj;		/* 0: nothing pending */
+static int lmk_swapd_buddy_free;
+
+/* Reported through /sys/class/lmk/lowmemorykiller/swap_stat */
+static struct lmk_swap_stat {
+	unsigned long requests;		/* wakeups posted by kswapd */
+	unsigned long coalesced;	/* ... while one was still pending */
+	unsigned long passes;		/* reclaim passes run by lmk_swapd */
+	unsigned long procs;		/* processes scanned by those passes */
+	unsigned long pages_isolated;
+	unsigned long pages_reclaimed;
+	unsigned long pass_ms;		/* total time spent in passes */
+	unsigned long max_pass_ms;
+	unsigned long proc_reclaims;	/* /proc/<pid>/reclaim and lmk_state */
+	unsigned long proc_pages_reclaimed;
+	unsigned long stalls;		/* direct reclaimers in lowmem_shrink */
+	unsigned long stall_us;		/* total time they spent there */
+	unsigned long max_stall_us;
+} lmk_swap_stat;
+static DEFINE_SPINLOCK(lmk_swap_stat_lock);
+
 enum pageout_io {
 	PAGEOUT_IO_ASYNC,
 	PAGEOUT_IO_SYNC,
@@ -200,6 +237,102 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
+/*
+ * Processes indexed by oom_adj, so that picking a victim only looks at
+ * the tasks that can be killed at the current level instead of walking
+ * every process. Entries are added when oom_adj is written through
+ * /proc, which is how the activity manager ranks each app, and dropped
+ * from the task free notifier. Processes that never had their oom_adj
+ * written are picked up by lowmem_index_sync() when a lookup finds
+ * nothing to kill. The entry is embedded in the task_struct, so
+ * indexing a process never allocates.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+/* How long a sampled task size stays valid */
+#define LOWMEM_RSS_TTL		(HZ / 10)
+/* Minimum interval between two lowmem_index_sync() calls */
+#define LOWMEM_SYNC_INTERVAL	HZ
+
+/*
+ * Nests inside tasklist_lock. The task free notifier takes it from the
+ * RCU callback too, so everybody else keeps softirqs off while holding
+ * it. Only held for the list updates and the victim scan itself.
+ */
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct list_head lowmem_adj_list[LOWMEM_ADJ_BUCKETS];
+static unsigned long lowmem_sync_time;
+
+static struct list_head *lowmem_adj_bucket(int adj)
+{
+	if (adj < OOM_DISABLE)
+		adj = OOM_DISABLE;
+	if (adj > OOM_ADJUST_MAX)
+		adj = OOM_ADJUST_MAX;
+	return &lowmem_adj_list[adj - OOM_DISABLE];
+}
+
+/*
+ * Add @task with its current oom_adj, or move it to the right bucket if
+ * it is already indexed. Called with lowmem_index_lock held.
+ */
+static void lowmem_index_update(struct task_struct *task)
+{
+	struct lowmem_task *lt = &task->lowmem;
+	int adj = task->signal->oom_adj;
+
+	if (!list_empty(&lt->node)) {
+		if (lt->adj != adj) {
+			lt->adj = adj;
+			list_move_tail(&lt->node, lowmem_adj_bucket(adj));
+		}
+		return;
+	}
+
+	lt->adj = adj;
+	lt->tasksize = 0;
+	lt->tasksize_time = jiffies - LOWMEM_RSS_TTL - 1;
+	list_add_tail(&lt->node, lowmem_adj_bucket(adj));
+}
+
+/* Called from /proc/<pid>/oom_adj and oom_score_adj after a write */
+void lowmem_adj_changed(struct task_struct *task)
+{
+	spin_lock_bh(&lowmem_index_lock);
+	lowmem_index_update(task->group_leader);
+	spin_unlock_bh(&lowmem_index_lock);
+}
+
+/*
+ * Index every process that could be killed but is not known yet, e.g.
+ * children of apps, which inherit oom_adj without anyone writing it.
+ * Called with tasklist_lock and lowmem_index_lock held.
+ */
+static void lowmem_index_sync(void)
+{
+	struct task_struct *p;
+
+	lowmem_sync_time = jiffies;
+	for_each_process(p) {
+		if (!p->mm || p->signal->oom_adj < 0)
+			continue;
+		lowmem_index_update(p);
+	}
+}
+
+/* Size of an indexed task, resampled once LOWMEM_RSS_TTL has passed */
+static int lowmem_task_size(struct lowmem_task *lt, struct mm_struct *mm)
+{
+	if (time_after(jiffies, lt->tasksize_time + LOWMEM_RSS_TTL)) {
+#ifdef CONFIG_ZRAM
+		lt->tasksize = get_mm_rss(mm) + get_mm_counter(mm, MM_SWAPENTS);
+#else
+		lt->tasksize = get_mm_rss(mm);
+#endif
+		lt->tasksize_time = jiffies;
+	}
+	return lt->tasksize;
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -211,9 +344,22 @@ static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
-
+	unsigned long flags;
 #ifdef CONFIG_ANDROID_LMK_ENHANCE
 	int i = 0;
+#endif
+
+	/*
+	 * Not only leaders: after an exec from a secondary thread the
+	 * indexed task is no longer the leader of its group.
+	 */
+	if (!list_empty(&task->lowmem.node)) {
+		spin_lock_irqsave(&lowmem_index_lock, flags);
+		list_del_init(&task->lowmem.node);
+		spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	}
+
+#ifdef CONFIG_ANDROID_LMK_ENHANCE
 	for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++)
 		if (task == lowmem_deathpending[i]) {
 			lowmem_deathpending[i] = NULL;
@@ -436,9 +582,231 @@ static void lowmem_mem_leak_account(struct task_struct *p)
 }
 #endif
 
+/*
+ * Memory pressure notification through /dev/lmk_pressure, so that
+ * userspace can trim caches before anything gets killed. The level is
+ * graded like the kill decision in lowmem_shrink: level N means free
+ * memory and file cache are both within lowmem_pressure_margin percent
+ * of the minfree threshold at which the Nth highest adj tier is killed,
+ * 0 means no pressure. Along with it the share of pages scanned by
+ * vmscan that were actually reclaimed is reported.
+ *
+ * poll() signals POLLIN | POLLPRI whenever the level changed since the
+ * last read of that file; read() at offset 0 returns the current state.
+ * lowmem_shrink only runs while vmscan is reclaiming, so read() and
+ * poll() resample the counters themselves and a deferrable timer does
+ * the same while the level is raised, letting it fall back to 0 once
+ * memory is freed.
+ */
+static uint32_t lowmem_pressure_margin = 25;
+
+/* Minimum interval between two samples of the vmscan counters */
+#define LOWMEM_PRESSURE_INTERVAL	(HZ / 10)
+
+/* Resample period while the level is above 0 */
+#define LOWMEM_PRESSURE_DECAY		HZ
+
+static struct lowmem_pressure {
+	int level;
+	int min_adj;			/* adj killed at this level */
+	int other_free;
+	int other_file;
+	unsigned int efficiency;	/* percent, since last sample */
+	unsigned long seq;		/* bumped on level change */
+	unsigned long time;		/* jiffies of last sample */
+	unsigned long scanned;
+	unsigned long reclaimed;
+} lowmem_pressure;
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+static void lowmem_pressure_timeout(unsigned long data);
+static struct timer_list lowmem_pressure_timer =
+	TIMER_DEFERRED_INITIALIZER(lowmem_pressure_timeout, 0, 0);
+
+/* Free memory and file cache as weighed by the kill decision */
+static void lowmem_other_pages(int *other_free, int *other_file)
+{
+	*other_free = global_page_state(NR_FREE_PAGES);
+	*other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+#ifdef  CONFIG_ZRAM
+	*other_free -= totalreserve_pages;
+	if (*other_free < 0)
+		*other_free = 0;
+
+	*other_file -= total_swapcache_pages;
+	if (*other_file < 0)
+		*other_file = 0;
+#endif  /*CONFIG_ZRAM*/
+}
+
+#ifdef CONFIG_VM_EVENT_COUNTERS
+/*
+ * Sum of an event over all zones. FOR_ALL_ZONES lays the per-zone
+ * items out in zone order, ending with the _MOVABLE one. Counters are
+ * read without the hotplug lock, an approximation is good enough.
+ */
+static unsigned long lowmem_zone_events(enum vm_event_item last)
+{
+	unsigned long sum = 0;
+	int cpu, i;
+
+	for_each_online_cpu(cpu) {
+		struct vm_event_state *this = &per_cpu(vm_event_states, cpu);
+
+		for (i = 0; i < MAX_NR_ZONES; i++)
+			sum += this->event[last - i];
+	}
+	return sum;
+}
+
+static void lowmem_sample_reclaim(struct lowmem_pressure *lp)
+{
+	unsigned long scanned, reclaimed;
+
+	scanned = lowmem_zone_events(PGSCAN_KSWAPD_MOVABLE) +
+		  lowmem_zone_events(PGSCAN_DIRECT_MOVABLE);
+	reclaimed = lowmem_zone_events(PGSTEAL_MOVABLE);
+
+	if (scanned != lp->scanned)
+		lp->efficiency = min(100UL, (reclaimed - lp->reclaimed) * 100 /
+					    (scanned - lp->scanned));
+	else
+		lp->efficiency = 100;
+	lp->scanned = scanned;
+	lp->reclaimed = reclaimed;
+}
+#else
+static void lowmem_sample_reclaim(struct lowmem_pressure *lp)
+{
+	lp->efficiency = 100;
+}
+#endif
+
+static void lowmem_pressure_update(int other_free, int other_file)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int i, level = 0, min_adj = OOM_ADJUST_MAX + 1;
+	bool changed = false;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+
+	for (i = 0; i < array_size; i++) {
+		size_t minfree = lowmem_minfree[i] +
+			lowmem_minfree[i] * lowmem_pressure_margin / 100;
+
+		if (other_free < minfree && other_file < minfree) {
+			level = array_size - i;
+			min_adj = lowmem_adj[i];
+			break;
+		}
+	}
+
+	spin_lock_bh(&lowmem_pressure_lock);
+	if (level != lowmem_pressure.level ||
+	    time_after(jiffies, lowmem_pressure.time +
+				LOWMEM_PRESSURE_INTERVAL)) {
+		lowmem_pressure.time = jiffies;
+		lowmem_pressure.other_free = other_free;
+		lowmem_pressure.other_file = other_file;
+		lowmem_sample_reclaim(&lowmem_pressure);
+		if (level != lowmem_pressure.level) {
+			lowmem_pressure.level = level;
+			lowmem_pressure.min_adj = min_adj;
+			lowmem_pressure.seq++;
+			changed = true;
+		}
+	}
+	spin_unlock_bh(&lowmem_pressure_lock);
+
+	if (changed) {
+		lowmem_print(3, "lowmem_pressure level %d, ofree %d %d\n",
+			     level, other_free, other_file);
+		wake_up_interruptible(&lowmem_pressure_wait);
+	}
+	if (level && !timer_pending(&lowmem_pressure_timer))
+		mod_timer(&lowmem_pressure_timer,
+			  jiffies + LOWMEM_PRESSURE_DECAY);
+}
+
+static void lowmem_pressure_sample(void)
+{
+	int other_free, other_file;
+
+	lowmem_other_pages(&other_free, &other_file);
+	lowmem_pressure_update(other_free, other_file);
+}
+
+static void lowmem_pressure_timeout(unsigned long data)
+{
+	lowmem_pressure_sample();
+}
+
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	/* Report the current level on the first poll */
+	file->private_data = (void *)(lowmem_pressure.seq - 1);
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct lowmem_pressure lp;
+	char buffer[160];
+	size_t len;
+
+	lowmem_pressure_sample();
+	spin_lock_bh(&lowmem_pressure_lock);
+	lp = lowmem_pressure;
+	spin_unlock_bh(&lowmem_pressure_lock);
+
+	if (*ppos == 0)
+		file->private_data = (void *)lp.seq;
+
+	len = snprintf(buffer, sizeof(buffer),
+		       "level:      %d\n"
+		       "min_adj:    %d\n"
+		       "other_free: %d\n"
+		       "other_file: %d\n"
+		       "efficiency: %u\n",
+		       lp.level, lp.level ? lp.min_adj : OOM_ADJUST_MAX + 1,
+		       lp.other_free, lp.other_file, lp.efficiency);
+	return simple_read_from_buffer(buf, count, ppos, buffer, len);
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &lowmem_pressure_wait, wait);
+
+	lowmem_pressure_sample();
+	if ((unsigned long)file->private_data != lowmem_pressure.seq)
+		return POLLIN | POLLRDNORM | POLLPRI;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner		= THIS_MODULE,
+	.open		= lowmem_pressure_open,
+	.read		= lowmem_pressure_read,
+	.poll		= lowmem_pressure_poll,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "lmk_pressure",
+	.fops		= &lowmem_pressure_fops,
+};
+
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *p;
+	struct lowmem_task *lt;
+	int adj, synced = 0;
 #ifdef CONFIG_ANDROID_LMK_ENHANCE
 	struct task_struct *selected[LOWMEM_DEATHPENDING_DEPTH] = {NULL,};
 #else
@@ -461,29 +829,13 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	int selected_oom_adj;
 #endif
 	int array_size = ARRAY_SIZE(lowmem_adj);
-	int other_free = global_page_state(NR_FREE_PAGES);
-	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
+	int other_free, other_file;
 #ifdef CONFIG_ZRAM_FOR_ANDROID			
 	int  oom_adj_index = 0;
-	int to_reclaimed = 0;
 #endif  /*CONFIG_ZRAM_FOR_ANDROID*/
 
-
-#ifdef  CONFIG_ZRAM
-        other_free -= totalreserve_pages;
-	if(other_free < 0)	
-	{
-		other_free = 0;
-	}
-
-	other_file  -=  total_swapcache_pages;
-        if(other_file < 0)
-        {
-        	other_file = 0;
-        }
-#endif  /*CONFIG_ZRAM*/
-
+	lowmem_other_pages(&other_free, &other_file);
+	lowmem_pressure_update(other_free, other_file);
 
 	/*
 	 * If we already have a death outstanding, then
@@ -625,58 +977,28 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
                 if(lowmem_swap_app_enable && ((jiffies -lowmem_last_swap_time) >= swap_interval_time) \
                         && (min_adj>FRONT_APP_ADJ)/*for performance consideration, avoid swapin front app& system process*/\
                             && ((min_adj >= lowmem_adj[0]) && (min_adj < lowmem_adj[5]))/*avoid swap in empty process*/){
-			int times = 0;
 			struct sysinfo si = {0};
-                        int  count=0;
 			int  buddy_free = getbuddyfreepages()  >>  1;   //buddy pages /2
-                        int  start_adj=0;
-                        const static int  swap_thresh[15]={8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 102, 110, 118};
-                        const static int  swap_to_scan[15]={1024, 1024, 768, 768, 768, 512, 512, 512, 256, 256, 64, 64, 32, 16, 0};
-                        const static int  scan_num=1024;
-                        const static int  scan_max_times=2;
-                        
-                        if(buddy_free > scan_num){
-				buddy_free = scan_num;
-			}
 
-                        count=jiffies;
-                        /*Only run at buddy pages enough*/
-                        if(buddy_free > (SWAP_CLUSTER_MAX  << 1) ){
-                              for(start_adj=1; start_adj<min_adj; start_adj++){
-                                 /*swap policy:
-                                  * (a) if current mem pressure not high, swap harder(not easily exist)
-                                  * (b) if process has low oom_adj, this process will swap harder, for consideration this process
-                                  *     will not easily been killed*/
-                                 to_reclaimed += swap_to_zram((buddy_free*swap_to_scan[start_adj])/swap_to_scan[0], start_adj, start_adj);
-			
-			         lowmem_print(2,"[LMK_swap]buddy_free:%d, swap_to_scan[%d]:%d, to_reclaimed:%d,  min_adj:%d, time:%d ms\r\n", \
-                                         buddy_free, start_adj, swap_to_scan[start_adj], to_reclaimed,  min_adj, jiffies_to_msecs(jiffies-count));
-			
-			         if(to_reclaimed >= swap_thresh[min_adj]){
-			            swap_interval_time = default_interval_time;
-                                    return rem - to_reclaimed;
-			         }
-                             }
-                        }
-
-			if(0 == to_reclaimed){
-			       times = scan_max_times;
-			}
-			else{
-				times = buddy_free*(swap_to_scan[min_adj]/swap_to_scan[0])/to_reclaimed;
-				if(times > scan_max_times){
-					times = scan_max_times;
-				}
+			/*
+			 * Swapping out is left to lmk_swapd so that kswapd is
+			 * not held up walking page tables. Only run at buddy
+			 * pages enough, otherwise back off for longer.
+			 */
+			lowmem_last_swap_time = jiffies;
+			if(buddy_free > (SWAP_CLUSTER_MAX << 1)){
+				lmk_swapd_wakeup(min_adj, buddy_free);
+			}else{
+				swap_interval_time = default_interval_time * 2;
 			}
-			
-			swap_interval_time = default_interval_time * times;
-			lowmem_last_swap_time =  jiffies;	   
+
 			si_swapinfo(&si);
-                        lowmem_print(2,"[LMK_swap] buddy_free:%d, si.totalswap:%d, si.freeswap:%d, minfile:%d\r\n", \
+                        lowmem_print(2,"[LMK_swap] buddy_free:%d, si.totalswap:%lu, si.freeswap:%lu, minfile:%zu\r\n", \
                                 buddy_free, si.totalswap, si.freeswap, lowmem_minfile[oom_adj_index]);
 
+			/* Give swapping a chance before killing anything */
 			if( (si.totalswap - si.freeswap) < lowmem_minfile[oom_adj_index]){
-                                return rem - to_reclaimed;
+                                return rem;
 			}
                  }
 #endif
@@ -688,11 +1010,19 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 #endif
             lowmem_white_list_init();
             read_lock(&tasklist_lock);
-	    for_each_process(p) {
+	    spin_lock_bh(&lowmem_index_lock);
+retry:
+	    /* Highest oom_adj first, so the search can stop early */
+	    for (adj = OOM_ADJUST_MAX; adj >= min_adj && adj >= OOM_DISABLE; adj--) {
+	    list_for_each_entry(lt, lowmem_adj_bucket(adj), node) {
 		struct mm_struct *mm;
 		struct signal_struct *sig;
 		int oom_adj;
 
+		p = container_of(lt, struct task_struct, lowmem);
+		/* Released but not freed yet, signal may be gone */
+		if (!pid_alive(p))
+			continue;
 		task_lock(p);
 		mm = p->mm;
 		sig = p->signal;
@@ -727,11 +1057,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
                         task_unlock(p);
 			continue;
                 }
-#ifdef CONFIG_ZRAM
-		tasksize = get_mm_rss(p->mm) + get_mm_counter(p->mm, MM_SWAPENTS);
-#else		
-		tasksize = get_mm_rss(mm);
-#endif
+		tasksize = lowmem_task_size(lt, mm);
 		task_unlock(p);
 		if (tasksize <= 0){
 		    lowmem_print(6, " [LMK] [%d:%s] no task size skip, adj %d, %d\n",
@@ -756,10 +1082,6 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 
 			if (all_selected_oom < LOWMEM_DEATHPENDING_DEPTH)
 				all_selected_oom++;
-
-			lowmem_print(2, "[LMK] select %d (%s), adj %d, size %d, to kill\n",
-				p->pid, p->comm, oom_adj, tasksize);
-
 			break;
 		}
 #else
@@ -773,10 +1095,32 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		selected = p;
 		selected_tasksize = tasksize;
 		selected_oom_adj = oom_adj;
-		lowmem_print(2, "[LMK] select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+#endif
+	    }
+		/* Tasks in lower buckets can not beat those selected */
+#ifdef CONFIG_ANDROID_LMK_ENHANCE
+		if (all_selected_oom >= LOWMEM_DEATHPENDING_DEPTH)
+			break;
+#else
+		if (selected)
+			break;
 #endif
 	    }
+#ifdef CONFIG_ANDROID_LMK_ENHANCE
+	    if (!all_selected_oom && !synced &&
+#else
+	    if (!selected && !synced &&
+#endif
+		time_after(jiffies, lowmem_sync_time + LOWMEM_SYNC_INTERVAL)) {
+		lowmem_index_sync();
+		synced = 1;
+		goto retry;
+	    }
+	    /*
+	     * The index is not needed any more. tasklist_lock still keeps
+	     * the victims from being released while they are signalled.
+	     */
+	    spin_unlock_bh(&lowmem_index_lock);
 #ifdef CONFIG_ANDROID_LMK_ENHANCE
 	    for (i = 0; i < LOWMEM_DEATHPENDING_DEPTH; i++) {
 		if (selected[i]) {
@@ -789,6 +1133,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
  
                         if(selected[i]->pid == last_killed_pid && selected[i]->signal->oom_adj > 2) {
                             selected[i]->signal->oom_adj--;
+                            lowmem_adj_changed(selected[i]);
                          } else
                          last_killed_pid = selected[i]->pid;
                          rem -= selected_tasksize[i];
@@ -805,6 +1150,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		force_sig(SIGKILL, selected);
                 if(selected->pid == last_killed_pid && selected->signal->oom_adj > 2) {
                        selected->signal->oom_adj--;
+                       lowmem_adj_changed(selected);
                 } else
                        last_killed_pid = selected->pid;
                 
@@ -826,6 +1172,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
                     force_sig(SIGKILL, wl_selected);
                     if(wl_selected->pid == last_killed_pid && wl_selected->signal->oom_adj > 2) {
                        wl_selected->signal->oom_adj--;
+                       lowmem_adj_changed(wl_selected);
                     } else
                        last_killed_pid = wl_selected->pid;
 
@@ -840,8 +1187,41 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
         return rem;
 }
 
+#ifdef CONFIG_ZRAM_FOR_ANDROID
+/*
+ * Account the time tasks in direct reclaim spend in lowmem_shrink, the
+ * stall that moving swap_to_zram out to lmk_swapd is meant to remove.
+ */
+static int lowmem_shrink_timed(struct shrinker *s, struct shrink_control *sc)
+{
+	ktime_t start;
+	unsigned long us;
+	int rem;
+
+	if (current_is_kswapd() || sc->nr_to_scan <= 0)
+		return lowmem_shrink(s, sc);
+
+	start = ktime_get();
+	rem = lowmem_shrink(s, sc);
+	us = ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&lmk_swap_stat_lock);
+	lmk_swap_stat.stalls++;
+	lmk_swap_stat.stall_us += us;
+	if (us > lmk_swap_stat.max_stall_us)
+		lmk_swap_stat.max_stall_us = us;
+	spin_unlock(&lmk_swap_stat_lock);
+
+	return rem;
+}
+#endif /* CONFIG_ZRAM_FOR_ANDROID */
+
 static struct shrinker lowmem_shrinker = {
+#ifdef CONFIG_ZRAM_FOR_ANDROID
+	.shrink = lowmem_shrink_timed,
+#else
 	.shrink = lowmem_shrink,
+#endif
 	.seeks = DEFAULT_SEEKS * 16
 };
 
@@ -960,14 +1340,44 @@ static unsigned int swap_pages(struct list_head *zone0_page_list,
 }
 
 
+/* Candidate mms pinned per tasklist_lock hold in swap_to_zram */
+#define SWAP_TO_ZRAM_BATCH	16
+
+/*
+ * Find the first task of the next swap_to_zram batch. If @last is
+ * still hashed it is still on the task list and the walk continues
+ * right after it. Otherwise the walk restarts from the head and skips
+ * the tasks forked no later than @last; the task list is in fork
+ * order. Returns &init_task once the list is exhausted. Called with
+ * tasklist_lock held.
+ */
+static struct task_struct *swap_to_zram_resume(struct task_struct *last)
+{
+	struct task_struct *p;
+
+	if (!last)
+		return next_task(&init_task);
+	if (pid_alive(last))
+		return next_task(last);
+
+	for_each_process(p) {
+		if (timespec_compare(&p->start_time, &last->start_time) > 0)
+			return p;
+	}
+	return &init_task;
+}
+
 int swap_to_zram(int  nr_to_scan,  int  min_adj, int   max_adj)
 {
-	struct task_struct *p = NULL;
+	struct task_struct *p = NULL, *last = NULL;
+	struct mm_struct *mms[SWAP_TO_ZRAM_BATCH];
+	int nr_mms, nr_procs = 0, i;
 	int pages_tofree = 0, pages_freed = 0;
 	LIST_HEAD(zone0_page_list);
 	LIST_HEAD(zone1_page_list);
 	struct sysinfo ramzswap_info = { 0 };
 	int  shrink_to_scan = nr_to_scan ;
+	bool done = false;
     
 	si_swapinfo(&ramzswap_info);
 	si_meminfo(&ramzswap_info);
@@ -980,58 +1390,244 @@ int swap_to_zram(int  nr_to_scan,  int  min_adj, int   max_adj)
         if(nr_to_scan<=0){
                 return 0;
         }
-	pages_tofree = 0;
-		
-	read_lock(&tasklist_lock);
-	for_each_process(p) 
-	{
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
 
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) 
-		{
-			task_unlock(p);
-			continue;
-		}
+	/*
+	 * Pin the mms of up to SWAP_TO_ZRAM_BATCH candidates under
+	 * tasklist_lock and scan them once it is dropped. The last
+	 * pinned task keeps a reference so the next batch can resume
+	 * after it instead of rescanning the head of the task list.
+	 */
+	while (!done) {
+		int tofree = 0;
+
+		nr_mms = 0;
+		read_lock(&tasklist_lock);
+		p = swap_to_zram_resume(last);
+		if (last)
+			put_task_struct(last);
+		last = NULL;
+		done = true;
+		for (; p != &init_task; p = next_task(p)) {
+			struct mm_struct *mm;
+			struct signal_struct *sig;
+			int oom_adj;
+
+			task_lock(p);
+			mm = p->mm;
+			sig = p->signal;
+			if (!mm || !sig) 
+			{
+				task_unlock(p);
+				continue;
+			}
 			
-                oom_adj = sig->oom_adj;
-                if ( (oom_adj < min_adj) || (oom_adj > max_adj) ||\
-			(__task_cred(p)->uid  <= 10000) || (p->flags & PF_KTHREAD) )
-		{
+			oom_adj = sig->oom_adj;
+			if ( (oom_adj < min_adj) || (oom_adj > max_adj) ||\
+				(__task_cred(p)->uid  <= 10000) || (p->flags & PF_KTHREAD) )
+			{
+				task_unlock(p);
+				continue;
+			}
+
+			lowmem_print(3, "%s, name:%s, adj:%d, policy:%u, uid:%u\r\n",
+				__func__, p->comm, oom_adj,p->policy, __task_cred(p)->uid );
+
+			atomic_inc(&mm->mm_users);
 			task_unlock(p);
-			continue;
+			mms[nr_mms++] = mm;
+			if (nr_mms == SWAP_TO_ZRAM_BATCH) {
+				last = p;
+				get_task_struct(last);
+				done = false;
+				break;
+			}
 		}
+		read_unlock(&tasklist_lock);
 
-         
-                printk("%s, name:%s, adj:%d, policy:%u, uid:%u\r\n", 
-			__func__, p->comm, oom_adj,p->policy, __task_cred(p)->uid );
+		for (i = 0; i < nr_mms; i++) {
+			down_read(&mms[i]->mmap_sem);
+			tofree += shrink_pages(mms[i], &zone0_page_list, &zone1_page_list, shrink_to_scan);
+			up_read(&mms[i]->mmap_sem);
+			mmput(mms[i]);
+		}
 
+		if (tofree)
+			pages_freed += swap_pages(&zone0_page_list, &zone1_page_list, tofree);
+		pages_tofree += tofree;
+		nr_procs += nr_mms;
+		cond_resched();
+	}
 
-		atomic_inc(&mm->mm_users);
-		task_unlock(p);
-                read_unlock(&tasklist_lock);
-		down_read(&mm->mmap_sem);
-		pages_tofree += shrink_pages(mm, &zone0_page_list, &zone1_page_list, shrink_to_scan);
-		up_read(&mm->mmap_sem);
-		mmput(mm);
-                read_lock(&tasklist_lock);
-		pr_debug("%s, name:%s, adj:%d, policy:%u, uid:%u\r\n", 
-							__func__, p->comm, oom_adj,p->policy, __task_cred(p)->uid );
-	 }
-	read_unlock(&tasklist_lock);
+	spin_lock(&lmk_swap_stat_lock);
+	lmk_swap_stat.procs += nr_procs;
+	lmk_swap_stat.pages_isolated += pages_tofree;
+	lmk_swap_stat.pages_reclaimed += pages_freed;
+	spin_unlock(&lmk_swap_stat_lock);
 
-	if(pages_tofree)
-	{
-		pages_freed += swap_pages(&zone0_page_list, &zone1_page_list, pages_tofree);
-	}
+	return pages_freed;
+}
+
+/*
+ * Swap out up to @nr_to_scan anonymous pages of @mm. Used for
+ * /proc/<pid>/reclaim and lmk_state, the caller holds a reference
+ * on @mm. Returns the number of pages reclaimed.
+ */
+int lowmem_reclaim_mm(struct mm_struct *mm, unsigned int nr_to_scan)
+{
+	LIST_HEAD(zone0_page_list);
+	LIST_HEAD(zone1_page_list);
+	struct sysinfo si = { 0 };
+	unsigned int pages_tofree;
+	int pages_freed = 0;
+
+	si_swapinfo(&si);
+	if (si.freeswap < CHECK_FREE_SWAPSPACE)
+		return 0;
+
+	down_read(&mm->mmap_sem);
+	pages_tofree = shrink_pages(mm, &zone0_page_list, &zone1_page_list,
+				    nr_to_scan);
+	up_read(&mm->mmap_sem);
+
+	if (pages_tofree)
+		pages_freed = swap_pages(&zone0_page_list, &zone1_page_list,
+					 pages_tofree);
+
+	spin_lock(&lmk_swap_stat_lock);
+	lmk_swap_stat.proc_reclaims++;
+	lmk_swap_stat.proc_pages_reclaimed += pages_freed;
+	spin_unlock(&lmk_swap_stat_lock);
 
 	return pages_freed;
 }
 
+static void lmk_swapd_wakeup(int min_adj, int buddy_free)
+{
+	spin_lock(&lmk_swapd_lock);
+	if (lmk_swapd_min_adj)
+		lmk_swap_stat.coalesced++;
+	lmk_swap_stat.requests++;
+	lmk_swapd_min_adj = min_adj;
+	lmk_swapd_buddy_free = buddy_free;
+	spin_unlock(&lmk_swapd_lock);
+
+	wake_up(&lmk_swapd_wait);
+}
+
+/*
+ * One reclaim pass, formerly run by kswapd from lowmem_shrink. Tiers
+ * are reclaimed from oom_adj 1 up to the one about to be killed, the
+ * lower ones harder since they are less likely to be killed, until
+ * enough has been reclaimed. The next pass is held off for longer the
+ * less this one achieved.
+ */
+static void lmk_swapd_pass(int min_adj, int buddy_free)
+{
+	static const int swap_thresh[15]={8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 102, 110, 118};
+	static const int swap_to_scan[15]={1024, 1024, 768, 768, 768, 512, 512, 512, 256, 256, 64, 64, 32, 16, 0};
+	static const int scan_num=1024;
+	static const int scan_max_times=2;
+	int to_reclaimed = 0;
+	int times, start_adj;
+	unsigned long start = jiffies, ms;
+
+	if (min_adj >= ARRAY_SIZE(swap_thresh))
+		min_adj = ARRAY_SIZE(swap_thresh) - 1;
+	if(buddy_free > scan_num){
+		buddy_free = scan_num;
+	}
+
+	for(start_adj=1; start_adj<min_adj; start_adj++){
+		to_reclaimed += swap_to_zram((buddy_free*swap_to_scan[start_adj])/swap_to_scan[0], start_adj, start_adj);
+
+		lowmem_print(2,"[LMK_swap]buddy_free:%d, swap_to_scan[%d]:%d, to_reclaimed:%d,  min_adj:%d, time:%d ms\r\n", \
+			buddy_free, start_adj, swap_to_scan[start_adj], to_reclaimed,  min_adj, jiffies_to_msecs(jiffies-start));
+
+		if(to_reclaimed >= swap_thresh[min_adj])
+			break;
+	}
+
+	if(to_reclaimed >= swap_thresh[min_adj]){
+		times = 1;
+	}else if(0 == to_reclaimed){
+		times = scan_max_times;
+	}else{
+		times = buddy_free*(swap_to_scan[min_adj]/swap_to_scan[0])/to_reclaimed;
+		if(times > scan_max_times){
+			times = scan_max_times;
+		}
+	}
+	swap_interval_time = default_interval_time * times;
+	lowmem_last_swap_time = jiffies;
+
+	ms = jiffies_to_msecs(jiffies - start);
+	spin_lock(&lmk_swap_stat_lock);
+	lmk_swap_stat.passes++;
+	lmk_swap_stat.pass_ms += ms;
+	if (ms > lmk_swap_stat.max_pass_ms)
+		lmk_swap_stat.max_pass_ms = ms;
+	spin_unlock(&lmk_swap_stat_lock);
+}
+
+static int lmk_swapd(void *unused)
+{
+	int min_adj, buddy_free;
+
+	set_user_nice(current, 5);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(lmk_swapd_wait,
+				     lmk_swapd_min_adj || kthread_should_stop());
+
+		spin_lock(&lmk_swapd_lock);
+		min_adj = lmk_swapd_min_adj;
+		buddy_free = lmk_swapd_buddy_free;
+		lmk_swapd_min_adj = 0;
+		spin_unlock(&lmk_swapd_lock);
+
+		if (min_adj)
+			lmk_swapd_pass(min_adj, buddy_free);
+	}
+
+	return 0;
+}
+
+static ssize_t swap_stat_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct lmk_swap_stat stat;
+
+	spin_lock(&lmk_swap_stat_lock);
+	stat = lmk_swap_stat;
+	spin_unlock(&lmk_swap_stat_lock);
+	spin_lock(&lmk_swapd_lock);
+	stat.requests = lmk_swap_stat.requests;
+	stat.coalesced = lmk_swap_stat.coalesced;
+	spin_unlock(&lmk_swapd_lock);
+
+	return sprintf(buf,
+		"requests:             %lu\n"
+		"coalesced:            %lu\n"
+		"passes:               %lu\n"
+		"procs:                %lu\n"
+		"pages_isolated:       %lu\n"
+		"pages_reclaimed:      %lu\n"
+		"pass_ms:              %lu\n"
+		"max_pass_ms:          %lu\n"
+		"proc_reclaims:        %lu\n"
+		"proc_pages_reclaimed: %lu\n"
+		"stalls:               %lu\n"
+		"stall_us:             %lu\n"
+		"max_stall_us:         %lu\n",
+		stat.requests, stat.coalesced, stat.passes, stat.procs,
+		stat.pages_isolated, stat.pages_reclaimed,
+		stat.pass_ms, stat.max_pass_ms,
+		stat.proc_reclaims, stat.proc_pages_reclaimed,
+		stat.stalls, stat.stall_us, stat.max_stall_us);
+}
+
+static DEVICE_ATTR(swap_stat, 0444, swap_stat_show, NULL);
 
 static ssize_t lmk_state_show(struct device *dev,
 			      struct device_attribute *attr, char *buf)
@@ -1109,21 +1705,9 @@ static ssize_t lmk_state_store(struct device *dev,
 		read_unlock(&tasklist_lock);
 
 		if (mm_scan) {
-			LIST_HEAD(zone0_page_list);
-			LIST_HEAD(zone1_page_list);
-			int pages_tofree = 0, pages_freed = 0;
-
-			down_read(&mm_scan->mmap_sem);
-			pages_tofree =
-			shrink_pages(mm_scan, &zone0_page_list,
-					&zone1_page_list, 0x7FFFFFFF);
-			up_read(&mm_scan->mmap_sem);
+			lowmem_reclaim_mm(mm_scan, 0x7FFFFFFF);
 			mmput(mm_scan);
-			pages_freed =
-			    swap_pages(&zone0_page_list,
-				       &zone1_page_list, pages_tofree);
 			lmk_kill_ok = 0;
-
 		}
 	}
 
@@ -1133,9 +1717,39 @@ static ssize_t lmk_state_store(struct device *dev,
 static DEVICE_ATTR(lmk_state, 0664, lmk_state_show, lmk_state_store);
 
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
+static void __init lowmem_index_init(void)
+{
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_adj_list[i]);
+
+	read_lock(&tasklist_lock);
+	spin_lock_bh(&lowmem_index_lock);
+	lowmem_index_sync();
+	spin_unlock_bh(&lowmem_index_lock);
+	read_unlock(&tasklist_lock);
+}
+
+static void lowmem_index_exit(void)
+{
+	struct lowmem_task *lt, *tmp;
+	int i;
+
+	spin_lock_bh(&lowmem_index_lock);
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		list_for_each_entry_safe(lt, tmp, &lowmem_adj_list[i], node)
+			list_del_init(&lt->node);
+	spin_unlock_bh(&lowmem_index_lock);
+}
+
 static int __init lowmem_init(void)
 {
 #ifdef CONFIG_ANDROID_LMK_THREAD
+	lowmem_index_init();
+	if (misc_register(&lowmem_pressure_dev))
+		printk(KERN_ERR "Failed to register lmk_pressure\n");
+	task_free_register(&task_nb);
         kthread_run(lowmem_killer, NULL, "lowmemorykiller");
 #else
 #ifdef CONFIG_ZRAM_FOR_ANDROID
@@ -1147,9 +1761,19 @@ static int __init lowmem_init(void)
 #ifdef LMK_SYSTEM_PROCESS_LEAK_MEM_DETECT
         lowmem_mem_leak_init();
 #endif
+	lowmem_index_init();
+	if (misc_register(&lowmem_pressure_dev))
+		printk(KERN_ERR "Failed to register lmk_pressure\n");
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 #ifdef CONFIG_ZRAM_FOR_ANDROID
+	lmk_swapd_task = kthread_run(lmk_swapd, NULL, "lmk_swapd");
+	if (IS_ERR(lmk_swapd_task)) {
+		printk(KERN_ERR "Failed to start lmk_swapd\n");
+		lmk_swapd_task = NULL;
+		lowmem_swap_app_enable = 0;
+	}
+
 	for_each_zone(zone) {
 		if (high_wmark < zone->watermark[WMARK_HIGH])
 			high_wmark = zone->watermark[WMARK_HIGH];
@@ -1171,6 +1795,9 @@ static int __init lowmem_init(void)
 	if (device_create_file(lmk_dev, &dev_attr_lmk_state) < 0)
 		printk(KERN_ERR "Failed to create device file(%s)!\n",
 		       dev_attr_lmk_state.attr.name);
+	if (device_create_file(lmk_dev, &dev_attr_swap_stat) < 0)
+		printk(KERN_ERR "Failed to create device file(%s)!\n",
+		       dev_attr_swap_stat.attr.name);
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 #endif
 	return 0;
@@ -1181,7 +1808,14 @@ static void __exit lowmem_exit(void)
 #ifndef CONFIG_ANDROID_LMK_THREAD
 	unregister_shrinker(&lowmem_shrinker);
 	task_free_unregister(&task_nb);
+#ifdef CONFIG_ZRAM_FOR_ANDROID
+	if (lmk_swapd_task)
+		kthread_stop(lmk_swapd_task);
+#endif
 #endif
+	misc_deregister(&lowmem_pressure_dev);
+	del_timer_sync(&lowmem_pressure_timer);
+	lowmem_index_exit();
 }
 
 #ifdef CONFIG_ZRAM_FOR_ANDROID
@@ -1204,6 +1838,8 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_margin, lowmem_pressure_margin, uint,
+		   S_IRUGO | S_IWUSR);
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
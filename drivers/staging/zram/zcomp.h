@@ -0,0 +1,67 @@
+/*
+ * Compression stream pool for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/*
+ * A compression stream: private working memory for the compressor
+ * plus an output buffer big enough for the worst case expansion of
+ * one page. A stream is owned by exactly one writer at a time.
+ */
+struct zcomp_strm {
+	void *buffer;		/* compressed output, two pages */
+	void *private;		/* backend scratch memory */
+	struct list_head list;
+};
+
+/* static compression backend */
+struct zcomp_backend {
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst);
+
+	void *(*create)(void);
+	void (*destroy)(void *private);
+
+	const char *name;
+};
+
+struct zcomp {
+	struct zcomp_backend *backend;
+	spinlock_t strm_lock;		/* protects idle_strm and counters */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;	/* writers waiting for a stream */
+	int avail_strm;			/* streams allocated, idle + busy */
+	int max_strm;
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+int zcomp_known_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *comp, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, const unsigned char *src,
+		size_t src_len, unsigned char *dst);
+
+#endif
@@ -0,0 +1,352 @@
+/*
+ * Compressed RAM block device benchmark
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * fio-style benchmark over a zram block device: <jobs> threads each
+ * write (or read back) <pages> pages of their own region with direct,
+ * synchronous 4K I/O, so that compression streams are measured in
+ * parallel. Pages are half random and half zeros, which compresses to
+ * about half like typical anonymous memory, and are stamped with their
+ * index so that dedup does not kick in. Usage:
+ *
+ *   echo "write|read <jobs> <pages>" > /sys/kernel/debug/zram_bench
+ *   cat /sys/kernel/debug/zram_bench
+ *
+ * The device is opened exclusively, so it can not be in use as swap.
+ * Its contents are overwritten.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/sched.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <asm/div64.h>
+
+#define ZBENCH_MAX_JOBS		16
+#define ZBENCH_SECTORS_PER_PAGE	(PAGE_SIZE >> 9)
+
+static char *path = "/dev/block/zram0";
+module_param(path, charp, 0444);
+MODULE_PARM_DESC(path, "zram device to run on, its data is overwritten");
+
+struct zbench_job {
+	struct task_struct	*task;
+	struct page		*page;
+	int			id;
+};
+
+struct zbench {
+	struct mutex		lock;
+
+	/* current run */
+	struct block_device	*bdev;
+	int			rw;
+	uint32_t		pages;		/* per job */
+	uint32_t		*lat;		/* ns per page */
+	atomic_t		running;
+	atomic_t		errors;
+	struct completion	done;
+
+	/* last result */
+	char			result[512];
+};
+
+static struct zbench zbench;
+static struct dentry *zbench_dentry;
+
+static inline u64 zbench_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static void zbench_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int zbench_io(struct page *page, sector_t sector)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_KERNEL, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = sector;
+	bio->bi_bdev = zbench.bdev;
+	bio->bi_end_io = zbench_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(zbench.rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+	return ret;
+}
+
+/* jobs must not exit before kthread_stop */
+static void zbench_wait_stop(void)
+{
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+}
+
+static int zbench_job(void *data)
+{
+	struct zbench_job *job = data;
+	uint32_t base = job->id * zbench.pages;
+	u32 *stamp = kmap(job->page);
+	uint32_t i;
+	u64 start;
+
+	for (i = 0; i < zbench.pages && !kthread_should_stop(); i++) {
+		*stamp = base + i;
+		start = zbench_now();
+		if (zbench_io(job->page,
+			      (sector_t)(base + i) * ZBENCH_SECTORS_PER_PAGE)) {
+			atomic_inc(&zbench.errors);
+			break;
+		}
+		zbench.lat[base + i] = (uint32_t)min_t(u64,
+				zbench_now() - start, UINT_MAX);
+	}
+	kunmap(job->page);
+
+	if (atomic_dec_and_test(&zbench.running))
+		complete(&zbench.done);
+	zbench_wait_stop();
+	return 0;
+}
+
+static int zbench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void zbench_report(const char *test, int jobs, u64 elapsed)
+{
+	uint32_t n = jobs * zbench.pages;
+	u64 kbps, iops, us = elapsed;
+
+	do_div(us, NSEC_PER_USEC);
+	if (!us)
+		us = 1;
+
+	kbps = ((u64)n * PAGE_SIZE * USEC_PER_SEC) >> 10;
+	do_div(kbps, (uint32_t)us);
+	iops = (u64)n * USEC_PER_SEC;
+	do_div(iops, (uint32_t)us);
+
+	sort(zbench.lat, n, sizeof(uint32_t), zbench_cmp, NULL);
+
+	snprintf(zbench.result, sizeof(zbench.result),
+		"test: %s, jobs: %d, pages: %u, errors: %d\n"
+		"elapsed: %llu us, %llu.%02llu MB/s, %llu iops\n"
+		"latency (us): p50 %u, p90 %u, p99 %u, max %u\n",
+		test, jobs, zbench.pages, atomic_read(&zbench.errors),
+		us, kbps / 1024, (kbps % 1024) * 100 / 1024, iops,
+		zbench.lat[n / 2] / 1000, zbench.lat[n * 9 / 10] / 1000,
+		zbench.lat[n * 99 / 100] / 1000, zbench.lat[n - 1] / 1000);
+
+	printk(KERN_INFO "zram bench: %s", zbench.result);
+}
+
+static int zbench_start(struct zbench_job *jobs, int njobs)
+{
+	void *addr;
+	int i;
+
+	for (i = 0; i < njobs; i++) {
+		jobs[i].id = i;
+		jobs[i].page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!jobs[i].page)
+			return -ENOMEM;
+		addr = kmap(jobs[i].page);
+		get_random_bytes(addr, PAGE_SIZE / 2);
+		kunmap(jobs[i].page);
+	}
+
+	for (i = 0; i < njobs; i++) {
+		jobs[i].task = kthread_create(zbench_job, &jobs[i],
+					      "zbench/%d", i);
+		if (IS_ERR(jobs[i].task)) {
+			int ret = PTR_ERR(jobs[i].task);
+
+			jobs[i].task = NULL;
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static void zbench_stop(struct zbench_job *jobs, int njobs)
+{
+	int i;
+
+	for (i = 0; i < njobs; i++) {
+		if (jobs[i].task)
+			kthread_stop(jobs[i].task);
+		if (jobs[i].page)
+			__free_page(jobs[i].page);
+	}
+}
+
+static int zbench_run(const char *test, int njobs, uint32_t pages)
+{
+	struct zbench_job jobs[ZBENCH_MAX_JOBS];
+	fmode_t mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+	u64 start;
+	int i, ret;
+
+	if (!strcmp(test, "write"))
+		zbench.rw = WRITE;
+	else if (!strcmp(test, "read"))
+		zbench.rw = READ;
+	else
+		return -EINVAL;
+
+	if (njobs <= 0 || njobs > ZBENCH_MAX_JOBS || !pages)
+		return -EINVAL;
+
+	mutex_lock(&zbench.lock);
+
+	zbench.bdev = blkdev_get_by_path(path, mode, &zbench);
+	if (IS_ERR(zbench.bdev)) {
+		ret = PTR_ERR(zbench.bdev);
+		goto out_unlock;
+	}
+	if (((u64)njobs * pages) << PAGE_SHIFT >
+			i_size_read(zbench.bdev->bd_inode)) {
+		ret = -ENOSPC;
+		goto out_put;
+	}
+
+	zbench.lat = vzalloc(sizeof(uint32_t) * njobs * pages);
+	if (!zbench.lat) {
+		ret = -ENOMEM;
+		goto out_put;
+	}
+	zbench.pages = pages;
+	atomic_set(&zbench.running, njobs);
+	atomic_set(&zbench.errors, 0);
+	INIT_COMPLETION(zbench.done);
+
+	memset(jobs, 0, sizeof(jobs));
+	ret = zbench_start(jobs, njobs);
+	if (!ret) {
+		start = zbench_now();
+		for (i = 0; i < njobs; i++)
+			wake_up_process(jobs[i].task);
+		wait_for_completion(&zbench.done);
+		zbench_report(test, njobs, zbench_now() - start);
+	}
+	zbench_stop(jobs, njobs);
+
+	vfree(zbench.lat);
+	zbench.lat = NULL;
+out_put:
+	blkdev_put(zbench.bdev, mode);
+out_unlock:
+	mutex_unlock(&zbench.lock);
+	return ret;
+}
+
+static ssize_t zbench_write(struct file *filp, const char __user *ubuf,
+		size_t count, loff_t *ppos)
+{
+	char buf[64], test[16];
+	uint32_t pages;
+	int jobs, ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%15s %d %u", test, &jobs, &pages) != 3)
+		return -EINVAL;
+
+	ret = zbench_run(test, jobs, pages);
+
+	return ret ? ret : count;
+}
+
+static int zbench_show(struct seq_file *m, void *private)
+{
+	mutex_lock(&zbench.lock);
+	seq_printf(m, "%s", zbench.result);
+	mutex_unlock(&zbench.lock);
+
+	return 0;
+}
+
+static int zbench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zbench_show, inode->i_private);
+}
+
+static const struct file_operations zbench_fops = {
+	.open = zbench_open,
+	.read = seq_read,
+	.write = zbench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init zbench_init(void)
+{
+	mutex_init(&zbench.lock);
+	init_completion(&zbench.done);
+
+	zbench_dentry = debugfs_create_file("zram_bench", S_IRUGO | S_IWUSR,
+			NULL, NULL, &zbench_fops);
+	if (!zbench_dentry)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void __exit zbench_exit(void)
+{
+	debugfs_remove(zbench_dentry);
+}
+
+module_init(zbench_init);
+module_exit(zbench_exit);
+
+MODULE_DESCRIPTION("Compressed RAM block device benchmark");
+MODULE_LICENSE("Dual BSD/GPL");
@@ -0,0 +1,198 @@
+/*
+ * Same-page deduplication for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Every compressed object is entered in a hash table keyed by a
+ * checksum of its uncompressed contents. Before compressing a page the
+ * writer looks its checksum up, and on a hit decompresses the candidate
+ * and compares it byte for byte; identical pages then share one
+ * object, which is freed when the last slot referencing it goes away.
+ *
+ * The comparison runs without dedup_lock. The candidate is pinned
+ * meanwhile, which keeps its memory but is not a slot reference: once
+ * the last slot drops it, it leaves the table and is freed by the last
+ * unpin, so refcount keeps counting slots only and dup_data_size stays
+ * exact.
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/hash.h>
+#include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/* Average number of entries per bucket when every slot is unique */
+#define ZRAM_DEDUP_LOAD		4
+
+u32 zram_dedup_checksum(const unsigned char *mem)
+{
+	return jhash2((const u32 *)mem, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct hlist_head *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->dedup_table[hash_32(checksum, zram->dedup_bits)];
+}
+
+static bool zram_dedup_match(struct zram *zram, struct zram_entry *entry,
+			struct page *page, struct zcomp_strm *zstrm)
+{
+	unsigned char *cmem, *mem;
+	bool match = false;
+
+	cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	if (!zcomp_decompress(zram->comp, cmem, entry->len, zstrm->buffer)) {
+		mem = kmap_atomic(page, KM_USER0);
+		match = !memcmp(mem, zstrm->buffer, PAGE_SIZE);
+		kunmap_atomic(mem, KM_USER0);
+	}
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return match;
+}
+
+static void zram_dedup_free(struct zram *zram, struct zram_entry *entry)
+{
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+}
+
+/*
+ * Look for an object with the same contents as @page, using the
+ * compression stream buffer as scratch space. On success a reference
+ * is taken for the slot the page is going to be stored in.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, struct page *page,
+				u32 checksum, struct zcomp_strm *zstrm)
+{
+	struct zram_entry *entry, *found = NULL;
+	struct hlist_node *pos;
+	bool match, orphan;
+
+	spin_lock(&zram->dedup_lock);
+	pos = zram_dedup_bucket(zram, checksum)->first;
+	while (pos) {
+		entry = hlist_entry(pos, struct zram_entry, node);
+		if (entry->checksum != checksum) {
+			pos = pos->next;
+			continue;
+		}
+
+		entry->pins++;
+		spin_unlock(&zram->dedup_lock);
+		match = zram_dedup_match(zram, entry, page, zstrm);
+		spin_lock(&zram->dedup_lock);
+		entry->pins--;
+
+		/* Still in the table as long as a slot refers to it */
+		if (entry->refcount) {
+			if (match) {
+				entry->refcount++;
+				found = entry;
+				break;
+			}
+			pos = pos->next;
+			continue;
+		}
+
+		/* Dropped by its last slot meanwhile, the bucket moved on */
+		orphan = !entry->pins;
+		spin_unlock(&zram->dedup_lock);
+		if (orphan)
+			zram_dedup_free(zram, entry);
+		return NULL;
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return found;
+}
+
+/*
+ * Make a freshly stored object available for sharing. Returns the
+ * entry with one reference held, or NULL if it could not be
+ * allocated, in which case the caller keeps using the bare handle.
+ */
+struct zram_entry *zram_dedup_insert(struct zram *zram, unsigned long handle,
+				u16 len, u32 checksum)
+{
+	struct zram_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->len = len;
+	entry->checksum = checksum;
+	entry->refcount = 1;
+	entry->pins = 0;
+
+	spin_lock(&zram->dedup_lock);
+	hlist_add_head(&entry->node, zram_dedup_bucket(zram, checksum));
+	zram->stats.dedup_entries++;
+	spin_unlock(&zram->dedup_lock);
+
+	return entry;
+}
+
+/*
+ * Drop a reference. Returns true if it was the last one, in which case
+ * the object is gone from the table and freed, right away or by the
+ * last lookup still comparing against it.
+ */
+bool zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	bool pinned;
+
+	spin_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		spin_unlock(&zram->dedup_lock);
+		return false;
+	}
+	hlist_del(&entry->node);
+	zram->stats.dedup_entries--;
+	pinned = entry->pins;
+	spin_unlock(&zram->dedup_lock);
+
+	if (!pinned)
+		zram_dedup_free(zram, entry);
+	return true;
+}
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	unsigned int bits;
+
+	if (!zram->use_dedup)
+		return 0;
+
+	bits = ilog2(max_t(size_t, num_pages / ZRAM_DEDUP_LOAD, 16));
+	zram->dedup_table = vzalloc(sizeof(struct hlist_head) << bits);
+	if (!zram->dedup_table) {
+		pr_err("Error allocating dedup hash table\n");
+		return -ENOMEM;
+	}
+	zram->dedup_bits = bits;
+
+	return 0;
+}
+
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->dedup_table);
+	zram->dedup_table = NULL;
+	zram->dedup_bits = 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Same-page deduplication for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/list.h>
+#include <linux/types.h>
+
+struct page;
+struct zram;
+struct zcomp_strm;
+
+/*
+ * A compressed object that may be shared by several slots. Slots
+ * flagged ZRAM_DEDUP point to one of these instead of holding the
+ * zsmalloc handle themselves.
+ */
+struct zram_entry {
+	struct hlist_node node;
+	unsigned long handle;	/* zsmalloc handle of the object */
+	u32 checksum;		/* of the uncompressed page */
+	u16 len;		/* compressed size */
+	int refcount;		/* slots using this object */
+	int pins;		/* lookups comparing against it */
+};
+
+u32 zram_dedup_checksum(const unsigned char *mem);
+struct zram_entry *zram_dedup_find(struct zram *zram, struct page *page,
+				u32 checksum, struct zcomp_strm *zstrm);
+struct zram_entry *zram_dedup_insert(struct zram *zram, unsigned long handle,
+				u16 len, u32 checksum);
+bool zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+
+#endif
@@ -28,10 +28,13 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/ktime.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/err.h>
+#include <linux/cpumask.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 #include <linux/swap.h>
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
@@ -152,15 +155,128 @@ static void setup_swap_header(struct zram *zram, union swap_header *s)
 }
 #endif /* CONFIG_ZRAM_FOR_ANDROID */
 
+/*
+ * Backing device blocks are page sized. Block 0 is never handed out so
+ * that a ZRAM_WB slot never has a zero handle.
+ */
+static unsigned long zram_alloc_bd_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->bd_lock);
+	blk = find_next_zero_bit(zram->bd_map, zram->bd_pages, 1);
+	if (blk < zram->bd_pages)
+		set_bit(blk, zram->bd_map);
+	else
+		blk = 0;
+	spin_unlock(&zram->bd_lock);
+
+	return blk;
+}
+
+static void zram_free_bd_block(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bd_lock);
+	WARN_ON(!test_bit(blk, zram->bd_map));
+	clear_bit(blk, zram->bd_map);
+	atomic_inc(&zram->bd_seq);
+	spin_unlock(&zram->bd_lock);
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Synchronously read or write one page of the backing device */
+static int zram_bd_rw_page(struct zram *zram, struct page *page,
+			unsigned long blk, int rw)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = &done;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bd_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int ret;
+};
+
+static void zram_bd_read_work(struct work_struct *work)
+{
+	struct zram_bd_work *bw = container_of(work, struct zram_bd_work,
+					work);
+
+	bw->ret = zram_bd_rw_page(bw->zram, bw->page, bw->blk, READ_SYNC);
+}
+
+/*
+ * Reads come in through zram_make_request, where any bio we submit is
+ * only queued on current->bio_list until we return; waiting for it
+ * there would never finish. Issue the read from a worker instead.
+ */
+static int zram_bd_read(struct zram *zram, struct page *page,
+			unsigned long blk)
+{
+	struct zram_bd_work bw;
+
+	bw.zram = zram;
+	bw.page = page;
+	bw.blk = blk;
+
+	INIT_WORK_ONSTACK(&bw.work, zram_bd_read_work);
+	queue_work(system_unbound_wq, &bw.work);
+	flush_work(&bw.work);
+	destroy_work_on_stack(&bw.work);
+
+	if (!bw.ret)
+		zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	return bw.ret;
+}
+
+/* zsmalloc handle of a compressed slot, whether shared or not */
+static unsigned long zram_obj_handle(struct zram *zram, u32 index)
+{
+	unsigned long handle = zram->table[index].handle;
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		return ((struct zram_entry *)handle)->handle;
+	return handle;
+}
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
+	u16 size = zram->table[index].size;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -172,28 +288,43 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
+	/* Already out of memory, only the block has to go */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_free_bd_block(zram, handle);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.bd_count);
+		goto reset;
+	}
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat64_sub(zram, &zram->stats.compr_size, size);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
+	if (size <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		if (!zram_dedup_put(zram, (struct zram_entry *)handle)) {
+			/* Other slots still share the object */
+			zram_stat64_sub(zram, &zram->stats.dup_data_size,
+					size);
+			goto out;
+		}
+	} else {
+		zs_free(zram->mem_pool, handle);
+	}
+	zram_stat64_sub(zram, &zram->stats.compr_size, size);
+
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
-
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+reset:
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -213,8 +344,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic((struct page *)zram->table[index].handle, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -223,70 +353,111 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
-static void zram_read(struct zram *zram, struct bio *bio)
+static int zram_bvec_read(struct zram *zram, struct page *page, u32 index)
 {
+	int ret;
+	ktime_t start;
+	unsigned long handle;
+	unsigned char *user_mem, *cmem;
 
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
+again:
+	read_lock(&zram->table_lock);
 
-	zram_stat64_inc(zram, &zram->stats.num_reads);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	if (zram->idle_map)
+		clear_bit(index, zram->idle_map);
 
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		size_t clen;
-		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		read_unlock(&zram->table_lock);
+		handle_zero_page(page);
+		return 0;
+	}
 
-		page = bvec->bv_page;
+	/* Requested page is not present in compressed area */
+	if (unlikely(!zram->table[index].handle)) {
+		read_unlock(&zram->table_lock);
+		pr_debug("Read before write: index=%u\n", index);
+		handle_zero_page(page);
+		return 0;
+	}
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
+	/*
+	 * Page lives on the backing device. The block can not be read
+	 * with table_lock held, so check afterwards that the slot still
+	 * refers to it and start over if it was rewritten meanwhile.
+	 * The slot may even have been freed and written back to the same
+	 * block again, so also start over if any block was freed since.
+	 */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		unsigned long blk = zram->table[index].handle;
+		int seq = atomic_read(&zram->bd_seq);
+
+		read_unlock(&zram->table_lock);
+		ret = zram_bd_read(zram, page, blk);
+		if (ret) {
+			pr_err("Backing device read failed! err=%d, "
+				"page=%u\n", ret, index);
+			return ret;
 		}
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			handle_zero_page(page);
-			index++;
-			continue;
+		read_lock(&zram->table_lock);
+		if (!zram_test_flag(zram, index, ZRAM_WB) ||
+				zram->table[index].handle != blk ||
+				atomic_read(&zram->bd_seq) != seq) {
+			read_unlock(&zram->table_lock);
+			goto again;
 		}
+		read_unlock(&zram->table_lock);
+		return 0;
+	}
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
-		}
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		read_unlock(&zram->table_lock);
+		return 0;
+	}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+	handle = zram_obj_handle(zram, index);
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+	start = ktime_get();
+	ret = zcomp_decompress(zram->comp, cmem, zram->table[index].size,
+			user_mem);
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+	zs_unmap_object(zram->mem_pool, handle);
+	kunmap_atomic(user_mem, KM_USER0);
+	read_unlock(&zram->table_lock);
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+	zram_stat64_inc(zram, &zram->stats.decomp_pages);
+	zram_stat64_add(zram, &zram->stats.decomp_time,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n",
+			ret, index);
+		return ret;
+	}
+
+	flush_dcache_page(page);
+	return 0;
+}
+
+static void zram_read(struct zram *zram, struct bio *bio)
+{
+	int i;
+	u32 index;
+	struct bio_vec *bvec;
+
+	zram_stat64_inc(zram, &zram->stats.num_reads);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+
+	bio_for_each_segment(bvec, bio, i) {
+		if (zram_bvec_read(zram, bvec->bv_page, index)) {
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
 			goto out;
 		}
-
-		flush_dcache_page(page);
 		index++;
 	}
 
@@ -298,121 +469,162 @@ out:
 	bio_io_error(bio);
 }
 
-static void zram_write(struct zram *zram, struct bio *bio)
+/*
+ * Compress one page and store it in slot @index. The page is compressed
+ * into a private stream buffer and copied into freshly allocated
+ * storage without holding table_lock, so writers to different slots
+ * proceed in parallel; the lock is only taken to swap the slot contents.
+ */
+static int zram_bvec_write(struct zram *zram, struct page *page, u32 index)
 {
-	int i;
-	u32 index;
-	struct bio_vec *bvec;
-
-	zram_stat64_inc(zram, &zram->stats.num_writes);
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-
-	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
-		struct page *page, *page_store;
-		unsigned char *user_mem, *cmem, *src;
-
-		page = bvec->bv_page;
-		src = zram->compress_buffer;
+	int ret;
+	u32 checksum = 0;
+	bool dedup = false, shared = false;
+	size_t clen;
+	ktime_t start;
+	unsigned long handle;
+	struct zcomp_strm *zstrm;
+	struct zram_entry *entry;
+	struct page *page_store;
+	unsigned char *user_mem, *cmem, *src;
 
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (page_zero_filled(user_mem)) {
+		kunmap_atomic(user_mem, KM_USER0);
+		write_lock(&zram->table_lock);
+		zram_free_page(zram, index);
+		zram_stat_inc(&zram->stats.pages_zero);
+		zram_set_flag(zram, index, ZRAM_ZERO);
+		if (zram->idle_map)
+			clear_bit(index, zram->idle_map);
+		write_unlock(&zram->table_lock);
+		return 0;
+	}
+	if (zram->use_dedup)
+		checksum = zram_dedup_checksum(user_mem);
+	kunmap_atomic(user_mem, KM_USER0);
 
-		mutex_lock(&zram->lock);
+	zstrm = zcomp_strm_find(zram->comp);
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
-			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
-			index++;
-			continue;
+	if (zram->use_dedup) {
+		entry = zram_dedup_find(zram, page, checksum, zstrm);
+		if (entry) {
+			zcomp_strm_release(zram->comp, zstrm);
+			clen = entry->len;
+			handle = (unsigned long)entry;
+			dedup = shared = true;
+			goto install;
 		}
+	}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
-
-		kunmap_atomic(user_mem, KM_USER0);
+	start = ktime_get();
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = zcomp_compress(zram->comp, zstrm, user_mem, &clen);
+	kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
-			pr_err("Compression failed! err=%d\n", ret);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
-		}
+	if (unlikely(ret)) {
+		zcomp_strm_release(zram->comp, zstrm);
+		pr_err("Compression failed! err=%d\n", ret);
+		return ret;
+	}
 
-		/*
-		 * Page is incompressible. Store it as-is (uncompressed)
-		 * since we do not want to return too many disk write
-		 * errors which has side effect of hanging the system.
-		 */
-		if (unlikely(clen > max_zpage_size)) {
-			clen = PAGE_SIZE;
-			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
-				pr_info("Error allocating memory for "
-					"incompressible page: %u\n", index);
-				zram_stat64_inc(zram,
-					&zram->stats.failed_writes);
-				goto out;
-			}
+	zram_stat64_inc(zram, &zram->stats.comp_pages);
+	zram_stat64_add(zram, &zram->stats.comp_bytes, clen);
+	zram_stat64_add(zram, &zram->stats.comp_time,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+	/*
+	 * Page is incompressible. Store it as-is (uncompressed)
+	 * since we do not want to return too many disk write
+	 * errors which has side effect of hanging the system.
+	 */
+	if (unlikely(clen > max_zpage_size)) {
+		clen = PAGE_SIZE;
+		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!page_store)) {
+			zcomp_strm_release(zram->comp, zstrm);
+			pr_info("Error allocating memory for "
+				"incompressible page: %u\n", index);
+			return -ENOMEM;
 		}
+		handle = (unsigned long)page_store;
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		src = kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(src, KM_USER0);
+	} else {
+		handle = zs_malloc(zram->mem_pool, clen);
+		if (!handle) {
+			zcomp_strm_release(zram->comp, zstrm);
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			return -ENOMEM;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		memcpy(cmem, zstrm->buffer, clen);
+		zs_unmap_object(zram->mem_pool, handle);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+		if (zram->use_dedup) {
+			entry = zram_dedup_insert(zram, handle, clen,
+						checksum);
+			if (entry) {
+				handle = (unsigned long)entry;
+				dedup = true;
+			}
 		}
-#endif
+	}
 
-		memcpy(cmem, src, clen);
+	zcomp_strm_release(zram->comp, zstrm);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+install:
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now and install the new copy.
+	 */
+	write_lock(&zram->table_lock);
+	zram_free_page(zram, index);
+
+	zram->table[index].handle = handle;
+	zram->table[index].size = clen;
+	if (unlikely(clen == PAGE_SIZE)) {
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_inc(&zram->stats.pages_expand);
+	} else if (dedup) {
+		zram_set_flag(zram, index, ZRAM_DEDUP);
+	}
 
-		/* Update stats */
+	/* Update stats */
+	if (shared)
+		zram_stat64_add(zram, &zram->stats.dup_data_size, clen);
+	else
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
-		zram_stat_inc(&zram->stats.pages_stored);
-		if (clen <= PAGE_SIZE / 2)
-			zram_stat_inc(&zram->stats.good_compress);
+	zram_stat_inc(&zram->stats.pages_stored);
+	if (clen <= PAGE_SIZE / 2)
+		zram_stat_inc(&zram->stats.good_compress);
+	if (zram->idle_map)
+		clear_bit(index, zram->idle_map);
+	write_unlock(&zram->table_lock);
+
+	return 0;
+}
+
+static void zram_write(struct zram *zram, struct bio *bio)
+{
+	int i;
+	u32 index;
+	struct bio_vec *bvec;
+
+	zram_stat64_inc(zram, &zram->stats.num_writes);
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-		mutex_unlock(&zram->lock);
+	bio_for_each_segment(bvec, bio, i) {
+		if (zram_bvec_write(zram, bvec->bv_page, index)) {
+			zram_stat64_inc(zram, &zram->stats.failed_writes);
+			goto out;
+		}
 		index++;
 	}
 
@@ -472,41 +684,251 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
-void zram_reset_device(struct zram *zram)
+/*
+ * Only the path is recorded here; the device is opened when zram is
+ * initialized and closed again on reset. An empty string or "none"
+ * removes the backing device.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
 {
-	size_t index;
+	char *name = NULL;
 
-	mutex_lock(&zram->init_lock);
-	zram->init_done = 0;
+	if (*path && !sysfs_streq(path, "none")) {
+		name = kstrndup(path, PATH_MAX, GFP_KERNEL);
+		if (!name)
+			return -ENOMEM;
+		strim(name);
+	}
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	kfree(zram->backing_dev);
+	zram->backing_dev = name;
+
+	return 0;
+}
+
+static int zram_open_backing_dev(struct zram *zram)
+{
+	struct block_device *bdev;
+	unsigned long pages;
+
+	bdev = blkdev_get_by_path(zram->backing_dev,
+			FMODE_READ | FMODE_WRITE | FMODE_EXCL, zram);
+	if (IS_ERR(bdev)) {
+		pr_err("Cannot open backing device %s: err=%ld\n",
+			zram->backing_dev, PTR_ERR(bdev));
+		return PTR_ERR(bdev);
+	}
+
+	pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (pages < 2) {
+		pr_err("Backing device %s is too small\n", zram->backing_dev);
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		return -EINVAL;
+	}
+
+	zram->bd_map = vzalloc(BITS_TO_LONGS(pages) * sizeof(long));
+	if (!zram->bd_map) {
+		pr_err("Error allocating backing device bitmap\n");
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		return -ENOMEM;
+	}
+	/* Block 0 is reserved, see zram_alloc_bd_block */
+	set_bit(0, zram->bd_map);
+
+	zram->bdev = bdev;
+	zram->bd_pages = pages;
+	pr_info("Using %s as backing device, %lu pages\n",
+		zram->backing_dev, pages);
+
+	return 0;
+}
+
+/* Number of slots looked at per table_lock hold */
+#define ZRAM_SCAN_BATCH		256
+
+/*
+ * Mark every page currently held in memory as idle. Any access clears
+ * the mark again, so what is still marked at the next writeback has not
+ * been touched in between.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index, end, num_pages = zram->disksize >> PAGE_SHIFT;
+
+	for (index = 0; index < num_pages; index = end) {
+		end = min(index + ZRAM_SCAN_BATCH, num_pages);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+		read_lock(&zram->table_lock);
+		for (; index < end; index++) {
+			if (!zram->table[index].handle ||
+			    zram_test_flag(zram, index, ZRAM_WB))
+				continue;
+			set_bit(index, zram->idle_map);
+		}
+		read_unlock(&zram->table_lock);
+		cond_resched();
+	}
+}
 
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+/*
+ * Copy out the contents of a slot chosen for writeback and mark it
+ * ZRAM_UNDER_WB. Called with table_lock held for writing.
+ */
+static int zram_wb_prepare(struct zram *zram, u32 index, struct page *page)
+{
+	unsigned long handle;
+	unsigned char *cmem, *mem;
+	int ret = 0;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+	mem = kmap_atomic(page, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		cmem = kmap_atomic((struct page *)zram->table[index].handle,
+				KM_USER1);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+	} else {
+		handle = zram_obj_handle(zram, index);
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+		ret = zcomp_decompress(zram->comp, cmem,
+				zram->table[index].size, mem);
+		zs_unmap_object(zram->mem_pool, handle);
+	}
+	kunmap_atomic(mem, KM_USER0);
 
-		if (!page)
+	if (!ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+
+	return ret;
+}
+
+/*
+ * Move pages out to the backing device: either every incompressible
+ * page, or every page left idle since the last zram_mark_idle(). The
+ * slot stays readable while its page is being written; if it is freed
+ * or rewritten meanwhile ZRAM_UNDER_WB gets cleared and the block is
+ * dropped instead of installed.
+ *
+ * Returns the number of pages written back, or a negative error if the
+ * walk stopped early; pages written before that stay on the device.
+ */
+int zram_writeback(struct zram *zram, bool huge_only)
+{
+	size_t index, num_pages = zram->disksize >> PAGE_SHIFT;
+	unsigned long blk;
+	struct page *page;
+	int ret = 0, count = 0;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < num_pages; index++) {
+		write_lock(&zram->table_lock);
+		if (!zram->table[index].handle ||
+		    zram_test_flag(zram, index, ZRAM_WB) ||
+		    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+		    (huge_only ?
+		     !zram_test_flag(zram, index, ZRAM_UNCOMPRESSED) :
+		     !test_bit(index, zram->idle_map))) {
+			write_unlock(&zram->table_lock);
 			continue;
+		}
+		ret = zram_wb_prepare(zram, index, page);
+		write_unlock(&zram->table_lock);
+		if (ret) {
+			pr_err("Decompression failed! err=%d, page=%zu\n",
+				ret, index);
+			break;
+		}
+
+		blk = zram_alloc_bd_block(zram);
+		if (!blk) {
+			ret = -ENOSPC;
+		} else {
+			ret = zram_bd_rw_page(zram, page, blk, WRITE_SYNC);
+			if (ret) {
+				pr_err("Backing device write failed! "
+					"err=%d, page=%zu\n", ret, index);
+				zram_stat64_inc(zram,
+					&zram->stats.bd_failed_writes);
+				zram_free_bd_block(zram, blk);
+				blk = 0;
+			}
+		}
+
+		write_lock(&zram->table_lock);
+		if (!blk) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		} else if (zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_free_page(zram, index);
+			zram->table[index].handle = blk;
+			zram_set_flag(zram, index, ZRAM_WB);
+			zram_stat_inc(&zram->stats.bd_count);
+			clear_bit(index, zram->idle_map);
+			count++;
+			blk = 0;
+		}
+		write_unlock(&zram->table_lock);
+
+		if (blk) {
+			/* Slot changed while the page was being written */
+			zram_free_bd_block(zram, blk);
+		} else if (!ret) {
+			zram_stat64_inc(zram, &zram->stats.bd_writes);
+		}
+
+		if (ret)
+			break;
+		cond_resched();
+	}
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+	__free_page(page);
+
+	return ret ? ret : count;
+}
+
+void zram_reset_device(struct zram *zram)
+{
+	size_t index;
+
+	mutex_lock(&zram->init_lock);
+	zram->init_done = 0;
+
+	/* Free various per-device buffers */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
+
+	/*
+	 * Free all pages that are still in this zram device. Shared
+	 * objects and backing device blocks need the bookkeeping done
+	 * by zram_free_page, so go through it for every slot.
+	 */
+	if (zram->table) {
+		for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+			zram_free_page(zram, index);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zram_dedup_fini(zram);
+
+	vfree(zram->idle_map);
+	zram->idle_map = NULL;
+
+	if (zram->bdev)
+		blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+	vfree(zram->bd_map);
+	zram->bd_map = NULL;
+	zram->bd_pages = 0;
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -534,17 +956,12 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (IS_ERR(zram->comp)) {
+		pr_err("Cannot initialise %s compressing backend\n",
+			zram->compressor);
+		ret = PTR_ERR(zram->comp);
+		zram->comp = NULL;
 		goto fail;
 	}
 
@@ -558,6 +975,23 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	zram->idle_map = vzalloc(BITS_TO_LONGS(num_pages) * sizeof(long));
+	if (!zram->idle_map) {
+		pr_err("Error allocating idle page bitmap\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret)
+		goto fail;
+
+	if (zram->backing_dev) {
+		ret = zram_open_backing_dev(zram);
+		if (ret)
+			goto fail;
+	}
+
 #ifdef CONFIG_ZRAM_FOR_ANDROID
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
@@ -565,7 +999,8 @@ int zram_init_device(struct zram *zram)
 		ret = -ENOMEM;
 		goto fail;
 	}
-	zram->table[0].page = page;
+	zram->table[0].handle = (unsigned long)page;
+	zram->table[0].size = PAGE_SIZE;
 	zram_set_flag(zram, 0, ZRAM_UNCOMPRESSED);
 	swap_header = kmap(page);
 	setup_swap_header(zram, swap_header);
@@ -576,7 +1011,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool("zram", GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -602,7 +1037,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->table_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->table_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -615,9 +1052,15 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	rwlock_init(&zram->table_lock);
+	spin_lock_init(&zram->dedup_lock);
+	spin_lock_init(&zram->bd_lock);
+	atomic_set(&zram->bd_seq, 0);
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -687,6 +1130,8 @@ static void destroy_device(struct zram *zram)
 
 	if (zram->queue)
 		blk_cleanup_queue(zram->queue);
+
+	kfree(zram->backing_dev);
 }
 
 static int __init zram_init(void)
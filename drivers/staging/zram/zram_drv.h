@@ -18,7 +18,9 @@
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,20 +28,11 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
+/* Compression backend used unless one is set through sysfs */
+static const char * const default_compressor = "lzo";
+
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
@@ -51,8 +44,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -71,6 +64,15 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* handle points to a shared struct zram_entry */
+	ZRAM_DEDUP,
+
+	/* Page was written to the backing device, handle is the block */
+	ZRAM_WB,
+
+	/* Page is being written back, cleared if the slot is freed */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -78,8 +80,14 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	/*
+	 * zsmalloc handle of the compressed object, the struct page
+	 * holding the data for ZRAM_UNCOMPRESSED pages, the struct
+	 * zram_entry for ZRAM_DEDUP pages or the backing device block
+	 * for ZRAM_WB pages.
+	 */
+	unsigned long handle;
+	u16 size;	/* object size (excluding header) */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
@@ -92,6 +100,17 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 comp_pages;		/* pages run through the compressor */
+	u64 comp_bytes;		/* compressor output for those pages */
+	u64 comp_time;		/* ns spent compressing */
+	u64 decomp_pages;	/* pages decompressed */
+	u64 decomp_time;	/* ns spent decompressing */
+	u64 dup_data_size;	/* compressed bytes saved by dedup */
+	u64 bd_reads;		/* pages read from backing device */
+	u64 bd_writes;		/* pages written to backing device */
+	u64 bd_failed_writes;	/* writeback I/O errors */
+	u32 dedup_entries;	/* shareable objects, under dedup_lock */
+	u32 bd_count;		/* pages held on backing device */
 	u32 pages_zero;		/* no. of zero filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
@@ -99,13 +118,14 @@ struct zram_stats {
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;	/* pool of compression streams */
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	rwlock_t table_lock;	/* protect table entries and 32-bit stats.
+				 * Compression runs outside of it, only
+				 * installing or freeing a slot and
+				 * decompressing one take this lock. */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -116,6 +136,29 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	int max_comp_streams;	/* number of parallel compressions */
+	char compressor[10];	/* backend name, see zcomp.c */
+
+	/* Same-page deduplication, see zram_dedup.c */
+	bool use_dedup;		/* only changed before init */
+	spinlock_t dedup_lock;	/* protects dedup_table and refcounts */
+	struct hlist_head *dedup_table;
+	unsigned int dedup_bits;
+
+	/*
+	 * Pages not accessed since the last "echo all > idle". Kept apart
+	 * from table flags so that readers can clear bits with only
+	 * table_lock held for reading.
+	 */
+	unsigned long *idle_map;
+
+	/* Optional backing device for writeback of huge and idle pages */
+	struct block_device *bdev;
+	char *backing_dev;	/* path, set before init, kept over reset */
+	spinlock_t bd_lock;	/* protects bd_map */
+	atomic_t bd_seq;	/* bumped whenever a block is freed */
+	unsigned long *bd_map;	/* allocated backing device blocks */
+	unsigned long bd_pages;	/* size of backing device in pages */
 
 	struct zram_stats stats;
 };
@@ -128,5 +171,8 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, bool huge_only);
 
 #endif
@@ -15,6 +15,9 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/mm.h>
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <linux/string.h>
 
 #include "zram_drv.h"
 
@@ -72,6 +75,83 @@ static ssize_t disksize_store(struct device *dev,
 	return len;
 }
 
+static ssize_t max_comp_streams_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->max_comp_streams);
+}
+
+static ssize_t max_comp_streams_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long num;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &num);
+	if (ret)
+		return ret;
+	if (num < 1 || num > 4 * num_possible_cpus())
+		return -EINVAL;
+
+	/*
+	 * The stream count can be changed on a live device: extra streams
+	 * are allocated now, surplus ones are freed once they go idle.
+	 */
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		ret = zcomp_set_max_streams(zram->comp, num);
+		if (ret) {
+			pr_info("Cannot allocate %lu compression streams\n",
+				num);
+			num = zram->comp->max_strm;
+		}
+	}
+	zram->max_comp_streams = num;
+	mutex_unlock(&zram->init_lock);
+
+	return ret ? ret : len;
+}
+
+static ssize_t comp_algorithm_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	size_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	sz = zcomp_available_show(zram->compressor, buf);
+	mutex_unlock(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t comp_algorithm_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	char compressor[sizeof(((struct zram *)0)->compressor)];
+	struct zram *zram = dev_to_zram(dev);
+
+	strlcpy(compressor, buf, sizeof(compressor));
+	/* ignore trailing newline */
+	strim(compressor);
+	if (!zcomp_known_algorithm(compressor))
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Can't change algorithm for initialized device\n");
+		return -EBUSY;
+	}
+	strlcpy(zram->compressor, compressor, sizeof(zram->compressor));
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
 static ssize_t initstate_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -210,6 +290,43 @@ static ssize_t compr_data_size_show(struct device *dev,
 		zram_stat64_read(zram, &zram->stats.compr_size));
 }
 
+/*
+ * Compression statistics of the backend in use: compression ratio and
+ * average time per page for each direction. They are reset together
+ * with the device, which is also the only point where the backend can
+ * be changed, so they always describe a single algorithm.
+ */
+static ssize_t comp_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 comp_pages, comp_bytes, comp_time;
+	u64 decomp_pages, decomp_time;
+	struct zram *zram = dev_to_zram(dev);
+
+	spin_lock(&zram->stat64_lock);
+	comp_pages = zram->stats.comp_pages;
+	comp_bytes = zram->stats.comp_bytes;
+	comp_time = zram->stats.comp_time;
+	decomp_pages = zram->stats.decomp_pages;
+	decomp_time = zram->stats.decomp_time;
+	spin_unlock(&zram->stat64_lock);
+
+	return sprintf(buf,
+		"algorithm:          %s\n"
+		"compressed_pages:   %llu\n"
+		"compressed_bytes:   %llu\n"
+		"ratio_percent:      %llu\n"
+		"compress_avg_ns:    %llu\n"
+		"decompressed_pages: %llu\n"
+		"decompress_avg_ns:  %llu\n",
+		zram->compressor, comp_pages, comp_bytes,
+		comp_pages ? div64_u64(comp_bytes * 100,
+				comp_pages << PAGE_SHIFT) : 0,
+		comp_pages ? div64_u64(comp_time, comp_pages) : 0,
+		decomp_pages,
+		decomp_pages ? div64_u64(decomp_time, decomp_pages) : 0);
+}
+
 static ssize_t mem_used_total_show(struct device *dev,
 		struct device_attribute *attr, char *buf)
 {
@@ -217,17 +334,234 @@ static ssize_t mem_used_total_show(struct device *dev,
 	struct zram *zram = dev_to_zram(dev);
 
 	if (zram->init_done) {
-		val = xv_get_total_size_bytes(zram->mem_pool) +
+		val = zs_get_total_size_bytes(zram->mem_pool) +
 			((u64)(zram->stats.pages_expand) << PAGE_SHIFT);
 	}
 
 	return sprintf(buf, "%llu\n", val);
 }
 
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long do_compact;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &do_compact);
+	if (ret)
+		return ret;
+	if (!do_compact)
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	zs_compact(zram->mem_pool);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+/*
+ * Allocator fragmentation: memory backing the pool against what the
+ * stored objects actually need. Size class rounding accounts for the
+ * difference between data and slot bytes, partially used zspages for
+ * the rest; only the latter can be recovered by writing to 'compact'.
+ */
+static ssize_t frag_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u64 data, pool_bytes;
+	struct zs_pool_stats stats;
+	struct zram *zram = dev_to_zram(dev);
+
+	memset(&stats, 0, sizeof(stats));
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done)
+		zs_get_pool_stats(zram->mem_pool, &stats);
+	mutex_unlock(&zram->init_lock);
+
+	data = zram_stat64_read(zram, &zram->stats.compr_size) -
+		((u64)zram->stats.pages_expand << PAGE_SHIFT);
+	pool_bytes = stats.pages_allocated << PAGE_SHIFT;
+
+	return sprintf(buf,
+		"pool_bytes:      %llu\n"
+		"slot_bytes:      %llu\n"
+		"data_bytes:      %llu\n"
+		"objects:         %llu\n"
+		"frag_percent:    %llu\n"
+		"pages_compacted: %llu\n"
+		"objs_migrated:   %llu\n",
+		pool_bytes, stats.obj_allocated, data, stats.objs,
+		pool_bytes && pool_bytes > data ?
+			div64_u64((pool_bytes - data) * 100, pool_bytes) : 0,
+		stats.pages_compacted, stats.objs_migrated);
+}
+
+static ssize_t use_dedup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	return sprintf(buf, "%d\n", zram->use_dedup);
+}
+
+static ssize_t use_dedup_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	unsigned long val;
+	struct zram *zram = dev_to_zram(dev);
+
+	ret = strict_strtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Can't change dedup for initialized device\n");
+		return -EBUSY;
+	}
+	zram->use_dedup = !!val;
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+/*
+ * Shared objects and what they save. dup_bytes is compressed data that
+ * would have been stored again without dedup; entries the number of
+ * objects that can currently be shared.
+ */
+static ssize_t dedup_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u32 entries;
+	struct zram *zram = dev_to_zram(dev);
+
+	spin_lock(&zram->dedup_lock);
+	entries = zram->stats.dedup_entries;
+	spin_unlock(&zram->dedup_lock);
+
+	return sprintf(buf,
+		"enabled:   %d\n"
+		"entries:   %u\n"
+		"dup_bytes: %llu\n",
+		zram->use_dedup, entries,
+		zram_stat64_read(zram, &zram->stats.dup_data_size));
+}
+
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	ssize_t sz;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	sz = sprintf(buf, "%s\n",
+		zram->backing_dev ? zram->backing_dev : "none");
+	mutex_unlock(&zram->init_lock);
+
+	return sz;
+}
+
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	struct zram *zram = dev_to_zram(dev);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		pr_info("Can't set backing device for initialized device\n");
+		return -EBUSY;
+	}
+	ret = zram_set_backing_dev(zram, buf);
+	mutex_unlock(&zram->init_lock);
+
+	return ret ? ret : len;
+}
+
+static ssize_t idle_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+
+	if (!sysfs_streq(buf, "all"))
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	zram_mark_idle(zram);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	int ret;
+	bool huge_only;
+	struct zram *zram = dev_to_zram(dev);
+
+	if (sysfs_streq(buf, "huge"))
+		huge_only = true;
+	else if (sysfs_streq(buf, "idle"))
+		huge_only = false;
+	else
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	ret = zram_writeback(zram, huge_only);
+	mutex_unlock(&zram->init_lock);
+
+	return ret < 0 ? ret : len;
+}
+
+static ssize_t bd_stat_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	u32 count;
+	struct zram *zram = dev_to_zram(dev);
+
+	read_lock(&zram->table_lock);
+	count = zram->stats.bd_count;
+	read_unlock(&zram->table_lock);
+
+	return sprintf(buf,
+		"bd_pages:  %lu\n"
+		"bd_count:  %u\n"
+		"bd_reads:  %llu\n"
+		"bd_writes: %llu\n"
+		"bd_failed_writes: %llu\n",
+		zram->bd_pages, count,
+		zram_stat64_read(zram, &zram->stats.bd_reads),
+		zram_stat64_read(zram, &zram->stats.bd_writes),
+		zram_stat64_read(zram, &zram->stats.bd_failed_writes));
+}
+
 static DEVICE_ATTR(disksize, S_IRUGO | S_IWUSR,
 		disksize_show, disksize_store);
 static DEVICE_ATTR(initstate, S_IRUGO | S_IWUSR, initstate_show, initstate_store);
 static DEVICE_ATTR(reset, S_IWUSR, NULL, reset_store);
+static DEVICE_ATTR(max_comp_streams, S_IRUGO | S_IWUSR,
+		max_comp_streams_show, max_comp_streams_store);
+static DEVICE_ATTR(comp_algorithm, S_IRUGO | S_IWUSR,
+		comp_algorithm_show, comp_algorithm_store);
 static DEVICE_ATTR(num_reads, S_IRUGO, num_reads_show, NULL);
 static DEVICE_ATTR(num_writes, S_IRUGO, num_writes_show, NULL);
 static DEVICE_ATTR(invalid_io, S_IRUGO, invalid_io_show, NULL);
@@ -235,12 +569,25 @@ static DEVICE_ATTR(notify_free, S_IRUGO, notify_free_show, NULL);
 static DEVICE_ATTR(zero_pages, S_IRUGO, zero_pages_show, NULL);
 static DEVICE_ATTR(orig_data_size, S_IRUGO, orig_data_size_show, NULL);
 static DEVICE_ATTR(compr_data_size, S_IRUGO, compr_data_size_show, NULL);
+static DEVICE_ATTR(comp_stat, S_IRUGO, comp_stat_show, NULL);
 static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+static DEVICE_ATTR(frag_stat, S_IRUGO, frag_stat_show, NULL);
+static DEVICE_ATTR(use_dedup, S_IRUGO | S_IWUSR,
+		use_dedup_show, use_dedup_store);
+static DEVICE_ATTR(dedup_stat, S_IRUGO, dedup_stat_show, NULL);
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(idle, S_IWUSR, NULL, idle_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(bd_stat, S_IRUGO, bd_stat_show, NULL);
 
 static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_disksize.attr,
 	&dev_attr_initstate.attr,
 	&dev_attr_reset.attr,
+	&dev_attr_max_comp_streams.attr,
+	&dev_attr_comp_algorithm.attr,
 	&dev_attr_num_reads.attr,
 	&dev_attr_num_writes.attr,
 	&dev_attr_invalid_io.attr,
@@ -248,7 +595,16 @@ static struct attribute *zram_disk_attrs[] = {
 	&dev_attr_zero_pages.attr,
 	&dev_attr_orig_data_size.attr,
 	&dev_attr_compr_data_size.attr,
+	&dev_attr_comp_stat.attr,
 	&dev_attr_mem_used_total.attr,
+	&dev_attr_compact.attr,
+	&dev_attr_frag_stat.attr,
+	&dev_attr_use_dedup.attr,
+	&dev_attr_dedup_stat.attr,
+	&dev_attr_backing_dev.attr,
+	&dev_attr_idle.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_bd_stat.attr,
 	NULL,
 };
 
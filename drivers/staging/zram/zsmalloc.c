@@ -0,0 +1,660 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Size-class allocator for compressed pages. Objects of similar size
+ * share a size class; each class carves groups of pages ("zspages")
+ * into fixed-size slots. Unlike xvmalloc, freeing never leaves holes
+ * that only other sizes could use, and a zspage whose last object is
+ * freed goes straight back to the page allocator.
+ *
+ * Partially used zspages can still pile up when objects are freed in
+ * random order, so objects are reached through handles and can be
+ * migrated: zs_compact() moves the objects of the emptiest zspages of
+ * a class into the fullest ones and releases the emptied pages.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct kmem_cache *handle_cachep;
+static struct kmem_cache *zspage_cachep;
+static int zs_cache_users;
+static DEFINE_MUTEX(zs_cache_lock);
+
+static int zs_create_caches(void)
+{
+	int ret = 0;
+
+	mutex_lock(&zs_cache_lock);
+	if (zs_cache_users++)
+		goto out;
+
+	handle_cachep = kmem_cache_create("zs_handle",
+			sizeof(struct zs_handle), 0, 0, NULL);
+	zspage_cachep = kmem_cache_create("zspage",
+			sizeof(struct zspage), 0, 0, NULL);
+	if (!handle_cachep || !zspage_cachep) {
+		if (handle_cachep)
+			kmem_cache_destroy(handle_cachep);
+		if (zspage_cachep)
+			kmem_cache_destroy(zspage_cachep);
+		handle_cachep = NULL;
+		zspage_cachep = NULL;
+		zs_cache_users--;
+		ret = -ENOMEM;
+	}
+out:
+	mutex_unlock(&zs_cache_lock);
+	return ret;
+}
+
+static void zs_destroy_caches(void)
+{
+	mutex_lock(&zs_cache_lock);
+	if (!--zs_cache_users) {
+		kmem_cache_destroy(handle_cachep);
+		kmem_cache_destroy(zspage_cachep);
+		handle_cachep = NULL;
+		zspage_cachep = NULL;
+	}
+	mutex_unlock(&zs_cache_lock);
+}
+
+static int get_size_class_index(size_t size)
+{
+	if (size < ZS_MIN_ALLOC_SIZE)
+		size = ZS_MIN_ALLOC_SIZE;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/*
+ * Pick the number of pages per zspage that wastes the least space at
+ * the end of the zspage for objects of the given size.
+ */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, best_usage = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int usage;
+
+		usage = (zspage_size - zspage_size % size) * 100 / zspage_size;
+		if (usage > best_usage) {
+			best_usage = usage;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static void obj_location(struct size_class *class, struct zspage *zspage,
+			unsigned int idx, struct page **page,
+			unsigned long *offset)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+
+	*page = zspage->pages[off >> PAGE_SHIFT];
+	*offset = off & ~PAGE_MASK;
+}
+
+/* Headers are ZS_SIZE_CLASS_DELTA aligned and never cross a page */
+static unsigned long obj_get_header(struct size_class *class,
+			struct zspage *zspage, unsigned int idx)
+{
+	struct page *page;
+	unsigned long offset, val;
+	void *addr;
+
+	obj_location(class, zspage, idx, &page, &offset);
+	addr = kmap_atomic(page, KM_USER0);
+	val = *(unsigned long *)(addr + offset);
+	kunmap_atomic(addr, KM_USER0);
+
+	return val;
+}
+
+static void obj_set_header(struct size_class *class,
+			struct zspage *zspage, unsigned int idx,
+			unsigned long val)
+{
+	struct page *page;
+	unsigned long offset;
+	void *addr;
+
+	obj_location(class, zspage, idx, &page, &offset);
+	addr = kmap_atomic(page, KM_USER0);
+	*(unsigned long *)(addr + offset) = val;
+	kunmap_atomic(addr, KM_USER0);
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i;
+
+	for (i = 0; i < zspage->class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	atomic_sub(zspage->class->pages_per_zspage, &pool->pages_allocated);
+	kmem_cache_free(zspage_cachep, zspage);
+}
+
+/*
+ * Allocate a zspage and thread all of its slots on the free list.
+ * Called without the class lock since page allocation may sleep.
+ */
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+			struct size_class *class)
+{
+	struct zspage *zspage;
+	unsigned int i;
+
+	zspage = kmem_cache_zalloc(zspage_cachep,
+			pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class;
+	INIT_LIST_HEAD(&zspage->list);
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (!zspage->pages[i]) {
+			while (i--)
+				__free_page(zspage->pages[i]);
+			kmem_cache_free(zspage_cachep, zspage);
+			return NULL;
+		}
+	}
+	atomic_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	for (i = 0; i < class->objs_per_zspage; i++) {
+		unsigned int next = i + 1;
+
+		if (next == class->objs_per_zspage)
+			next = ZS_NO_FREE;
+		obj_set_header(class, zspage, i,
+			(unsigned long)next << OBJ_FREE_SHIFT);
+	}
+	zspage->freeidx = 0;
+
+	return zspage;
+}
+
+/* Take a free slot from a zspage. Called with class->lock held. */
+static unsigned int obj_alloc(struct size_class *class,
+			struct zspage *zspage, struct zs_handle *handle)
+{
+	unsigned int idx = zspage->freeidx;
+	unsigned long header;
+
+	BUG_ON(idx == ZS_NO_FREE);
+
+	header = obj_get_header(class, zspage, idx);
+	zspage->freeidx = header >> OBJ_FREE_SHIFT;
+	obj_set_header(class, zspage, idx,
+		(unsigned long)handle | OBJ_ALLOCATED_TAG);
+
+	handle->zspage = zspage;
+	handle->idx = idx;
+
+	zspage->inuse++;
+	class->objs_inuse++;
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	return idx;
+}
+
+/*
+ * Return a slot to its zspage. Called with class->lock held. Returns
+ * true if the zspage became empty; it is then off all lists and the
+ * caller must free it once the lock is dropped.
+ */
+static bool obj_free(struct size_class *class, struct zspage *zspage,
+			unsigned int idx)
+{
+	obj_set_header(class, zspage, idx,
+		(unsigned long)zspage->freeidx << OBJ_FREE_SHIFT);
+	zspage->freeidx = idx;
+
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+	zspage->inuse--;
+	class->objs_inuse--;
+
+	if (zspage->inuse)
+		return false;
+
+	list_del(&zspage->list);
+	class->zspages--;
+	return true;
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ * @name: name of the pool, for debugging
+ * @flags: allocation flags used to allocate pool pages
+ *
+ * Returns the pool on success and NULL on failure.
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	if (zs_create_caches()) {
+		kfree(pool);
+		return NULL;
+	}
+
+	rwlock_init(&pool->migrate_lock);
+	pool->flags = flags;
+	pool->name = name;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock_init(&class->lock);
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / class->size;
+	}
+
+	pool->area = alloc_percpu(struct mapping_area);
+	if (!pool->area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = per_cpu_ptr(pool->area, cpu);
+
+		area->vm_buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->vm_buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, cpu;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		struct zspage *zspage, *tmp;
+
+		if (class->objs_inuse)
+			pr_info("zsmalloc %s: freeing non-empty class %u\n",
+				pool->name, class->size);
+
+		list_splice_init(&class->full, &class->partial);
+		list_for_each_entry_safe(zspage, tmp, &class->partial, list) {
+			list_del(&zspage->list);
+			free_zspage(pool, zspage);
+		}
+	}
+
+	if (pool->area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->area, cpu)->vm_buf);
+		free_percpu(pool->area);
+	}
+
+	zs_destroy_caches();
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ *
+ * On success, handle to the allocated object is returned,
+ * otherwise 0.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	size += ZS_HANDLE_SIZE;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	handle = kmem_cache_alloc(handle_cachep,
+			pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(pool, class);
+		if (!zspage) {
+			kmem_cache_free(handle_cachep, handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+		class->zspages++;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	obj_alloc(class, zspage, handle);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zspage *zspage;
+	bool empty;
+
+	if (unlikely(!obj))
+		return;
+
+	read_lock(&pool->migrate_lock);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	empty = obj_free(class, zspage, handle->idx);
+	spin_unlock(&class->lock);
+	read_unlock(&pool->migrate_lock);
+
+	if (empty)
+		free_zspage(pool, zspage);
+	kmem_cache_free(handle_cachep, handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/* Copy len bytes at byte offset off of a zspage, page by page */
+static void zspage_copy(struct zspage *zspage, unsigned long off,
+			char *buf, size_t len, bool to_zspage)
+{
+	while (len) {
+		struct page *page = zspage->pages[off >> PAGE_SHIFT];
+		unsigned long poff = off & ~PAGE_MASK;
+		size_t chunk = min_t(size_t, len, PAGE_SIZE - poff);
+		char *addr;
+
+		addr = kmap_atomic(page, KM_USER1);
+		if (to_zspage)
+			memcpy(addr + poff, buf, chunk);
+		else
+			memcpy(buf, addr + poff, chunk);
+		kunmap_atomic(addr, KM_USER1);
+
+		off += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @obj: handle returned from zs_malloc
+ * @mm: mapping mode to use
+ *
+ * Objects that span two pages are copied to a per-cpu buffer (and
+ * copied back on unmap, unless mapped read-only). Preemption and
+ * migration stay disabled until zs_unmap_object(), so mappings must
+ * be short-lived and must not nest.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct mapping_area *area;
+	struct size_class *class;
+	struct zspage *zspage;
+	struct page *page;
+	unsigned long offset;
+
+	BUG_ON(!obj);
+
+	read_lock(&pool->migrate_lock);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	area = this_cpu_ptr(pool->area);
+	area->vm_mm = mm;
+
+	obj_location(class, zspage, handle->idx, &page, &offset);
+	if (offset + class->size <= PAGE_SIZE) {
+		area->vm_addr = kmap_atomic(page, KM_USER0);
+		return area->vm_addr + offset + ZS_HANDLE_SIZE;
+	}
+
+	area->vm_addr = NULL;
+	if (mm != ZS_MM_WO)
+		zspage_copy(zspage, (unsigned long)handle->idx * class->size,
+			area->vm_buf, class->size, false);
+
+	return area->vm_buf + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct mapping_area *area;
+	struct size_class *class;
+
+	area = this_cpu_ptr(pool->area);
+	if (area->vm_addr) {
+		kunmap_atomic(area->vm_addr, KM_USER0);
+	} else if (area->vm_mm != ZS_MM_RO) {
+		class = handle->zspage->class;
+		/* Leave the header alone, it may only change under lock */
+		zspage_copy(handle->zspage,
+			(unsigned long)handle->idx * class->size +
+				ZS_HANDLE_SIZE,
+			area->vm_buf + ZS_HANDLE_SIZE,
+			class->size - ZS_HANDLE_SIZE, true);
+	}
+
+	read_unlock(&pool->migrate_lock);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Move one object between two zspages of a class. Called with the
+ * migrate lock held for writing and class->lock held.
+ */
+static void migrate_object(struct zs_pool *pool, struct size_class *class,
+			struct zspage *dst, struct zspage *src,
+			unsigned int idx, char *buf)
+{
+	struct zs_handle *handle;
+	unsigned long header;
+	size_t len = class->size - ZS_HANDLE_SIZE;
+
+	header = obj_get_header(class, src, idx);
+	handle = (struct zs_handle *)(header & ~OBJ_ALLOCATED_TAG);
+
+	zspage_copy(src, (unsigned long)idx * class->size + ZS_HANDLE_SIZE,
+		buf, len, false);
+	obj_free(class, src, idx);
+
+	obj_alloc(class, dst, handle);
+	zspage_copy(dst, (unsigned long)handle->idx * class->size +
+			ZS_HANDLE_SIZE, buf, len, true);
+
+	pool->objs_migrated++;
+}
+
+/*
+ * Empty the least used partial zspage of a class into the most used
+ * ones. Returns the emptied zspage, to be freed by the caller, or NULL
+ * if the class can not release a zspage by compaction.
+ */
+static struct zspage *compact_one_zspage(struct zs_pool *pool,
+			struct size_class *class, char *buf)
+{
+	struct zspage *zspage, *src = NULL, *dst;
+	unsigned long free_objs;
+	unsigned int idx;
+
+	free_objs = class->zspages * class->objs_per_zspage -
+			class->objs_inuse;
+	if (free_objs < class->objs_per_zspage)
+		return NULL;
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	}
+	if (!src)
+		return NULL;
+
+	/* Keep src away from obj_alloc() while moving its objects out */
+	list_del_init(&src->list);
+
+	dst = NULL;
+	for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+		if (!(obj_get_header(class, src, idx) & OBJ_ALLOCATED_TAG))
+			continue;
+
+		/* Fill the fullest zspage first, then move on to the next */
+		if (!dst || dst->inuse == class->objs_per_zspage) {
+			dst = NULL;
+			list_for_each_entry(zspage, &class->partial, list) {
+				if (!dst || zspage->inuse > dst->inuse)
+					dst = zspage;
+			}
+			/* free_objs guarantees there is room for everything */
+			BUG_ON(!dst);
+		}
+
+		migrate_object(pool, class, dst, src, idx, buf);
+	}
+
+	/*
+	 * obj_free() already unlinked src (and fixed zspages) when its
+	 * last object left.
+	 */
+	return src;
+}
+
+/**
+ * zs_compact - migrate objects to release partially used zspages
+ * @pool: pool to compact
+ *
+ * Returns the number of pages released. The migrate lock is taken
+ * and released around every zspage, so readers are only held off for
+ * the time it takes to move one zspage worth of objects.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	struct zspage *zspage;
+	char *buf;
+	int i;
+
+	buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+	if (!buf)
+		return 0;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		struct size_class *class = &pool->size_class[i];
+
+		for (;;) {
+			write_lock(&pool->migrate_lock);
+			spin_lock(&class->lock);
+			zspage = compact_one_zspage(pool, class, buf);
+			if (zspage)
+				pool->pages_compacted +=
+					class->pages_per_zspage;
+			spin_unlock(&class->lock);
+			write_unlock(&pool->migrate_lock);
+
+			if (!zspage)
+				break;
+
+			freed += class->pages_per_zspage;
+			free_zspage(pool, zspage);
+			cond_resched();
+		}
+	}
+
+	kfree(buf);
+	pr_debug("zsmalloc %s: compaction released %lu pages\n",
+		pool->name, freed);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+void zs_get_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		stats->objs += class->objs_inuse;
+		stats->obj_allocated += (u64)class->objs_inuse * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	stats->pages_allocated = atomic_read(&pool->pages_allocated);
+	stats->pages_compacted = pool->pages_compacted;
+	stats->objs_migrated = pool->objs_migrated;
+}
+EXPORT_SYMBOL_GPL(zs_get_pool_stats);
@@ -0,0 +1,110 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "zsmalloc.h"
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many 0-order pages that is carved
+ * into objects of one size class. Objects may straddle the pages of a
+ * zspage, which lets sizes that do not divide PAGE_SIZE pack tightly.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/*
+ * Size classes are ZS_SIZE_CLASS_DELTA bytes apart. Must be a multiple
+ * of the object header size, so that headers never cross a page.
+ */
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+#define ZS_SIZE_CLASSES	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+				ZS_SIZE_CLASS_DELTA + 1)
+
+/* End of user params */
+
+/*
+ * Every slot starts with a header word. For an allocated object it
+ * holds the handle with OBJ_ALLOCATED_TAG set, which is what lets
+ * compaction find and update the owner of an object it moves. For a
+ * free slot it holds the index of the next free slot in the zspage.
+ */
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+#define OBJ_ALLOCATED_TAG	1UL
+#define OBJ_FREE_SHIFT		1
+#define ZS_NO_FREE		0xffffU
+
+/*
+ * Handles are kept in a slab cache. The handle value returned to the
+ * user is the address of this struct, which stays put while the object
+ * it describes is migrated.
+ */
+struct zs_handle {
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* on class partial or full list */
+	struct size_class *class;
+	unsigned int inuse;		/* allocated objects */
+	unsigned int freeidx;		/* first free slot or ZS_NO_FREE */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head partial;	/* zspages with free slots */
+	struct list_head full;		/* zspages without free slots */
+	unsigned int size;		/* slot size including header */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+	unsigned long zspages;
+	unsigned long objs_inuse;
+};
+
+/* per-cpu area used to access objects that straddle two pages */
+struct mapping_area {
+	char *vm_buf;		/* copy of a split object */
+	char *vm_addr;		/* kmap address of a non-split object */
+	enum zs_mapmode vm_mm;
+};
+
+struct zs_pool {
+	/*
+	 * Held for reading while an object is mapped or freed, for
+	 * writing while compaction moves objects around. Taken before
+	 * any class lock.
+	 */
+	rwlock_t migrate_lock;
+	struct size_class size_class[ZS_SIZE_CLASSES];
+	struct mapping_area __percpu *area;
+	gfp_t flags;			/* allocation flags for zspages */
+	const char *name;
+
+	atomic_t pages_allocated;
+	/* protected by migrate_lock held for writing */
+	unsigned long pages_compacted;
+	unsigned long objs_migrated;
+};
+
+#endif
@@ -28,6 +28,8 @@
 
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/proc_fs.h>
 #include <asm/atomic.h>
 #include <asm/bitops.h>
 #include <linux/netdevice.h>
@@ -59,6 +61,14 @@
 #define VETH_RING_SIZE	    64
 #endif
 
+    /*
+     * Frames received per NAPI poll, and frames queued on the tx ring
+     * before the peer is notified without waiting for the end of the
+     * burst.
+     */
+#define VETH_NAPI_WEIGHT    64
+#define VETH_TX_KICK_BATCH  (VETH_RING_SIZE / 4)
+
 /*----- Tracing -----*/
 
 #define VETH_CONT(x...)	printk (x)
@@ -97,8 +107,19 @@ typedef struct {
     volatile nku32_f	c_idx;		/* consumer index */
     volatile nku8_f	stopped;	/* states: started/stopped */
     nku16_f		size_unused;	/* size of ring (number of slots) */
+    volatile nku32_f	c_features;	/* VETH_RING_FEATURES if supported */
+    volatile nku32_f	c_no_notify;	/* consumer polling, no rx xirq */
 } VEthRingDesc;
 
+    /*
+     * The consumer of a ring writes this value in c_features to tell
+     * the producer that it honours c_no_notify. Peers that predate it
+     * never write it, and get an rx xirq for every burst as before.
+     * Both fields fit in the cache line padding of the ring descriptor,
+     * so the slot layout is unchanged.
+     */
+#define VETH_RING_FEATURES  0x4e415049	/* "NAPI" */
+
 struct VEthLink;
 
 typedef struct {
@@ -179,21 +200,37 @@ typedef struct VEthLink {
     VEthLocal     local;
     VEthPeer      peer;
 
+    nku32_f       tx_kick_idx;	/* tx_ring->p_idx at last notification */
+
     _Bool         enabled;
 } VEthLink;
 
+    /*
+     * Cross-interrupt accounting, see /proc/nk/veth.
+     */
+typedef struct {
+    unsigned long tx_xirqs;	/* rx xirqs sent to peer */
+    unsigned long tx_xirqs_saved; /* not sent, peer was polling */
+    unsigned long rx_xirqs;	/* rx xirqs received */
+    unsigned long rx_polls;	/* NAPI polls run */
+} VEthXirqStats;
+
     /*
      * Device instance data.
      */
 typedef struct VEth {
     veth_stats		stats;	/* net statistics     */
+    VEthXirqStats	xstats;	/* xirq statistics    */
     VEthLink		link;	/* link with peer OS data */
     struct net_device*	netdev;	/* Linux net device   */
+    struct napi_struct	napi;	/* rx ring consumer   */
+    struct tasklet_struct tx_kick; /* end of tx burst  */
 } VEth;
 
 static VEth*		veth_devices [VETH_MAX];
 static unsigned int	veth_devices_num;
 static NkXIrqId		veth_sysconf_id;
+static struct proc_dir_entry* veth_proc;
 
 #define VETH_PMEM_ID	4
 #define VETH_RXIRQ_ID	6
@@ -364,22 +401,22 @@ veth_ring_pull_data (VEthRingDesc* ring, nku8_f* dst)
 #endif	/* not CONFIG_SKB_DESTRUCTOR */
 
     /*
-     * Rx xirq handler to receive frames as a rx_ring consumer
+     * Consume up to budget frames from the rx ring.
      */
 
-    static void
-veth_rx_xirq (void* cookie, NkXIrq xirq)
+    static int
+veth_rx_ring_consume (VEthLink* link, int budget)
 {
-    VEthLink*		link = (VEthLink*) cookie;
     VEth*		veth = link->veth;
     struct net_device*	netdev  = veth->netdev;
     VEthRingDesc*	rx_ring = link->rx_ring;
     struct sk_buff*	skb;
+    int			done = 0;
 #ifndef CONFIG_SKB_DESTRUCTOR
     int			len;
 #endif
 
-    while (RING_C_ROOM (rx_ring) > 0) {
+    while (done < budget && RING_C_ROOM (rx_ring) > 0) {
 	    /*
 	     * Check the peer state and account
 	     * error if it is not ON.
@@ -388,8 +425,9 @@ veth_rx_xirq (void* cookie, NkXIrq xirq)
 	    VETH_DTRACE ("peer driver not ready\n");
 	    netif_carrier_off (veth->netdev);
 	    veth->stats.rx_errors++;
-	    return;
+	    break;
 	}
+	done++;
 #ifdef CONFIG_SKB_DESTRUCTOR
 	skb  = veth_alloc_skb (link);
 	if (!skb) {
@@ -427,7 +465,7 @@ veth_rx_xirq (void* cookie, NkXIrq xirq)
 	veth->stats.rx_packets++;
 	veth->stats.rx_bytes += skb->len;
 
-	netif_rx (skb);
+	netif_receive_skb (skb);
     }
     netdev->last_rx = jiffies;
 
@@ -437,6 +475,54 @@ veth_rx_xirq (void* cookie, NkXIrq xirq)
 	nkops.nk_xirq_trigger (link->peer.tx_ready_xirq, link->peer.osid);
     }
 #endif
+    return done;
+}
+
+    /*
+     * NAPI poll. The peer is asked not to send rx xirqs while a poll
+     * is pending; the ring is checked again once they are re-enabled
+     * so that a frame queued in between is not left behind.
+     */
+
+    static int
+veth_poll (struct napi_struct* napi, int budget)
+{
+    VEth*		veth    = container_of (napi, VEth, napi);
+    VEthLink*		link    = &veth->link;
+    VEthRingDesc*	rx_ring = link->rx_ring;
+    int			done;
+
+    veth->xstats.rx_polls++;
+    done = veth_rx_ring_consume (link, budget);
+    if (done < budget) {
+	napi_complete (napi);
+	rx_ring->c_no_notify = 0;
+	smp_mb();
+	if (RING_C_ROOM (rx_ring) > 0 &&
+	    link->rx_link->c_state == NK_DEV_VLINK_ON &&
+	    napi_reschedule (napi)) {
+	    rx_ring->c_no_notify = 1;
+	}
+    }
+    return done;
+}
+
+    /*
+     * Rx xirq handler, defers the rx_ring consumption to NAPI
+     */
+
+    static void
+veth_rx_xirq (void* cookie, NkXIrq xirq)
+{
+    VEthLink*	link = (VEthLink*) cookie;
+    VEth*	veth = link->veth;
+
+    (void) xirq;
+    veth->xstats.rx_xirqs++;
+    if (napi_schedule_prep (&veth->napi)) {
+	link->rx_ring->c_no_notify = 1;
+	__napi_schedule (&veth->napi);
+    }
 }
 
     /*
@@ -493,6 +579,44 @@ veth_link_state_notify (const VEthLink* link)
     }
 }
 
+    /*
+     * Notify the peer of the frames queued since the last notification,
+     * unless it is polling the ring anyway. Called with the tx lock held.
+     */
+    static void
+veth_tx_kick (VEth* veth)
+{
+    VEthLink*     link    = &veth->link;
+    VEthRingDesc* tx_ring = link->tx_ring;
+
+    if (tx_ring->p_idx == link->tx_kick_idx) {
+	return;
+    }
+    link->tx_kick_idx = tx_ring->p_idx;
+	/* Publish p_idx before looking at the consumer state */
+    smp_mb();
+    if (tx_ring->c_features == VETH_RING_FEATURES && tx_ring->c_no_notify) {
+	veth->xstats.tx_xirqs_saved++;
+	return;
+    }
+    veth->xstats.tx_xirqs++;
+    nkops.nk_xirq_trigger (link->peer.rx_xirq, link->peer.osid);
+}
+
+    /*
+     * Runs once the stack is done handing us the current burst of
+     * frames (Linux 3.0 has no skb->xmit_more to tell us).
+     */
+    static void
+veth_tx_kick_tasklet (unsigned long data)
+{
+    VEth* veth = (VEth*) data;
+
+    netif_tx_lock (veth->netdev);
+    veth_tx_kick (veth);
+    netif_tx_unlock (veth->netdev);
+}
+
     /*
      * Send sysconf xirq to guest.
      */
@@ -513,6 +637,12 @@ veth_ndo_open (struct net_device* dev)
     VETH_DTRACE ("%s\n", dev->name);
 	/* Reset stats */
     memset (&veth->stats, 0, sizeof veth->stats);
+    memset (&veth->xstats, 0, sizeof veth->xstats);
+    napi_enable (&veth->napi);
+	/* Frames may have been queued while we were down */
+    if (veth->link.rx_ring && RING_C_ROOM (veth->link.rx_ring) > 0) {
+	napi_schedule (&veth->napi);
+    }
     netif_start_queue (dev);
     return 0;
 }
@@ -520,8 +650,11 @@ veth_ndo_open (struct net_device* dev)
     static int
 veth_ndo_close (struct net_device* dev)
 {
+    VEth* veth = netdev_priv (dev);
+
     VETH_DTRACE ("%s\n", dev->name);
     netif_stop_queue (dev);
+    napi_disable (&veth->napi);
     return 0;
 }
 
@@ -579,7 +712,16 @@ veth_ndo_start_xmit (struct sk_buff* skb, struct net_device* dev)
 	tx_ring->stopped = 1;
 	netif_stop_queue (dev);
     }
-    nkops.nk_xirq_trigger (link->peer.rx_xirq, link->peer.osid);
+	/*
+	 * Notify the peer once per burst, or right away if
+	 * enough frames are already waiting for it.
+	 */
+    if (tx_ring->stopped ||
+	tx_ring->p_idx - link->tx_kick_idx >= VETH_TX_KICK_BATCH) {
+	veth_tx_kick (veth);
+    } else {
+	tasklet_schedule (&veth->tx_kick);
+    }
     return NETDEV_TX_OK;
 }
 
@@ -614,6 +756,7 @@ veth_ndo_tx_timeout (struct net_device* dev)
 	 * to consume. Otherwise, wake up interface.
 	 */
     if (RING_IS_FULL (tx_ring)) {
+	veth->xstats.tx_xirqs++;
 	nkops.nk_xirq_trigger (link->peer.rx_xirq, link->peer.osid);
     } else {
 	tx_ring->stopped = 0;
@@ -634,8 +777,10 @@ veth_ndo_tx_timeout (struct net_device* dev)
     static void
 veth_link_reset_rx (VEthLink* link)
 {
-    link->rx_ring->c_idx     = 0;
-    link->rx_ring->freed_idx = 0;
+    link->rx_ring->c_idx       = 0;
+    link->rx_ring->freed_idx   = 0;
+    link->rx_ring->c_no_notify = 0;
+    link->rx_ring->c_features  = VETH_RING_FEATURES;
 }
 
     static void
@@ -643,6 +788,7 @@ veth_link_reset_tx (VEthLink* link)
 {
     link->tx_ring->p_idx   = 0;
     link->tx_ring->stopped = 0;
+    link->tx_kick_idx      = 0;
 }
 
     /*
@@ -806,6 +952,8 @@ veth_alloc_link_resources (VEthLink* link)
 	return -ENOMEM;
     }
     rx_ring->p_idx = 0;
+    rx_ring->c_no_notify = 0;
+    rx_ring->c_features  = VETH_RING_FEATURES;
     veth_rx_ring_data_init (rx_ring);
 
     link->rx_ring    = rx_ring;
@@ -952,6 +1100,8 @@ veth_parse_mac_address (VEth* veth, NkDevVlink* vlink)
 veth_dev_free (VEth* veth)
 {
     unregister_netdev (veth->netdev);
+    tasklet_kill (&veth->tx_kick);
+    netif_napi_del (&veth->napi);
     free_netdev (veth->netdev);		/* This frees "veth" too */
 }
 
@@ -1029,9 +1179,13 @@ veth_dev_create (NkDevVlink* rx_link, NkDevVlink* tx_link)
     netdev->irq                = 0;
     netdev->dma                = 0;
 
+    netif_napi_add (netdev, &veth->napi, veth_poll, VETH_NAPI_WEIGHT);
+    tasklet_init (&veth->tx_kick, veth_tx_kick_tasklet, (unsigned long) veth);
+
 	/* register new Ethernet interface */
     if ((res = register_netdev (netdev))) {
 	VETH_ERR ("%s: register_netdev() failed (%d)\n", netdev->name, res);
+	netif_napi_del (&veth->napi);
 	free_netdev (netdev);
 	return res;
     }
@@ -1099,6 +1253,47 @@ veth_vlink_in_use (NkDevVlink* vlink)
     return 0;
 }
 
+    /*
+     * /proc/nk/veth: cross-interrupts sent and received per frame.
+     */
+    static int
+veth_read_proc (char* page, char** start, off_t off, int count, int* eof,
+		void* data)
+{
+    off_t	 begin = 0;
+    int		 len;
+    unsigned int minor;
+
+    (void) data;
+    len = sprintf (page, "%-8s %10s %10s %10s %8s %10s %10s %10s\n",
+		   "Iface", "TxFrames", "TxXirqs", "TxSaved", "Fr/Xirq",
+		   "RxFrames", "RxXirqs", "RxPolls");
+    for (minor = 0; minor < veth_devices_num; minor++) {
+	const VEth*	     veth = veth_devices [minor];
+	const VEthXirqStats* x    = &veth->xstats;
+	unsigned long	     ratio;
+
+	ratio = x->tx_xirqs ? veth->stats.tx_packets * 100 / x->tx_xirqs : 0;
+	len += sprintf (page + len,
+			"%-8s %10lu %10lu %10lu %5lu.%02lu %10lu %10lu %10lu\n",
+			veth->netdev->name,
+			veth->stats.tx_packets, x->tx_xirqs, x->tx_xirqs_saved,
+			ratio / 100, ratio % 100,
+			veth->stats.rx_packets, x->rx_xirqs, x->rx_polls);
+    }
+    if (len + begin > off + count)
+	goto done;
+    if (len + begin < off) {
+	begin += len;
+	len = 0;
+    }
+    *eof = 1;
+done:
+    if (off >= len + begin) return 0;
+    *start = page + off - begin;
+    return (count < begin + len - off ? count : begin + len - off);
+}
+
 static void veth_module_cleanup (void);
 
     static int __init
@@ -1147,6 +1342,8 @@ veth_module_init (void)
 	    }
 	}
     }
+    veth_proc = create_proc_read_entry ("nk/veth", 0, NULL,
+					veth_read_proc, NULL);
     VETH_INFO ("%u device(s)\n", device_count);
     return 0;
 }
@@ -1160,6 +1357,10 @@ veth_module_cleanup (void)
 {
     unsigned int minor;
 
+    if (veth_proc) {
+	remove_proc_entry ("nk/veth", NULL);
+	veth_proc = NULL;
+    }
     if (veth_sysconf_id) {
 	nkops.nk_xirq_detach (veth_sysconf_id);
     }
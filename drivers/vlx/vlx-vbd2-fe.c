@@ -199,6 +199,7 @@
 #define VBD_LINK_MAX_DISKS		64
 #define	VBD_LINK_MAX_SEGS_PER_REQ	128
 #define VBD_LINK_DEFAULT_MSG_COUNT	64
+#define VBD_LINK_RETURN_BATCH		16
 
 /*----- Tracing -----*/
 
@@ -314,8 +315,21 @@ struct vbd_link_t {
     struct request**	reqs;		/* indexed by msg slot */
 	/* Statistics */
     unsigned		errors;
+    unsigned		submits;	/* requests put on the ring */
+    unsigned		submit_batches;	/* request_fn runs which sent any */
+    unsigned		completes;	/* requests ended */
+    unsigned		complete_batches; /* io_lock sections ending them */
 };
 
+    /*
+     * Read/write responses are collected by vbd_cb_return_notify()
+     * and ended together, under a single io_lock section.
+     */
+typedef struct {
+    struct request*	req;
+    _Bool		is_error;
+} vbd_done_t;
+
     static inline void
 vbd_disk_init (vbd_disk_t* di, vbd2_devid_t xd_devid, vbd2_genid_t xd_genid,
 	       vbd_major_t* major, struct gendisk* gd, dev_t device,
@@ -2054,6 +2068,41 @@ vbd_cache_invalidate (const char* const start, const size_t len)
 #endif
 }
 
+    /*
+     * Cache maintenance on the double-buffering path is accumulated
+     * into a single virtually contiguous range, so that a request
+     * made of whole pages costs one clean or invalidate operation
+     * instead of one per bio_vec.
+     */
+typedef struct {
+    char*	start;
+    size_t	len;
+    _Bool	clean;		/* else invalidate */
+} vbd_cache_range_t;
+
+    static inline void
+vbd_cache_range_flush (vbd_cache_range_t* range)
+{
+    if (range->len) {
+	if (range->clean) {
+	    vbd_cache_clean (range->start, range->len);
+	} else {
+	    vbd_cache_invalidate (range->start, range->len);
+	}
+	range->len = 0;
+    }
+}
+
+    static inline void
+vbd_cache_range_add (vbd_cache_range_t* range, char* start, size_t len)
+{
+    if (range->start + range->len != start) {
+	vbd_cache_range_flush (range);
+	range->start = start;
+    }
+    range->len += len;
+}
+
     /*
      * Request block io.
      * Called from vbd_rq_do_blkif_request_2x() only.
@@ -2085,6 +2134,7 @@ vbd_link_queue_request_26 (vbd_link_t* vbd, struct request* req,
     void*		vaddr = NULL;	/* page virt addr */
     unsigned int        pfsect = 0, plsect = 0;
     u32		        count = 0;
+    vbd_cache_range_t	range = {vshared, 0, rq_data_dir (req)};
 
     DTRACE ("vmq_tx_data_area %p data_offset %x vshared/pshared %p/%lx\n",
 	    vmq_tx_data_area (vbd->link), data_offset, vshared, pshared);
@@ -2136,10 +2186,8 @@ vbd_link_queue_request_26 (vbd_link_t* vbd, struct request* req,
 			DTRACE ("paddr/vaddr %lx/%p bv_offset/len %x/%x\n",
 				paddr, vaddr, bvec->bv_offset, bvec->bv_len);
 			memcpy (start, vaddr + bvec->bv_offset, bvec->bv_len);
-			vbd_cache_clean (start, bvec->bv_len);
-		    } else {
-			vbd_cache_invalidate (start, bvec->bv_len);
 		    }
+		    vbd_cache_range_add (&range, start, bvec->bv_len);
 		    VBD2_FIRST_BUF (rreq) [count-1] =
 			VBD2_BUFFER (pshared - PAGE_SIZE, pfsect, plsect);
 		} else {
@@ -2167,10 +2215,8 @@ vbd_link_queue_request_26 (vbd_link_t* vbd, struct request* req,
 			DTRACE ("paddr/vaddr %lx/%p bv_offset/len %x/%x\n",
 				paddr, vaddr, bvec->bv_offset, bvec->bv_len);
 			memcpy (start, vaddr + bvec->bv_offset, bvec->bv_len);
-			vbd_cache_clean (start, bvec->bv_len);
-		    } else {
-			vbd_cache_invalidate (start, bvec->bv_len);
 		    }
+		    vbd_cache_range_add (&range, start, bvec->bv_len);
 		    VBD2_FIRST_BUF (rreq) [count++] =
 			VBD2_BUFFER (pshared, pfsect, plsect);
 		    vshared += PAGE_SIZE;
@@ -2188,6 +2234,7 @@ vbd_link_queue_request_26 (vbd_link_t* vbd, struct request* req,
     }
     rreq->count = (vbd2_count_t) count;
     if (vbd->xx_config.data_count) {
+	vbd_cache_range_flush (&range);
 	VBD_ASSERT (vbd->data_offsets [slot] == 0xFFFFFFFF);
 	vbd->data_offsets [slot] = data_offset;
     }
@@ -2214,6 +2261,7 @@ vbd_link_copy_back_26 (vbd_link_t* vbd, struct request* req,
     unsigned long       paddr = 0;	/* page phys addr */
     void*		vaddr = NULL;	/* page virt addr */
     unsigned int        pfsect = 0, plsect = 0;
+    vbd_cache_range_t	range = {NULL, 0, true};
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
     rq_for_each_segment (bvec, req, iter)
@@ -2251,11 +2299,12 @@ vbd_link_copy_back_26 (vbd_link_t* vbd, struct request* req,
 		vshared += PAGE_SIZE;
 		pshared += PAGE_SIZE;
 	    }
-	    vbd_cache_clean (vaddr + bvec->bv_offset, bvec->bv_len);
+	    vbd_cache_range_add (&range, vaddr + bvec->bv_offset, bvec->bv_len);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,24)
 	}
 #endif
     }
+    vbd_cache_range_flush (&range);
 }
 
     /*
@@ -2268,6 +2317,7 @@ vbd_rq_do_blkif_request_26 (struct request_queue* rq)
 {
     vbd_link_t*     vbd = rq->queuedata;
     struct request* req;
+    unsigned	    sent = 0;
 
     DTRACE ("link %d\n", vmq_peer_osid (vbd->link));
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,31)
@@ -2344,6 +2394,15 @@ vbd_rq_do_blkif_request_26 (struct request_queue* rq)
 	    }
 	    break;
 	}
+	++sent;
+    }
+	/*
+	 * All requests pulled from the queue above are only signalled
+	 * to the backend now, with a single cross-interrupt.
+	 */
+    if (sent) {
+	vbd->submits += sent;
+	++vbd->submit_batches;
     }
     vmq_msg_send_flush (vbd->link);
 }
@@ -2553,6 +2612,7 @@ vbd_rq_do_blkif_request_24 (struct request_queue* rq)
     vbd_fe_t*		fe = vbd->fe;
 #endif
     struct request*	req;
+    unsigned		sent = 0;
 
     DTRACE ("entered, vbd %p\n", vbd);
     while (!rq->plugged && !list_empty (&rq->queue_head) &&
@@ -2609,6 +2669,11 @@ vbd_rq_do_blkif_request_24 (struct request_queue* rq)
 	    vmq_return_msg_free (vbd->link, rreq);
 	    break;
 	}
+	++sent;
+    }
+    if (sent) {
+	vbd->submits += sent;
+	++vbd->submit_batches;
     }
     vmq_msg_send_flush (vbd->link);
 }
@@ -2617,13 +2682,18 @@ vbd_rq_do_blkif_request_24 (struct request_queue* rq)
 #define VBD_LINK(link) \
     (*(vbd_link_t**) &((vmq_link_public_t*) (link))->priv)
 
-    /* Only called by vbd_cb_return_notify() */
+    /*
+     * Only called by vbd_cb_return_notify().
+     * Read/write requests are not ended here but returned in "done",
+     * in which case true is returned.
+     */
 
-    static void
-vbd_link_return_msg (vbd_link_t* vbd, vbd2_resp_t* resp)
+    static _Bool
+vbd_link_return_msg (vbd_link_t* vbd, vbd2_resp_t* resp, vbd_done_t* done)
 {
     const unsigned	slot = vmq_msg_slot (vbd->link, resp);
     const vbd2_op_t	op = resp->op;	/* Sample for safety */
+    _Bool		is_done = false;
 
     DTRACE ("entered\n");
     switch (op) {
@@ -2631,7 +2701,6 @@ vbd_link_return_msg (vbd_link_t* vbd, vbd2_resp_t* resp)
     case VBD2_OP_WRITE: {
 	struct request* const req = vbd->reqs [slot];
 	_Bool		is_error = resp->count != VBD2_STATUS_OK;
-	unsigned long	flags;
 
 	if ((struct request*)(unsigned long) resp->cookie != req) {
 	    ETRACE ("OS %d bad cookie %llx != %p slot %u resp %p\n",
@@ -2649,10 +2718,9 @@ vbd_link_return_msg (vbd_link_t* vbd, vbd2_resp_t* resp)
 	VBD_CATCHIF (is_error,
 		     ETRACE ("Bad return from %s: %x\n", vbd_op_names [op],
 			     resp->count));
-	spin_lock_irqsave (&vbd->io_lock, flags);
-	vbd_request_end (req, is_error);
-	vbd_link_kick_pending_request_queues_2x (vbd);
-	spin_unlock_irqrestore (&vbd->io_lock, flags);
+	done->req      = req;
+	done->is_error = is_error;
+	is_done        = true;
 	break;
     }
     case VBD2_OP_PROBE:
@@ -2680,6 +2748,30 @@ vbd_link_return_msg (vbd_link_t* vbd, vbd2_resp_t* resp)
 #endif
 	vmq_return_msg_free (vbd->link, resp);
     }
+    return is_done;
+}
+
+    /*
+     * Ends a batch of read/write requests whose messages have
+     * already been freed, so that the request queues restarted
+     * here find as many free ring slots as possible.
+     */
+
+    static void
+vbd_link_end_requests (vbd_link_t* vbd, const vbd_done_t* done,
+		       const unsigned count)
+{
+    unsigned long	flags;
+    unsigned		i;
+
+    spin_lock_irqsave (&vbd->io_lock, flags);
+    for (i = 0; i < count; ++i) {
+	vbd_request_end (done [i].req, done [i].is_error);
+    }
+    vbd->completes += count;
+    ++vbd->complete_batches;
+    vbd_link_kick_pending_request_queues_2x (vbd);
+    spin_unlock_irqrestore (&vbd->io_lock, flags);
 }
 
 /*----- Module thread -----*/
@@ -2851,10 +2943,20 @@ vbd_cb_receive_notify (vmq_link_t* link)
     static void
 vbd_cb_return_notify (vmq_link_t* link)
 {
-    void*  msg;
+    vbd_link_t*	vbd = VBD_LINK (link);
+    vbd_done_t	done [VBD_LINK_RETURN_BATCH];
+    unsigned	count = 0;
+    void*	msg;
 
     while (!vmq_return_msg_receive (link, &msg)) {
-	vbd_link_return_msg (VBD_LINK (link), (vbd2_resp_t*) msg);
+	if (vbd_link_return_msg (vbd, (vbd2_resp_t*) msg, &done [count]) &&
+	    ++count == VBD_LINK_RETURN_BATCH) {
+	    vbd_link_end_requests (vbd, done, count);
+	    count = 0;
+	}
+    }
+    if (count) {
+	vbd_link_end_requests (vbd, done, count);
     }
 }
 
@@ -2880,6 +2982,12 @@ vbd_link_proc (vmq_link_t* link, void* cookie)
 			 vbd->msg_max, vbd->segs_per_req_max,
 			 VBD_LINK_MAX_DEVIDS_PER_PROBE (vbd), vbd->is_up,
 			 vbd->xx_config.data_count ? "On" : "No", vbd->errors);
+    ctx->len += sprintf (ctx->page + ctx->len,
+			 "Submits- SBatches Completes CBatches\n");
+    ctx->len += sprintf (ctx->page + ctx->len,
+			 "%8u %8u %9u %8u\n", vbd->submits,
+			 vbd->submit_batches, vbd->completes,
+			 vbd->complete_batches);
 
     if (!vbd->disks) return false;
     ctx->len += sprintf (ctx->page + ctx->len,
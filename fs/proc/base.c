@@ -1042,6 +1042,14 @@ static const struct file_operations proc_environ_operations = {
 	.llseek		= generic_file_llseek,
 };
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void lowmem_adj_changed(struct task_struct *task);
+#else
+static inline void lowmem_adj_changed(struct task_struct *task)
+{
+}
+#endif
+
 static ssize_t oom_adjust_read(struct file *file, char __user *buf,
 				size_t count, loff_t *ppos)
 {
@@ -1143,6 +1151,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		lowmem_adj_changed(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1187,6 +1197,64 @@ static const struct file_operations proc_oom_adjust_operations = {
 	.llseek		= generic_file_llseek,
 };
 
+#if defined(CONFIG_ZRAM_FOR_ANDROID) && defined(CONFIG_ANDROID_LOW_MEMORY_KILLER)
+extern int lowmem_reclaim_mm(struct mm_struct *mm, unsigned int nr_to_scan);
+
+/*
+ * Writing "all" to /proc/<pid>/reclaim swaps every anonymous page of the
+ * process out to zram, writing a number stops after that many pages.
+ * Lets the activity manager push out an app as soon as it goes to the
+ * background, rather than leaving it to lowmemorykiller under pressure.
+ */
+static ssize_t reclaim_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct task_struct *task;
+	struct mm_struct *mm;
+	char buffer[PROC_NUMBUF];
+	unsigned int nr_to_scan;
+	int err;
+
+	memset(buffer, 0, sizeof(buffer));
+	if (count > sizeof(buffer) - 1)
+		count = sizeof(buffer) - 1;
+	if (copy_from_user(buffer, buf, count))
+		return -EFAULT;
+
+	if (!strcmp(strstrip(buffer), "all")) {
+		nr_to_scan = UINT_MAX;
+	} else {
+		err = kstrtouint(strstrip(buffer), 10, &nr_to_scan);
+		if (err)
+			return err;
+		if (!nr_to_scan)
+			return -EINVAL;
+	}
+
+	task = get_proc_task(file->f_path.dentry->d_inode);
+	if (!task)
+		return -ESRCH;
+	mm = get_task_mm(task);
+	if (mm) {
+		lowmem_reclaim_mm(mm, nr_to_scan);
+		mmput(mm);
+	}
+	put_task_struct(task);
+
+	return count;
+}
+
+/* Same access rules as oom_adj, the system server manages both */
+static const struct inode_operations proc_reclaim_inode_operations = {
+	.permission	= oom_adjust_permission,
+};
+
+static const struct file_operations proc_reclaim_operations = {
+	.write		= reclaim_write,
+	.llseek		= noop_llseek,
+};
+#endif
+
 static ssize_t oom_score_adj_read(struct file *file, char __user *buf,
 					size_t count, loff_t *ppos)
 {
@@ -1278,6 +1346,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		lowmem_adj_changed(task);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -2881,6 +2951,9 @@ static const struct pid_entry tgid_base_stuff[] = {
 	INF("oom_score",  S_IRUGO, proc_oom_score),
 	ANDROID("oom_adj",S_IRUGO|S_IWUSR, oom_adjust),
 	REG("oom_score_adj", S_IRUGO|S_IWUSR, proc_oom_score_adj_operations),
+#if defined(CONFIG_ZRAM_FOR_ANDROID) && defined(CONFIG_ANDROID_LOW_MEMORY_KILLER)
+	ANDROID("reclaim", S_IWUSR, reclaim),
+#endif
 #ifdef CONFIG_AUDITSYSCALL
 	REG("loginuid",   S_IWUSR|S_IRUGO, proc_loginuid_operations),
 	REG("sessionid",  S_IRUGO, proc_sessionid_operations),
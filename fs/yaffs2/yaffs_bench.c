@@ -0,0 +1,254 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Short op benchmark for the yaffs chunk cache, meant to be run on a
+ * nandsim backed mount. Does <count> reads or writes of <size> bytes at
+ * random <size> aligned offsets within the first <span> KB of a file.
+ * Writes smaller than a chunk go through the chunk cache; reads drop
+ * the page cache first so that every one of them reaches yaffs. Along
+ * with throughput and latency the yaffs cache hits are reported, so the
+ * effect of n_caches can be compared. Usage:
+ *
+ *   echo "write|read <size> <span> <count>" > /sys/kernel/debug/yaffs_bench
+ *   cat /sys/kernel/debug/yaffs_bench
+ *
+ * Run a write first, the read test only covers what is in the file.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/hrtimer.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <asm/div64.h>
+
+#include "yaffs_guts.h"
+
+static char *path = "/mnt/yaffs_bench";
+module_param(path, charp, 0444);
+MODULE_PARM_DESC(path, "file to run on, created if needed, on a yaffs mount");
+
+struct ybench {
+	struct mutex lock;
+
+	/* current run */
+	u32 size;
+	u32 count;
+	u32 *lat;		/* ns per op */
+
+	/* last result */
+	char result[512];
+};
+
+static struct ybench ybench;
+static struct dentry *ybench_dentry;
+
+static inline u64 ybench_now(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+static int ybench_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void ybench_report(const char *test, u32 n, u32 span, u32 hits,
+			  int n_caches, u64 elapsed)
+{
+	u64 bytes = (u64)n * ybench.size;
+	u64 kbps, iops, us = elapsed;
+
+	do_div(us, NSEC_PER_USEC);
+	if (!us)
+		us = 1;
+
+	kbps = (bytes * USEC_PER_SEC) >> 10;
+	do_div(kbps, (u32)us);
+	iops = (u64)n * USEC_PER_SEC;
+	do_div(iops, (u32)us);
+
+	if (n)
+		sort(ybench.lat, n, sizeof(u32), ybench_cmp, NULL);
+
+	snprintf(ybench.result, sizeof(ybench.result),
+		 "test: %s, size: %u, span: %u KB, count: %u, done: %u\n"
+		 "n_caches: %d, cache hits: %u\n"
+		 "elapsed: %llu us, %llu KB/s, %llu ops/s\n"
+		 "latency (us): p50 %u, p90 %u, p99 %u, max %u\n",
+		 test, ybench.size, span, ybench.count, n, n_caches, hits,
+		 us, kbps, iops,
+		 n ? ybench.lat[n / 2] / 1000 : 0,
+		 n ? ybench.lat[n * 9 / 10] / 1000 : 0,
+		 n ? ybench.lat[n * 99 / 100] / 1000 : 0,
+		 n ? ybench.lat[n - 1] / 1000 : 0);
+
+	printk(KERN_INFO "yaffs bench: %s", ybench.result);
+}
+
+static int ybench_run(const char *test, u32 size, u32 span, u32 count)
+{
+	struct file *filp;
+	struct inode *inode;
+	struct yaffs_dev *dev;
+	mm_segment_t old_fs;
+	bool write;
+	char *buf;
+	u32 slots, hits, i;
+	loff_t pos;
+	ssize_t ret;
+	u64 start, elapsed = 0;
+	int rval = 0;
+
+	if (!strcmp(test, "write"))
+		write = true;
+	else if (!strcmp(test, "read"))
+		write = false;
+	else
+		return -EINVAL;
+
+	if (!size || size > PAGE_SIZE || !count || span > (1U << 20))
+		return -EINVAL;
+	slots = (span << 10) / size;
+	if (!slots)
+		return -EINVAL;
+
+	filp = filp_open(path, write ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+	inode = filp->f_path.dentry->d_inode;
+	if (inode->i_sb->s_magic != YAFFS_MAGIC) {
+		filp_close(filp, NULL);
+		return -EINVAL;
+	}
+	dev = ((struct yaffs_obj *)inode->i_private)->my_dev;
+
+	mutex_lock(&ybench.lock);
+
+	buf = kmalloc(size, GFP_KERNEL);
+	ybench.lat = vmalloc(sizeof(u32) * count);
+	if (!buf || !ybench.lat) {
+		rval = -ENOMEM;
+		goto out;
+	}
+	memset(buf, 0x5a, size);
+	ybench.size = size;
+	ybench.count = count;
+
+	hits = dev->cache_hits;
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	for (i = 0; i < count; i++) {
+		pos = (loff_t)(random32() % slots) * size;
+		if (write) {
+			*(u32 *)buf = i;
+			start = ybench_now();
+			ret = vfs_write(filp, (char __user *)buf, size, &pos);
+		} else {
+			invalidate_mapping_pages(inode->i_mapping, 0, -1);
+			start = ybench_now();
+			ret = vfs_read(filp, (char __user *)buf, size, &pos);
+		}
+		ybench.lat[i] = (u32)min_t(u64, ybench_now() - start,
+					   UINT_MAX);
+		elapsed += ybench.lat[i];
+		if (ret < 0) {
+			rval = ret;
+			break;
+		}
+	}
+	set_fs(old_fs);
+
+	ybench_report(test, i, span, dev->cache_hits - hits,
+		      dev->param.n_caches, elapsed);
+
+out:
+	vfree(ybench.lat);
+	ybench.lat = NULL;
+	kfree(buf);
+	mutex_unlock(&ybench.lock);
+	filp_close(filp, NULL);
+
+	return rval;
+}
+
+static ssize_t ybench_write(struct file *filp, const char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	char buf[64], test[16];
+	u32 size, span, num;
+	int rval;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (sscanf(buf, "%15s %u %u %u", test, &size, &span, &num) != 4)
+		return -EINVAL;
+
+	rval = ybench_run(test, size, span, num);
+
+	return rval ? rval : count;
+}
+
+static int ybench_show(struct seq_file *m, void *private)
+{
+	mutex_lock(&ybench.lock);
+	seq_printf(m, "%s", ybench.result);
+	mutex_unlock(&ybench.lock);
+
+	return 0;
+}
+
+static int ybench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ybench_show, inode->i_private);
+}
+
+static const struct file_operations ybench_fops = {
+	.open = ybench_open,
+	.read = seq_read,
+	.write = ybench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init ybench_init(void)
+{
+	mutex_init(&ybench.lock);
+
+	ybench_dentry = debugfs_create_file("yaffs_bench", S_IRUGO | S_IWUSR,
+					    NULL, NULL, &ybench_fops);
+	if (!ybench_dentry)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void __exit ybench_exit(void)
+{
+	debugfs_remove(ybench_dentry);
+}
+
+module_init(ybench_init);
+module_exit(ybench_exit);
+
+MODULE_DESCRIPTION("YAFFS chunk cache benchmark");
+MODULE_LICENSE("GPL");
@@ -35,10 +35,11 @@
 
 #include "yaffs_attribs.h"
 
-/* Note YAFFS_GC_GOOD_ENOUGH must be <= YAFFS_GC_PASSIVE_THRESHOLD */
-#define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Candidates compared by sequence number within one gc_bucket */
+#define YAFFS_GC_INDEX_SCAN 8
+
 #include "yaffs_ecc.h"
 
 /* Forward declarations */
@@ -252,12 +253,48 @@ static void yaffs_handle_chunk_update(struct yaffs_dev *dev, int nand_chunk,
 	tags = tags;
 }
 
+/*
+ * GC candidate index.
+ * Must be called whenever a block's state, gc_prioritise flag or
+ * pages_in_use - soft_del_pages changes. Only FULL blocks are filed, so
+ * the gc does not have to walk the whole of block_info to find one.
+ */
+static void yaffs_gc_index_update(struct yaffs_dev *dev,
+				  struct yaffs_block_info *bi)
+{
+	struct list_head *link = &dev->gc_link[bi - dev->block_info];
+	int live = bi->pages_in_use - bi->soft_del_pages;
+
+	list_del_init(link);
+
+	if (bi->block_state != YAFFS_BLOCK_STATE_FULL)
+		return;
+
+	if (bi->gc_prioritise) {
+		list_add_tail(link, &dev->gc_prio);
+		dev->has_pending_prioritised_gc = 1;
+	} else if (live >= 0 && live < dev->param.chunks_per_block) {
+		list_add_tail(link, &dev->gc_bucket[live]);
+	}
+}
+
+/* Scanning and checkpoint restore set up block_info wholesale. */
+static void yaffs_gc_index_rebuild(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int i;
+
+	for (i = 0; i < n_blocks; i++)
+		yaffs_gc_index_update(dev, &dev->block_info[i]);
+}
+
 void yaffs_handle_chunk_error(struct yaffs_dev *dev,
 			      struct yaffs_block_info *bi)
 {
 	if (!bi->gc_prioritise) {
 		bi->gc_prioritise = 1;
 		dev->has_pending_prioritised_gc = 1;
+		yaffs_gc_index_update(dev, bi);
 		bi->chunk_error_strikes++;
 
 		if (bi->chunk_error_strikes > 3) {
@@ -492,6 +529,7 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 		/* If the block is full set the state to full */
 		if (dev->alloc_page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, bi);
 			dev->alloc_block = -1;
 		}
 
@@ -530,6 +568,7 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 		    yaffs_get_block_info(dev, dev->alloc_block);
 		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_index_update(dev, bi);
 			dev->alloc_block = -1;
 		}
 	}
@@ -677,6 +716,7 @@ static void yaffs_retire_block(struct yaffs_dev *dev, int flash_block)
 	bi->block_state = YAFFS_BLOCK_STATE_DEAD;
 	bi->gc_prioritise = 0;
 	bi->needs_retiring = 0;
+	yaffs_gc_index_update(dev, bi);
 
 	dev->n_retired_blocks++;
 }
@@ -1216,6 +1256,7 @@ static void yaffs_soft_del_chunk(struct yaffs_dev *dev, int chunk)
 		the_block->soft_del_pages++;
 		dev->n_free_chunks++;
 		yaffs2_update_oldest_dirty_seq(dev, block_no, the_block);
+		yaffs_gc_index_update(dev, the_block);
 	}
 }
 
@@ -1409,73 +1450,147 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Cache chunks in use are hashed on (object id, chunk id) for lookup and
+ *   kept on an LRU list for replacement, so that a device can have hundreds
+ *   of them without making every read and write search through them all.
+ *   Dirty chunks are also on a dirty list, so flushing only looks at them.
  */
 
-static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    const struct yaffs_obj *obj,
+					    int chunk_id)
+{
+	return &dev->cache_bucket[(obj->obj_id * 31 + chunk_id) &
+				  (YAFFS_NCACHE_BUCKETS - 1)];
+}
+
+/* Hook up a grabbed cache chunk to the object chunk it is going to hold. */
+static void yaffs_assign_chunk_cache(struct yaffs_dev *dev,
+				     struct yaffs_cache *cache,
+				     struct yaffs_obj *obj, int chunk_id)
+{
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	list_add(&cache->hash_link, yaffs_cache_bucket(dev, obj, chunk_id));
+	list_move_tail(&cache->lru, &dev->cache_lru);
+}
+
+/* First dirty chunk of obj, the one with the lowest chunk id, or NULL. */
+static struct yaffs_cache *yaffs_first_dirty_cache(struct yaffs_dev *dev,
+						   const struct yaffs_obj *obj)
 {
-	struct yaffs_dev *dev = obj->my_dev;
-	int i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
-		if (cache->object == obj && cache->dirty)
-			return 1;
+	list_for_each_entry(cache, &dev->cache_dirty, dirty_link) {
+		if (cache->object == obj)
+			return cache;
 	}
+	return NULL;
+}
 
-	return 0;
+/* Put a chunk on the dirty list next to the other dirty chunks of its object,
+ * keeping those in chunk id order so they are flushed out sequentially.
+ */
+static void yaffs_mark_cache_dirty(struct yaffs_dev *dev,
+				   struct yaffs_cache *cache)
+{
+	struct yaffs_cache *pos;
+
+	if (cache->dirty)
+		return;
+	cache->dirty = 1;
+	dev->n_dirty_caches++;
+
+	pos = yaffs_first_dirty_cache(dev, cache->object);
+	if (!pos) {
+		list_add_tail(&cache->dirty_link, &dev->cache_dirty);
+		return;
+	}
+	list_for_each_entry_from(pos, &dev->cache_dirty, dirty_link) {
+		if (pos->object != cache->object ||
+		    pos->chunk_id > cache->chunk_id)
+			break;
+	}
+	list_add_tail(&cache->dirty_link, &pos->dirty_link);
 }
 
-static void yaffs_flush_file_cache(struct yaffs_obj *obj)
+static void yaffs_mark_cache_clean(struct yaffs_dev *dev,
+				   struct yaffs_cache *cache)
+{
+	if (!cache->dirty)
+		return;
+	cache->dirty = 0;
+	dev->n_dirty_caches--;
+	list_del_init(&cache->dirty_link);
+}
+
+/* Drop whatever a cache chunk holds and put it back on the free list. */
+static void yaffs_release_chunk_cache(struct yaffs_dev *dev,
+				      struct yaffs_cache *cache)
+{
+	yaffs_mark_cache_clean(dev, cache);
+	cache->object = NULL;
+	list_del_init(&cache->hash_link);
+	list_move(&cache->lru, &dev->cache_free);
+}
+
+static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+
+	if (dev->param.n_caches < 1)
+		return 0;
+
+	return yaffs_first_dirty_cache(dev, obj) != NULL;
+}
+
+/* Write out the dirty chunks of obj, lowest chunk id first. They are
+ * contiguous on the dirty list, so this only walks the list once.
+ * Returns 0 if it had to stop early, on a locked chunk or a failed write.
+ */
+static int yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
 	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
-
-	if (n_caches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
-			}
+	int chunk_written;
+
+	if (dev->param.n_caches < 1)
+		return 1;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	cache = yaffs_first_dirty_cache(dev, obj);
+	while (cache) {
+		struct yaffs_cache *next = NULL;
 
-				chunk_written =
-				    yaffs_wr_data_obj(cache->object,
-						      cache->chunk_id,
-						      cache->data,
-						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+		if (cache->locked)
+			return 0;
+
+		if (!list_is_last(&cache->dirty_link, &dev->cache_dirty)) {
+			next = list_entry(cache->dirty_link.next,
+					  struct yaffs_cache, dirty_link);
+			if (next->object != obj)
+				next = NULL;
+		}
 
-		} while (cache && chunk_written > 0);
+		/* Write it out and free it up */
+		chunk_written =
+		    yaffs_wr_data_obj(cache->object,
+				      cache->chunk_id,
+				      cache->data,
+				      cache->n_bytes, 1);
+		yaffs_release_chunk_cache(dev, cache);
 
-		if (cache)
+		if (chunk_written <= 0) {
 			/* Hoosterman, disk full while writing cache out. */
 			yaffs_trace(YAFFS_TRACE_ERROR,
 				"yaffs tragedy: no space during cache write");
-
+			return 0;
+		}
+		cache = next;
 	}
 
+	return 1;
 }
 
 /*yaffs_flush_whole_cache(dev)
@@ -1485,42 +1600,30 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
-	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
+	struct yaffs_cache *cache;
 
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
+	/* Flush the object of the first dirty chunk...
+	 * until there are no further dirty chunks.
 	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-
-		}
-		if (obj)
-			yaffs_flush_file_cache(obj);
-
-	} while (obj);
+	while (!list_empty(&dev->cache_dirty)) {
+		cache = list_first_entry(&dev->cache_dirty, struct yaffs_cache,
+					 dirty_link);
+		if (!yaffs_flush_file_cache(cache->object))
+			break;
+	}
 
 }
 
 /* Grab us a cache chunk for use.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Then take the least recently used unlocked one, if it is dirty flush its
+ * object and look again.
  */
 static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 {
-	int i;
-
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
-		}
-	}
+	if (dev->param.n_caches > 0 && !list_empty(&dev->cache_free))
+		return list_first_entry(&dev->cache_free, struct yaffs_cache,
+					lru);
 
 	return NULL;
 }
@@ -1528,53 +1631,32 @@ static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
-	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_grab_chunk_worker(dev);
-
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
-
-			/* With locking we can't assume we can use entry zero */
-
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
+	if (dev->param.n_caches < 1)
+		return NULL;
 
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
-			}
+	cache = yaffs_grab_chunk_worker(dev);
+	if (cache)
+		return cache;
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
+	/* With locking we can't assume we can use the first one */
+	list_for_each_entry(cache, &dev->cache_lru, lru) {
+		if (cache->locked)
+			continue;
 
+		if (cache->dirty) {
+			/* Flush and try again.
+			 * NB this flushes every dirty chunk of the object.
+			 */
+			yaffs_flush_file_cache(cache->object);
+			return yaffs_grab_chunk_worker(dev);
 		}
+
+		yaffs_release_chunk_cache(dev, cache);
 		return cache;
-	} else {
-		return NULL;
-        }
+	}
+
+	return NULL;
 }
 
 /* Find a cached chunk */
@@ -1582,14 +1664,17 @@ static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
+	struct yaffs_cache *cache;
+
 	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
+		list_for_each_entry(cache,
+				    yaffs_cache_bucket(dev, obj, chunk_id),
+				    hash_link) {
+			if (cache->object == obj &&
+			    cache->chunk_id == chunk_id) {
 				dev->cache_hits++;
 
-				return &dev->cache[i];
+				return cache;
 			}
 		}
 	}
@@ -1602,21 +1687,10 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
+		list_move_tail(&cache->lru, &dev->cache_lru);
 
 		if (is_write)
-			cache->dirty = 1;
+			yaffs_mark_cache_dirty(dev, cache);
 	}
 }
 
@@ -1631,7 +1705,7 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 		    yaffs_find_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_release_chunk_cache(object->my_dev, cache);
 	}
 }
 
@@ -1647,7 +1721,7 @@ static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->param.n_caches; i++) {
 			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+				yaffs_release_chunk_cache(dev, &dev->cache[i]);
 		}
 	}
 }
@@ -2316,9 +2390,13 @@ struct yaffs_obj *yaffs_link_obj(struct yaffs_obj *parent, const YCHAR * name,
 static int yaffs_init_blocks(struct yaffs_dev *dev)
 {
 	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int n_links = n_blocks + dev->param.chunks_per_block;
+	int i;
 
 	dev->block_info = NULL;
 	dev->chunk_bits = NULL;
+	dev->gc_link = NULL;
+	dev->block_reads = NULL;
 
 	dev->alloc_block = -1;	/* force it to get a new one */
 
@@ -2348,9 +2426,40 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	}
 
 	if (dev->block_info && dev->chunk_bits) {
+		/* Block links first, then the buckets */
+		dev->gc_link = kmalloc(n_links * sizeof(struct list_head),
+				       GFP_NOFS);
+		if (!dev->gc_link) {
+			dev->gc_link =
+			    vmalloc(n_links * sizeof(struct list_head));
+			dev->gc_index_alt = 1;
+		} else {
+			dev->gc_index_alt = 0;
+		}
+	}
+
+	if (dev->block_info && dev->chunk_bits && dev->gc_link) {
+		dev->block_reads = kmalloc(n_blocks * sizeof(atomic_t),
+					   GFP_NOFS);
+		if (!dev->block_reads) {
+			dev->block_reads = vmalloc(n_blocks * sizeof(atomic_t));
+			dev->block_reads_alt = 1;
+		} else {
+			dev->block_reads_alt = 0;
+		}
+	}
+
+	if (dev->block_info && dev->chunk_bits && dev->gc_link &&
+	    dev->block_reads) {
 		memset(dev->block_info, 0,
 		       n_blocks * sizeof(struct yaffs_block_info));
 		memset(dev->chunk_bits, 0, dev->chunk_bit_stride * n_blocks);
+		for (i = 0; i < n_links; i++)
+			INIT_LIST_HEAD(&dev->gc_link[i]);
+		dev->gc_bucket = dev->gc_link + n_blocks;
+		INIT_LIST_HEAD(&dev->gc_prio);
+		for (i = 0; i < n_blocks; i++)
+			atomic_set(&dev->block_reads[i], 0);
 		return YAFFS_OK;
 	}
 
@@ -2374,6 +2483,21 @@ static void yaffs_deinit_blocks(struct yaffs_dev *dev)
 		kfree(dev->chunk_bits);
 	dev->chunk_bits_alt = 0;
 	dev->chunk_bits = NULL;
+
+	if (dev->gc_index_alt && dev->gc_link)
+		vfree(dev->gc_link);
+	else if (dev->gc_link)
+		kfree(dev->gc_link);
+	dev->gc_index_alt = 0;
+	dev->gc_link = NULL;
+	dev->gc_bucket = NULL;
+
+	if (dev->block_reads_alt && dev->block_reads)
+		vfree(dev->block_reads);
+	else if (dev->block_reads)
+		kfree(dev->block_reads);
+	dev->block_reads_alt = 0;
+	dev->block_reads = NULL;
 }
 
 void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
@@ -2394,6 +2518,7 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 	yaffs2_clear_oldest_dirty_seq(dev, bi);
 
 	bi->block_state = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_gc_index_update(dev, bi);
 
 	/* If this is the block being garbage collected then stop gc'ing this block */
 	if (block_no == dev->gc_block)
@@ -2483,8 +2608,10 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 
 	/*yaffs_verify_free_chunks(dev); */
 
-	if (bi->block_state == YAFFS_BLOCK_STATE_FULL)
+	if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
 		bi->block_state = YAFFS_BLOCK_STATE_COLLECTING;
+		yaffs_gc_index_update(dev, bi);
+	}
 
 	bi->has_shrink_hdr = 0;	/* clear the flag so that the block can erase */
 
@@ -2694,6 +2821,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		 * because checkpointing does not restore gc.
 		 */
 		bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		yaffs_gc_index_update(dev, bi);
 	} else {
 		/* The gc completed. */
 		/* Do any required cleanups */
@@ -2730,6 +2858,58 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+/*
+ * yaffs_gc_index_find() returns the block with the fewest live chunks, no
+ * more than threshold, that is ok to gc. Among the first few such blocks
+ * with that count the one with the oldest sequence number wins.
+ * Entries that went stale are refiled as they are found.
+ */
+static unsigned yaffs_gc_index_find(struct yaffs_dev *dev, int threshold,
+				    unsigned *pages_used)
+{
+	struct list_head *pos, *n;
+	struct yaffs_block_info *bi;
+	struct yaffs_block_info *best_bi;
+	int live;
+	int scanned;
+
+	if (threshold >= dev->param.chunks_per_block)
+		threshold = dev->param.chunks_per_block - 1;
+
+	for (live = 0; live <= threshold; live++) {
+		best_bi = NULL;
+		scanned = 0;
+
+		list_for_each_safe(pos, n, &dev->gc_bucket[live]) {
+			bi = &dev->block_info[pos - dev->gc_link];
+
+			if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+			    bi->gc_prioritise ||
+			    bi->pages_in_use - bi->soft_del_pages != live) {
+				yaffs_gc_index_update(dev, bi);
+				continue;
+			}
+
+			if (!yaffs_block_ok_for_gc(dev, bi))
+				continue;
+
+			if (!best_bi || bi->seq_number < best_bi->seq_number)
+				best_bi = bi;
+
+			if (++scanned >= YAFFS_GC_INDEX_SCAN)
+				break;
+		}
+
+		if (best_bi) {
+			*pages_used = live;
+			return dev->internal_start_block +
+			    (best_bi - dev->block_info);
+		}
+	}
+
+	return 0;
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
  * for garbage collection.
@@ -2738,8 +2918,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				    int aggressive, int background)
 {
-	int i;
-	int iterations;
+	struct list_head *pos, *n;
 	unsigned selected = 0;
 	int prioritised = 0;
 	int prioritised_exist = 0;
@@ -2749,19 +2928,22 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->has_pending_prioritised_gc && !aggressive) {
 		dev->gc_dirtiest = 0;
-		bi = dev->block_info;
-		for (i = dev->internal_start_block;
-		     i <= dev->internal_end_block && !selected; i++) {
-
-			if (bi->gc_prioritise) {
-				prioritised_exist = 1;
-				if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-				    yaffs_block_ok_for_gc(dev, bi)) {
-					selected = i;
-					prioritised = 1;
-				}
+		list_for_each_safe(pos, n, &dev->gc_prio) {
+			bi = &dev->block_info[pos - dev->gc_link];
+
+			if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+			    !bi->gc_prioritise) {
+				yaffs_gc_index_update(dev, bi);
+				continue;
+			}
+
+			prioritised_exist = 1;
+			if (yaffs_block_ok_for_gc(dev, bi)) {
+				selected = dev->internal_start_block +
+				    (bi - dev->block_info);
+				prioritised = 1;
+				break;
 			}
-			bi++;
 		}
 
 		/*
@@ -2785,12 +2967,8 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	 */
 
 	if (!selected) {
-		int pages_used;
-		int n_blocks =
-		    dev->internal_end_block - dev->internal_start_block + 1;
 		if (aggressive) {
 			threshold = dev->param.chunks_per_block;
-			iterations = n_blocks;
 		} else {
 			int max_threshold;
 
@@ -2807,38 +2985,11 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				threshold = YAFFS_GC_PASSIVE_THRESHOLD;
 			if (threshold > max_threshold)
 				threshold = max_threshold;
-
-			iterations = n_blocks / 16 + 1;
-			if (iterations > 100)
-				iterations = 100;
 		}
 
-		for (i = 0;
-		     i < iterations &&
-		     (dev->gc_dirtiest < 1 ||
-		      dev->gc_pages_in_use > YAFFS_GC_GOOD_ENOUGH); i++) {
-			dev->gc_block_finder++;
-			if (dev->gc_block_finder < dev->internal_start_block ||
-			    dev->gc_block_finder > dev->internal_end_block)
-				dev->gc_block_finder =
-				    dev->internal_start_block;
-
-			bi = yaffs_get_block_info(dev, dev->gc_block_finder);
-
-			pages_used = bi->pages_in_use - bi->soft_del_pages;
-
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
-			    && yaffs_block_ok_for_gc(dev, bi)) {
-				dev->gc_dirtiest = dev->gc_block_finder;
-				dev->gc_pages_in_use = pages_used;
-			}
-		}
-
-		if (dev->gc_dirtiest > 0 && dev->gc_pages_in_use <= threshold)
-			selected = dev->gc_dirtiest;
+		dev->gc_dirtiest =
+		    yaffs_gc_index_find(dev, threshold, &dev->gc_pages_in_use);
+		selected = dev->gc_dirtiest;
 	}
 
 	/*
@@ -2880,8 +3031,8 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	} else {
 		dev->gc_not_done++;
 		yaffs_trace(YAFFS_TRACE_GC,
-			"GC none: finder %d skip %d threshold %d dirtiest %d using %d oldest %d%s",
-			dev->gc_block_finder, dev->gc_not_done, threshold,
+			"GC none: skip %d threshold %d dirtiest %d using %d oldest %d%s",
+			dev->gc_not_done, threshold,
 			dev->gc_dirtiest, dev->gc_pages_in_use,
 			dev->oldest_dirty_block, background ? " bg" : "");
 	}
@@ -3076,6 +3227,7 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		yaffs_clear_chunk_bit(dev, block, page);
 
 		bi->pages_in_use--;
+		yaffs_gc_index_update(dev, bi);
 
 		if (bi->pages_in_use == 0 &&
 		    !bi->has_shrink_hdr &&
@@ -3553,6 +3705,74 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
  * Curve-balls: the first chunk might also be the last chunk.
  */
 
+static atomic_t *yaffs_block_reads(struct yaffs_dev *dev, int nand_chunk)
+{
+	int block_no = nand_chunk / dev->param.chunks_per_block;
+
+	return &dev->block_reads[block_no - dev->internal_start_block];
+}
+
+/*
+ * yaffs_file_rd_map()
+ * Sets up a read of whole chunks that can be done without the device lock:
+ * looks up the nand chunk holding each chunk of [offset, offset + n_bytes),
+ * or -1 for a hole, and marks a read as in flight on each of their blocks so
+ * that none of them gets erased under it. The caller must then read them and
+ * call yaffs_unlocked_read_done().
+ * Returns the number of chunks, or 0 if the range has to go through
+ * yaffs_file_rd() because it is not chunk aligned or is in the cache.
+ */
+int yaffs_file_rd_map(struct yaffs_obj *in, loff_t offset, int n_bytes,
+		      int *nand_chunks)
+{
+	struct yaffs_dev *dev = in->my_dev;
+	int chunk;
+	u32 start;
+	int n_chunks;
+	int i;
+
+	if (!dev->param.is_yaffs2 || dev->param.inband_tags ||
+	    n_bytes % dev->data_bytes_per_chunk)
+		return 0;
+
+	yaffs_addr_to_chunk(dev, offset, &chunk, &start);
+	if (start)
+		return 0;
+	chunk++;
+
+	n_chunks = n_bytes / dev->data_bytes_per_chunk;
+	for (i = 0; i < n_chunks; i++) {
+		if (yaffs_find_chunk_cache(in, chunk + i))
+			return 0;
+		nand_chunks[i] = yaffs_find_chunk_in_file(in, chunk + i, NULL);
+	}
+
+	for (i = 0; i < n_chunks; i++)
+		if (nand_chunks[i] >= 0)
+			atomic_inc(yaffs_block_reads(dev, nand_chunks[i]));
+	return n_chunks;
+}
+
+void yaffs_unlocked_read_done(struct yaffs_dev *dev, const int *nand_chunks,
+			      int n_chunks)
+{
+	int i;
+
+	for (i = 0; i < n_chunks; i++)
+		if (nand_chunks[i] >= 0 &&
+		    atomic_dec_and_test(yaffs_block_reads(dev, nand_chunks[i])))
+			wake_up(&dev->unlocked_read_wait);
+}
+
+/* Called with the device lock held, so no new read can be mapped meanwhile */
+void yaffs_wait_unlocked_reads(struct yaffs_dev *dev, int block_no)
+{
+	atomic_t *reads =
+		&dev->block_reads[block_no - dev->internal_start_block];
+
+	wait_event(dev->unlocked_read_wait, !atomic_read(reads));
+}
+
 int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 {
 
@@ -3596,10 +3816,8 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 				if (!cache) {
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_assign_chunk_cache(dev, cache,
+								 in, chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 					cache->n_bytes = 0;
@@ -3722,10 +3940,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_assign_chunk_cache(dev, cache,
+								 in, chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 				} else if (cache &&
@@ -3755,7 +3971,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_mark_cache_clean(dev, cache);
 					}
 
 				} else {
@@ -4779,6 +4995,7 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	int init_failed = 0;
 	unsigned x;
 	int bits;
+	int i;
 
 	yaffs_trace(YAFFS_TRACE_TRACING, "yaffs: yaffs_guts_initialise()" );
 
@@ -4946,7 +5163,6 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->passive_gc_count = 0;
 	dev->oldest_dirty_gc_count = 0;
 	dev->bg_gcs = 0;
-	dev->gc_block_finder = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
 	dev->n_deleted_files = 0;
@@ -4971,8 +5187,15 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->cache = NULL;
 	dev->gc_cleanup_list = NULL;
 
+	INIT_LIST_HEAD(&dev->cache_lru);
+	INIT_LIST_HEAD(&dev->cache_free);
+	INIT_LIST_HEAD(&dev->cache_dirty);
+	dev->n_dirty_caches = 0;
+	init_waitqueue_head(&dev->unlocked_read_wait);
+	for (i = 0; i < YAFFS_NCACHE_BUCKETS; i++)
+		INIT_LIST_HEAD(&dev->cache_bucket[i]);
+
 	if (!init_failed && dev->param.n_caches > 0) {
-		int i;
 		void *buf;
 		int cache_bytes =
 		    dev->param.n_caches * sizeof(struct yaffs_cache);
@@ -4989,15 +5212,15 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			INIT_LIST_HEAD(&dev->cache[i].dirty_link);
+			list_add_tail(&dev->cache[i].lru, &dev->cache_free);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
@@ -5077,6 +5300,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	yaffs_gc_index_rebuild(dev);
+
 	/* Zero out stats */
 	dev->n_page_reads = 0;
 	dev->n_page_writes = 0;
@@ -5162,21 +5387,13 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 	/* This is what we report to the outside world */
 
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Now subtract the number of dirty chunks in the cache */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
@@ -83,7 +83,8 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
+#define YAFFS_NCACHE_BUCKETS		128	/* power of 2 */
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -114,9 +115,11 @@
 
 /* ChunkCache is used for short read/write operations.*/
 struct yaffs_cache {
+	struct list_head hash_link;	/* in dev->cache_bucket, if in use */
+	struct list_head lru;		/* in dev->cache_lru or cache_free */
+	struct list_head dirty_link;	/* in dev->cache_dirty, if dirty */
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -516,8 +519,7 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -675,7 +677,6 @@ struct yaffs_dev {
 
 	unsigned has_pending_prioritised_gc;	/* We think this device might have pending prioritised gcs */
 	unsigned gc_disable;
-	unsigned gc_block_finder;
 	unsigned gc_dirtiest;
 	unsigned gc_pages_in_use;
 	unsigned gc_not_done;
@@ -683,6 +684,15 @@ struct yaffs_dev {
 	unsigned gc_chunk;
 	unsigned gc_skip;
 
+	/* GC candidate index, see yaffs_gc_index_update().
+	 * FULL blocks are filed in gc_bucket[] by the number of chunks
+	 * still live in them, or on gc_prio if gc_prioritise is set.
+	 */
+	struct list_head *gc_link;	/* one per block, parallels block_info */
+	struct list_head *gc_bucket;	/* chunks_per_block entries */
+	struct list_head gc_prio;
+	int gc_index_alt;
+
 	/* Special directories */
 	struct yaffs_obj *root_dir;
 	struct yaffs_obj *lost_n_found;
@@ -696,7 +706,20 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head cache_bucket[YAFFS_NCACHE_BUCKETS];
+	struct list_head cache_lru;	/* in use, least recently used first */
+	struct list_head cache_free;
+	/* dirty chunks, grouped by object and in chunk id order within it */
+	struct list_head cache_dirty;
+	int n_dirty_caches;
+
+	/* Whole chunk reads issued without the device lock held, counted
+	 * per block, see yaffs_file_rd_map(). A block is not erased while
+	 * any are in flight on it.
+	 */
+	atomic_t *block_reads;	/* one per block, parallels block_info */
+	int block_reads_alt;
+	wait_queue_head_t unlocked_read_wait;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -810,6 +833,11 @@ unsigned yaffs_get_obj_type(struct yaffs_obj *obj);
 int yaffs_get_obj_link_count(struct yaffs_obj *obj);
 
 /* File operations */
+int yaffs_file_rd_map(struct yaffs_obj *in, loff_t offset, int n_bytes,
+		      int *nand_chunks);
+void yaffs_unlocked_read_done(struct yaffs_dev *dev, const int *nand_chunks,
+			      int n_chunks);
+void yaffs_wait_unlocked_reads(struct yaffs_dev *dev, int block_no);
 int yaffs_file_rd(struct yaffs_obj *obj, u8 * buffer, loff_t offset,
 		  int n_bytes);
 int yaffs_wr_file(struct yaffs_obj *obj, const u8 * buffer, loff_t offset,
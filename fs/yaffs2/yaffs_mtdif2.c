@@ -84,6 +84,24 @@ int nandmtd2_write_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		return YAFFS_FAIL;
 }
 
+/*
+ * Reads the data of a chunk only. Unlike nandmtd2_read_chunk_tags() this
+ * uses no per device buffer and touches no device state, so it may be
+ * called without the device lock. ECC errors are returned, not handled.
+ */
+int nandmtd2_read_chunk_data(struct yaffs_dev *dev, int nand_chunk,
+			     u8 * data)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	size_t dummy;
+	loff_t addr;
+
+	nand_chunk -= dev->chunk_offset;
+	addr = ((loff_t) nand_chunk) * dev->param.total_bytes_per_chunk;
+
+	return mtd->read(mtd, addr, dev->data_bytes_per_chunk, &dummy, data);
+}
+
 int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 			     u8 * data, struct yaffs_ext_tags *tags)
 {
@@ -110,6 +110,9 @@ int yaffs_erase_block(struct yaffs_dev *dev, int flash_block)
 {
 	int result;
 
+	/* Reads started without the device lock may still be on this block */
+	yaffs_wait_unlocked_reads(dev, flash_block);
+
 	flash_block -= dev->block_offset;
 
 	dev->n_erasures++;
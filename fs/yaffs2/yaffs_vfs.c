@@ -97,6 +97,7 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_n_caches = 10;
 
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
@@ -104,6 +105,7 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_n_caches, uint, 0644);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -1125,6 +1127,49 @@ static void yaffs_touch_super(struct yaffs_dev *dev)
 		sb->s_dirt = 1;
 }
 
+/*
+ * Read a page of file data holding the gross lock only to look up where its
+ * chunks are, not across the flash reads themselves. Mapping still takes the
+ * gross lock, so a read waits for any writer or gc step that holds it; what
+ * this buys is that the lock is not held during the read's own flash I/O,
+ * so other reads and writers can use it meanwhile (except an erase of a
+ * block being read, which waits for those reads).
+ * Returns -EAGAIN if the page has to be read with the lock held, which is
+ * also how ECC errors get handed over to yaffs to deal with.
+ */
+static int yaffs_readpage_unlocked(struct yaffs_obj *obj, u8 * pg_buf,
+				   loff_t offset)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	int nand_chunks[PAGE_CACHE_SIZE / YAFFS_MIN_YAFFS2_CHUNK_SIZE];
+	int n_chunks;
+	int ret = 0;
+	int i;
+
+	if (PAGE_CACHE_SIZE > dev->data_bytes_per_chunk *
+			      ARRAY_SIZE(nand_chunks))
+		return -EAGAIN;
+
+	yaffs_gross_lock(dev);
+	n_chunks = yaffs_file_rd_map(obj, offset, PAGE_CACHE_SIZE,
+				     nand_chunks);
+	yaffs_gross_unlock(dev);
+
+	if (!n_chunks)
+		return -EAGAIN;
+
+	for (i = 0; i < n_chunks && !ret; i++) {
+		if (nand_chunks[i] < 0)
+			memset(pg_buf, 0, dev->data_bytes_per_chunk);
+		else if (nandmtd2_read_chunk_data(dev, nand_chunks[i], pg_buf))
+			ret = -EAGAIN;
+		pg_buf += dev->data_bytes_per_chunk;
+	}
+
+	yaffs_unlocked_read_done(dev, nand_chunks, n_chunks);
+	return ret;
+}
+
 static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 {
 	/* Lifted from jffs2 */
@@ -1153,12 +1198,17 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	ret = yaffs_readpage_unlocked(obj, pg_buf,
+				      pg->index << PAGE_CACHE_SHIFT);
+	if (ret == -EAGAIN) {
+		yaffs_gross_lock(dev);
 
-	ret = yaffs_file_rd(obj, pg_buf,
-			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
+		ret = yaffs_file_rd(obj, pg_buf,
+				    pg->index << PAGE_CACHE_SHIFT,
+				    PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+		yaffs_gross_unlock(dev);
+	}
 
 	if (ret >= 0)
 		ret = 0;
@@ -2238,7 +2288,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	param->n_caches = (options.no_cache) ? 0 : yaffs_n_caches;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
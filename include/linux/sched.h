@@ -1570,6 +1570,15 @@ struct task_struct {
 #ifdef CONFIG_HAVE_HW_BREAKPOINT
 	atomic_t ptrace_bp_refcnt;
 #endif
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* lowmemorykiller index of killable processes by oom_adj */
+	struct lowmem_task {
+		struct list_head node;	/* in lowmem_adj_list[adj] */
+		int adj;
+		int tasksize;		/* cached, in pages */
+		unsigned long tasksize_time; /* jiffies when sampled */
+	} lowmem;
+#endif
 };
 
 /* Future-safe accessor for struct task_struct's cpus_allowed. */
@@ -97,7 +97,8 @@ int smsg_ch_close(uint8_t dst, uint8_t channel, int timeout);
  *
  * @dst: dest processor ID
  * @msg: smsg body to be sent
- * @timeout: milliseconds, 0 means no wait, -1 means unlimited
+ * @timeout: milliseconds, 0 means no wait and never sleeps, so it may be
+ *	used from atomic context, -1 means unlimited
  * @return: 0 on success, <0 on failue
  */
 int smsg_send(uint8_t dst, struct smsg *msg, int timeout);
@@ -136,7 +137,8 @@ static inline void smsg_open_ack(uint8_t dst, uint16_t channel)
 /**
  * smem_alloc -- allocate shared memory block
  *
- * @size: size to be allocated, page-aligned
+ * @size: size to be allocated, sizes up to half a page are packed into
+ *        shared pages by size class, larger sizes are page-aligned
  * @return: phys addr or 0 if failed
  */
 uint32_t smem_alloc(uint32_t size);
@@ -149,6 +151,23 @@ uint32_t smem_alloc(uint32_t size);
  */
 void smem_free(uint32_t addr, uint32_t size);
 
+/**
+ * smem_map -- map shared memory block into kernel space
+ *
+ * @addr: smem phys addr, page-aligned
+ * @size: size to be mapped
+ * @return: virt addr or NULL if failed
+ */
+void *smem_map(uint32_t addr, uint32_t size);
+
+/**
+ * smem_unmap -- unmap shared memory block from smem_map
+ *
+ * @virt: virt addr from smem_map
+ * @addr: smem phys addr
+ */
+void smem_unmap(void *virt, uint32_t addr);
+
 /* ****************************************************************** */
 /* SBUF Interfaces */
 
@@ -215,6 +234,30 @@ int sbuf_read(uint8_t dst, uint8_t channel, uint32_t bufid,
 int sbuf_poll_wait(uint8_t dst, uint8_t channel, uint32_t bufid,
 		struct file *file, poll_table *wait);
 
+/* sbuf ring mode flags */
+#define SBUF_MODE_SPSC		0x01	/* single writer & reader, no locks */
+#define SBUF_MODE_COALESCE	0x02	/* coalesce wrptr/rdptr doorbells */
+
+/**
+ * sbuf_set_mode -- set fast path options of a ring buffer
+ *
+ * SBUF_MODE_SPSC skips the ring mutexes, the caller must guarantee that
+ * only one writer and one reader use the ring at a time.
+ * SBUF_MODE_COALESCE only sends a doorbell when the peer may be waiting
+ * (ring was empty for wrptr, full for rdptr), or once db_bytes are
+ * pending, or db_delay ms after the last skipped doorbell.
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @bufid: buffer ID
+ * @mode: SBUF_MODE_xxx flags, 0 for the default locked mode
+ * @db_bytes: pending bytes to force a doorbell, 0 means half the ring
+ * @db_delay: milliseconds to flush a pending doorbell, 0 means default
+ * @return: 0 on success, <0 on failue
+ */
+int sbuf_set_mode(uint8_t dst, uint8_t channel, uint32_t bufid,
+		uint32_t mode, uint32_t db_bytes, uint32_t db_delay);
+
 /**
  * sbuf_status -- get sbuf status
  *
@@ -275,6 +318,15 @@ void sblock_destroy(uint8_t dst, uint8_t channel);
 int sblock_register_notifier(uint8_t dst, uint8_t channel,
 		void (*handler)(int event, void *data), void *data);
 
+/**
+ * sblock_status -- get sblock status
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @return: 0 when ready, <0 when broken
+ */
+int sblock_status(uint8_t dst, uint8_t channel);
+
 /**
  * sblock_get  -- get a free sblock for sender
  *
@@ -286,6 +338,15 @@ int sblock_register_notifier(uint8_t dst, uint8_t channel,
  */
 int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout);
 
+/**
+ * sblock_put  -- put back a gotten sblock which won't be sent
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @blk: the sblock from sblock_get
+ */
+void sblock_put(uint8_t dst, uint8_t channel, struct sblock *blk);
+
 /**
  * sblock_send  -- send a sblock, it should be from sblock_get
  *
@@ -296,6 +357,20 @@ int sblock_get(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout);
  */
 int sblock_send(uint8_t dst, uint8_t channel, struct sblock *blk);
 
+/**
+ * sblock_send_nowait  -- send a sblock without sleeping, for atomic context
+ *
+ * When the smsg txbuf is busy, the send event is deferred to a work item
+ * and further sends fail with -EBUSY until it went out; SBLOCK_NOTIFY_GET
+ * is raised then.
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @blk: the sblock to be sent
+ * @return: 0 on success, -EBUSY if blk was not sent, <0 on other failue
+ */
+int sblock_send_nowait(uint8_t dst, uint8_t channel, struct sblock *blk);
+
 /**
  * sblock_receive  -- receive a sblock, it should be released after it's handled
  *
@@ -307,6 +382,19 @@ int sblock_send(uint8_t dst, uint8_t channel, struct sblock *blk);
  */
 int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout);
 
+/**
+ * sblock_receive_batch  -- receive ready sblocks without waiting or
+ * 		sleeping, so it can be called from softirq context
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @blks: array to return received sblocks, each should be released
+ * @num: max number of sblocks to receive
+ * @return: number of received sblocks (0 if none), <0 on failue
+ */
+int sblock_receive_batch(uint8_t dst, uint8_t channel,
+		struct sblock *blks, int num);
+
 /**
  * sblock_release  -- release a sblock from reveiver
  *
@@ -316,6 +404,18 @@ int sblock_receive(uint8_t dst, uint8_t channel, struct sblock *blk, int timeout
  */
 int sblock_release(uint8_t dst, uint8_t channel, struct sblock *blk);
 
+/**
+ * sblock_release_nowait  -- release a sblock without sleeping, for atomic
+ * 		context; the release event may be sent later from a work item,
+ * 		releases always reach the peer in the order they were made
+ *
+ * @dst: dest processor ID
+ * @channel: channel ID
+ * @return: 0 on success, -ENOSPC if the deferred queue is full and the
+ * 	release was dropped, <0 on other failue
+ */
+int sblock_release_nowait(uint8_t dst, uint8_t channel, struct sblock *blk);
+
 
 /* ****************************************************************** */
 /* TODO: SRPC interfaces */
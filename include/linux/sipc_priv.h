@@ -14,17 +14,27 @@
 #ifndef __SIPC_PRIV_H
 #define __SIPC_PRIV_H
 
+/* default cached msgs per channel, must be 2^n */
 #define SMSG_CACHE_NR		64
 
+/* msgs dispatched before waking the receivers of a batch */
+#define SMSG_IRQ_BUDGET		32
+
 struct smsg_channel {
 	/* wait queue for recv-buffer */
 	wait_queue_head_t	rxwait;
 	struct mutex		rxlock;
 
-	/* cached msgs for recv */
+	/* cached msgs for recv, cache_nr must be 2^n */
 	uint32_t		wrptr[1];
 	uint32_t		rdptr[1];
-	struct smsg		caches[SMSG_CACHE_NR];
+	uint32_t		cache_nr;
+	struct smsg		*caches;
+
+	/* statistics */
+	uint32_t		received;
+	uint32_t		dropped;
+	uint32_t		hiwater;
 };
 
 /* smsg ring-buffer between AP/CP ipc */
@@ -57,8 +67,13 @@ struct smsg_ipc {
 	/* sipc ctrl thread */
 	struct task_struct	*thread;
 
-	/* lock for send-buffer */
-	struct mutex		txlock;
+	/* dispatcher statistics */
+	uint32_t		rx_batches;
+	uint32_t		rx_max_batch;
+	uint32_t		rx_invalid;
+
+	/* lock for send-buffer, never held across a sleep */
+	spinlock_t		txlock;
 
 	/* all fixed channels receivers */
 	struct smsg_channel	*channels[SMSG_CH_NR];
@@ -75,6 +90,15 @@ struct smsg_ipc {
 int smsg_ipc_create(uint8_t dst, struct smsg_ipc *ipc);
 int smsg_ipc_destroy(uint8_t dst);
 
+/* smsg dispatcher, platform code may override irq_handler/irq_threadfn */
+irqreturn_t smsg_irq_handler(int irq, void *dev_id);
+irqreturn_t smsg_irq_threadfn(int irq, void *dev_id);
+
+#ifdef CONFIG_DEBUG_FS
+/* debugfs dir shared by all sipc modules */
+struct dentry *sipc_debugfs_root(void);
+#endif
+
 /* initialize smem pool for AP/CP */
 int smem_init(uint32_t addr, uint32_t size);
 
@@ -21,6 +21,7 @@ struct spipe_init_data {
 	uint32_t		ringnr;
 	uint32_t		txbuf_size;
 	uint32_t		rxbuf_size;
+	uint32_t		mode;		/* SBUF_MODE_xxx for all rings */
 };
 
 #endif
@@ -52,4 +52,10 @@ enum ION_SPRD_CUSTOM_CMD {
 	ION_SPRD_CUSTOM_MSYNC
 };
 
+#ifdef __KERNEL__
+struct ion_client;
+
+struct ion_client *sprd_ion_client_create(const char *name);
+#endif
+
 #endif /* _ION_SPRD_H */
@@ -0,0 +1,172 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Greedy single-pass compressor producing the LZ4 block format: a
+ *  sequence of (token, literal length, literals, match offset, match
+ *  length) records, see http://code.google.com/p/lz4/ for the format.
+ *  It favours speed over ratio and is paired with a decompressor that
+ *  is considerably faster than LZO's.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/* Number of identical bytes at ip and ref, not going past limit */
+static inline size_t lz4_count(const unsigned char *ip,
+		const unsigned char *ref, const unsigned char *limit)
+{
+	const unsigned char *start = ip;
+
+	while (ip + sizeof(u32) <= limit) {
+		u32 diff = LZ4_READ32(ip) ^ LZ4_READ32(ref);
+
+		if (diff) {
+#ifdef __LITTLE_ENDIAN
+			return ip - start + (__ffs(diff) >> 3);
+#else
+			return ip - start + ((31 - __fls(diff)) >> 3);
+#endif
+		}
+		ip += sizeof(u32);
+		ref += sizeof(u32);
+	}
+	while (ip < limit && *ip == *ref) {
+		ip++;
+		ref++;
+	}
+	return ip - start;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	u32 *hash_table = wrkmem;
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	const unsigned char *ref;
+	unsigned char *op = dst;
+	unsigned char *token;
+	size_t len;
+	u32 h;
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	memset(hash_table, 0, LZ4_MEM_COMPRESS);
+	hash_table[LZ4_HASH(LZ4_READ32(ip))] = 0;
+	ip++;
+
+	for (;;) {
+		unsigned int attempts = (1U << SKIPSTRENGTH) + 3;
+		const unsigned char *forward = ip;
+
+		/* Find a match */
+		do {
+			ip = forward;
+			forward += attempts++ >> SKIPSTRENGTH;
+			if (unlikely(ip > mflimit))
+				goto last_literals;
+
+			h = LZ4_HASH(LZ4_READ32(ip));
+			ref = src + hash_table[h];
+			hash_table[h] = ip - src;
+		} while (ip - ref > MAX_DISTANCE ||
+			 LZ4_READ32(ref) != LZ4_READ32(ip));
+
+		/* Catch up */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		/* Encode literal length and copy literals */
+		len = ip - anchor;
+		token = op++;
+		if (len >= RUN_MASK) {
+			*token = RUN_MASK << ML_BITS;
+			op = lz4_put_length(op, len - RUN_MASK);
+		} else {
+			*token = len << ML_BITS;
+		}
+		memcpy(op, anchor, len);
+		op += len;
+
+next_match:
+		/* Encode offset */
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		/* Encode match length */
+		ip += MINMATCH;
+		ref += MINMATCH;
+		len = lz4_count(ip, ref, matchlimit);
+		ip += len;
+		if (len >= ML_MASK) {
+			*token += ML_MASK;
+			op = lz4_put_length(op, len - ML_MASK);
+		} else {
+			*token += len;
+		}
+
+		anchor = ip;
+		if (ip > mflimit)
+			break;
+
+		/* Fill table */
+		hash_table[LZ4_HASH(LZ4_READ32(ip - 2))] = ip - 2 - src;
+
+		/* Test next position for an immediate match */
+		h = LZ4_HASH(LZ4_READ32(ip));
+		ref = src + hash_table[h];
+		hash_table[h] = ip - src;
+		if (ip - ref <= MAX_DISTANCE &&
+		    LZ4_READ32(ref) == LZ4_READ32(ip)) {
+			token = op++;
+			*token = 0;
+			goto next_match;
+		}
+
+		ip++;
+	}
+
+last_literals:
+	/* Encode last literals */
+	len = iend - anchor;
+	if (len >= RUN_MASK) {
+		*op++ = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, len - RUN_MASK);
+	} else {
+		*op++ = len << ML_BITS;
+	}
+	memcpy(op, anchor, len);
+	op += len;
+
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 compressor");
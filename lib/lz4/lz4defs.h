@@ -0,0 +1,30 @@
+/*
+ *  lz4defs.h -- common and architecture specific defines for the kernel usage
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define MINMATCH	4
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+/* The last match must start at least 12 bytes before the end of block */
+#define MFLIMIT		12
+/* The last 5 bytes of a block are always literals */
+#define LASTLITERALS	5
+
+#define MAX_DISTANCE	((1 << 16) - 1)
+
+#define HASH_LOG	12
+#define HASH_SIZE	(1 << HASH_LOG)
+
+/* Speed up the search on incompressible data */
+#define SKIPSTRENGTH	6
+
+#define LZ4_READ32(p)	get_unaligned((const u32 *)(p))
+#define LZ4_HASH(seq)	(((seq) * 2654435761U) >> (32 - HASH_LOG))